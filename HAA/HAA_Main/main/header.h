@@ -102,6 +102,8 @@
 #define PWM_FREQ                            "q"
 #define PWM_ZEROCROSSING_ARRAY_SET          "zc"
 #define ENABLE_HOMEKIT                      "h"
+#define HOMEKIT_EVENT_INTERVAL              "ei"
+#define HOMEKIT_EVENT_TELEMETRY             "et"
 #define HOMEKIT_SERVER_MAX_CLIENTS          "h"
 #define HOMEKIT_SERVER_MAX_CLIENTS_DEFAULT  (20)
 #define HOMEKIT_SERVER_MAX_CLIENTS_MAX      (20)
@@ -642,7 +642,7 @@ void reboot_task() {
 void reboot_haa() {
     if (xTaskCreate(reboot_task, "REB", REBOOT_TASK_SIZE, NULL, REBOOT_TASK_PRIORITY, NULL) != pdPASS) {
         ERROR("New REB");
-        homekit_remove_oldest_client();
+        homekit_evict_client();
     }
 }
 
@@ -717,7 +717,7 @@ void ntp_timer_worker(TimerHandle_t xTimer) {
             raven_ntp_get_time_t();
         } else if (xTaskCreate(ntp_task, "NTP", NTP_TASK_SIZE, NULL, NTP_TASK_PRIORITY, NULL) != pdPASS) {
             ERROR("New NTP");
-            homekit_remove_oldest_client();
+            homekit_evict_client();
             raven_ntp_get_time_t();
         }
     } else {
@@ -863,7 +863,7 @@ void wifi_watchdog() {
         if (main_config.wifi_ping_max_errors != 255 && !homekit_is_pairing() && !main_config.network_is_busy) {
             if (xTaskCreate(wifi_ping_gw_task, "GWP", WIFI_PING_GW_TASK_SIZE, NULL, WIFI_PING_GW_TASK_PRIORITY, NULL) != pdPASS) {
                 ERROR("New GWP");
-                homekit_remove_oldest_client();
+                homekit_evict_client();
             }
         }
         
@@ -879,7 +879,7 @@ void wifi_watchdog() {
         
         if (xTaskCreate(wifi_reconnection_task, "RCN", WIFI_RECONNECTION_TASK_SIZE, (void*) force_disconnect, WIFI_RECONNECTION_TASK_PRIORITY, NULL) != pdPASS) {
             ERROR("New RCN");
-            homekit_remove_oldest_client();
+            homekit_evict_client();
         }
     }
 }
@@ -941,7 +941,7 @@ void ping_task_timer_worker() {
     if (!main_config.network_is_busy && !homekit_is_pairing()) {
         if (xTaskCreate(ping_task, "PIN", PING_TASK_SIZE, NULL, PING_TASK_PRIORITY, NULL) != pdPASS) {
             ERROR("New PIN");
-            homekit_remove_oldest_client();
+            homekit_evict_client();
         }
     } else {
         ERROR("PING busy %i, HK pair %i", main_config.network_is_busy, homekit_is_pairing());
@@ -1022,8 +1022,76 @@ void save_states_callback() {
     esp_timer_start(SAVE_STATES_TIMER);
 }
 
+void homekit_event_pending_notify(ch_group_t* ch_group, const uint32_t pending) {
+    if (main_config.wifi_status == WIFI_STATUS_CONNECTED && main_config.enable_homekit_server) {
+        for (int i = 0; i < ch_group->chs && i < 32; i++) {
+            if (pending & (1UL << i)) {
+                homekit_characteristic_notify(ch_group->ch[i]);
+            }
+        }
+    }
+}
+
+// Window is closed only by its timer, so it is not kept open if timer can not be started
+void homekit_event_window_start(ch_group_t* ch_group) {
+    if (esp_timer_start(ch_group->homekit_event_timer) != pdPASS) {
+        taskENTER_CRITICAL();
+        const uint32_t pending = ch_group->homekit_event_pending;
+        ch_group->homekit_event_pending = 0;
+        ch_group->homekit_event_window = false;
+        taskEXIT_CRITICAL();
+        
+        ERROR("<%i> Ev window", ch_group->serv_index);
+        homekit_event_pending_notify(ch_group, pending);
+    }
+}
+
+void homekit_event_window_timer(TimerHandle_t xTimer) {
+    ch_group_t* ch_group = (ch_group_t*) pvTimerGetTimerID(xTimer);
+    
+    taskENTER_CRITICAL();
+    const uint32_t pending = ch_group->homekit_event_pending;
+    ch_group->homekit_event_pending = 0;
+    ch_group->homekit_event_window = (pending != 0);
+    taskEXIT_CRITICAL();
+    
+    if (pending) {
+        // Last values of burst are sent, and a new window is opened
+        homekit_event_pending_notify(ch_group, pending);
+        homekit_event_window_start(ch_group);
+    }
+}
+
 void homekit_characteristic_notify_safe(homekit_characteristic_t *ch) {
-    if (ch_group_find(ch)->homekit_enabled && main_config.wifi_status == WIFI_STATUS_CONNECTED && main_config.enable_homekit_server) {
+    ch_group_t* ch_group = ch_group_find(ch);
+    if (ch_group->homekit_enabled && main_config.wifi_status == WIFI_STATUS_CONNECTED && main_config.enable_homekit_server) {
+        if (ch_group->homekit_event_timer) {
+            int index = 0;
+            while (index < ch_group->chs && index < 32 && ch_group->ch[index] != ch) {
+                index++;
+            }
+            
+            if (index < ch_group->chs && index < 32) {
+                bool send = false;
+                
+                taskENTER_CRITICAL();
+                if (!ch_group->homekit_event_window) {
+                    ch_group->homekit_event_window = true;
+                    send = true;
+                } else {
+                    ch_group->homekit_event_pending |= (1UL << index);
+                }
+                taskEXIT_CRITICAL();
+                
+                if (send) {
+                    homekit_characteristic_notify(ch);
+                    homekit_event_window_start(ch_group);
+                }
+                
+                return;
+            }
+        }
+        
         homekit_characteristic_notify(ch);
     }
 }
@@ -1499,7 +1567,7 @@ void power_monitor_timer_worker(TimerHandle_t xTimer) {
         if (!homekit_is_pairing()) {
             if (xTaskCreate(power_monitor_task, "PM", POWER_MONITOR_TASK_SIZE, (void*) pvTimerGetTimerID(xTimer), POWER_MONITOR_TASK_PRIORITY, NULL) != pdPASS) {
                 ERROR("New PM");
-                homekit_remove_oldest_client();
+                homekit_evict_client();
             }
         } else {
             ERROR("HK pair");
@@ -1783,7 +1851,7 @@ void set_zones_timer_worker(TimerHandle_t xTimer) {
     if (!homekit_is_pairing()) {
         if (xTaskCreate(set_zones_task, "iAZ", SET_ZONES_TASK_SIZE, (void*) pvTimerGetTimerID(xTimer), SET_ZONES_TASK_PRIORITY, NULL) != pdPASS) {
             ERROR("New iAZ");
-            homekit_remove_oldest_client();
+            homekit_evict_client();
             esp_timer_start(xTimer);
         }
     } else {
@@ -2019,7 +2087,7 @@ void process_th_task(void* args) {
 void process_th_timer(TimerHandle_t xTimer) {
     if (xTaskCreate(process_th_task, "TH", PROCESS_TH_TASK_SIZE, (void*) pvTimerGetTimerID(xTimer), PROCESS_TH_TASK_PRIORITY, NULL) != pdPASS) {
         ERROR("New TH");
-        homekit_remove_oldest_client();
+        homekit_evict_client();
         esp_timer_start(xTimer);
     }
 }
@@ -2365,7 +2433,7 @@ void process_hum_task(void* args) {
 void process_humidif_timer(TimerHandle_t xTimer) {
     if (xTaskCreate(process_hum_task, "HUM", PROCESS_HUMIDIF_TASK_SIZE, (void*) pvTimerGetTimerID(xTimer), PROCESS_HUMIDIF_TASK_PRIORITY, NULL) != pdPASS) {
         ERROR("New HUM");
-        homekit_remove_oldest_client();
+        homekit_evict_client();
         esp_timer_start(xTimer);
     }
 }
@@ -2725,7 +2793,7 @@ void temperature_timer_worker(TimerHandle_t xTimer) {
     if (!homekit_is_pairing()) {
         if (xTaskCreate(temperature_task, "TEM", TEMPERATURE_TASK_SIZE, (void*) pvTimerGetTimerID(xTimer), TEMPERATURE_TASK_PRIORITY, NULL) != pdPASS) {
             ERROR("New TEM");
-            homekit_remove_oldest_client();
+            homekit_evict_client();
         }
     } else {
         ERROR("HK pair");
@@ -3311,7 +3379,7 @@ void rgbw_set_timer_worker() {
             
             free(colors);
         } else {
-            homekit_remove_oldest_client();
+            homekit_evict_client();
             break;
         }
         
@@ -3474,7 +3542,7 @@ void lightbulb_task_timer(TimerHandle_t xTimer) {
         lightbulb_group_t* lightbulb_group = lightbulb_group_find(ch_group->ch[0]);
         lightbulb_group->lightbulb_task_running = false;
         ERROR("New LB");
-        homekit_remove_oldest_client();
+        homekit_evict_client();
         esp_timer_start(xTimer);
     }
 }
@@ -3626,7 +3694,7 @@ void autodimmer_call(homekit_characteristic_t* ch0, const homekit_value_t value)
             
             if (xTaskCreate(autodimmer_task, "DIM", AUTODIMMER_TASK_SIZE, (void*) ch0, AUTODIMMER_TASK_PRIORITY, NULL) != pdPASS) {
                 ERROR("<%i> New DIM", ch_group->serv_index);
-                homekit_remove_oldest_client();
+                homekit_evict_client();
             }
         } else {
             esp_timer_start(LIGHTBULB_AUTODIMMER_TIMER);
@@ -4133,7 +4201,7 @@ void process_fan_task(void* args) {
 void process_fan_timer(TimerHandle_t xTimer) {
     if (xTaskCreate(process_fan_task, "FAN", PROCESS_FAN_TASK_SIZE, (void*) pvTimerGetTimerID(xTimer), PROCESS_FAN_TASK_PRIORITY, NULL) != pdPASS) {
         ERROR("New FAN");
-        homekit_remove_oldest_client();
+        homekit_evict_client();
         esp_timer_start(xTimer);
     }
 }
@@ -4237,7 +4305,7 @@ void light_sensor_timer_worker(TimerHandle_t xTimer) {
     if (!homekit_is_pairing()) {
         if (xTaskCreate(light_sensor_task, "LUX", LIGHT_SENSOR_TASK_SIZE, (void*) pvTimerGetTimerID(xTimer), LIGHT_SENSOR_TASK_PRIORITY, NULL) != pdPASS) {
             ERROR("New LUX");
-            homekit_remove_oldest_client();
+            homekit_evict_client();
         }
     } else {
         ERROR("HK pair");
@@ -4949,7 +5017,7 @@ void free_monitor_task(void* args) {
                                             
                                             free(method);
                                             
-                                            homekit_remove_oldest_client();
+                                            homekit_evict_client();
                                             errors++;
                                             
                                             if (errors < 5) {
@@ -5219,7 +5287,7 @@ void free_monitor_timer_worker(TimerHandle_t xTimer) {
         if (!homekit_is_pairing()) {
             if (xTaskCreate(free_monitor_task, "FM", FREE_MONITOR_TASK_SIZE, (void*) pvTimerGetTimerID(xTimer), FREE_MONITOR_TASK_PRIORITY, NULL) != pdPASS) {
                 ERROR("New FM");
-                homekit_remove_oldest_client();
+                homekit_evict_client();
             }
         } else {
             ERROR("HK pair");
@@ -5258,7 +5326,7 @@ void recv_uart_task() {
         if (xTaskCreate(free_monitor_task, "FM", FREE_MONITOR_TASK_SIZE, NULL, FREE_MONITOR_TASK_PRIORITY, NULL) != pdPASS) {
             reset_uart_buffer();
             ERROR("New FM");
-            homekit_remove_oldest_client();
+            homekit_evict_client();
         }
     } else {
         reset_uart_buffer();
@@ -5907,7 +5975,7 @@ void irrf_tx_task(void* pvParameters) {
                 
                 ir_code = malloc(sizeof(uint16_t) * ir_code_len);
                 if (!ir_code) {
-                    homekit_remove_oldest_client();
+                    homekit_evict_client();
                     errors++;
                     
                     if (errors < ACTION_TASK_MAX_ERRORS) {
@@ -6229,7 +6297,7 @@ void action_task_timer(TimerHandle_t xTimer) {
         (action_task->type == ACTION_TASK_TYPE_NETWORK &&
             xTaskCreate(net_action_task, "NET", NETWORK_ACTION_TASK_SIZE, action_task, NETWORK_ACTION_TASK_PRIORITY, NULL) != pdPASS)) {
         action_task->errors++;
-        homekit_remove_oldest_client();
+        homekit_evict_client();
         
         ERROR("<%i> AT %i", action_task->ch_group->serv_index, action_task->type);
         
@@ -6580,7 +6648,7 @@ void do_actions(ch_group_t* ch_group, uint8_t action) {
                                 FM_OVERRIDE_VALUE = action_serv_manager->value;
                                 if (xTaskCreate(free_monitor_task, "FM", FREE_MONITOR_TASK_SIZE, (void*) ch_group, FREE_MONITOR_TASK_PRIORITY, NULL) != pdPASS) {
                                     ERROR("New FM");
-                                    homekit_remove_oldest_client();
+                                    homekit_evict_client();
                                 }
                             }
                             break;
@@ -11565,6 +11633,8 @@ void normal_mode_init() {
         
         INFO("\n* SERV %i (%i)", service_numerator, serv_type);
         
+        ch_group_t* last_ch_group = main_config.ch_groups;
+        
         if (serv_type == SERV_TYPE_BUTTON ||
             serv_type == SERV_TYPE_DOORBELL) {
             new_button_event(acc_count, serv_count, total_services, json_accessory, serv_type);
@@ -11640,6 +11710,46 @@ void normal_mode_init() {
             new_switch(acc_count, serv_count, total_services, json_accessory, serv_type);
         }
         
+        // HomeKit events minimum interval
+        if (cJSON_GetObjectItemCaseSensitive(json_accessory, HOMEKIT_EVENT_INTERVAL) != NULL) {
+            const uint32_t event_interval = cJSON_GetObjectItemCaseSensitive(json_accessory, HOMEKIT_EVENT_INTERVAL)->valuedouble * 1000.f;
+            if (event_interval > 0) {
+                for (ch_group_t* ch_group = main_config.ch_groups; ch_group && ch_group != last_ch_group; ch_group = ch_group->next) {
+                    ch_group->homekit_event_timer = esp_timer_create(event_interval, false, (void*) ch_group, homekit_event_window_timer);
+                }
+                
+                INFO("Ev interval %i", event_interval);
+            }
+        }
+        
+        // HomeKit events priority: measurements are telemetry, batched by HAP server after interactive events
+        bool event_telemetry = (serv_type == SERV_TYPE_AIR_QUALITY ||
+                                serv_type == SERV_TYPE_TEMP_SENSOR ||
+                                serv_type == SERV_TYPE_HUM_SENSOR ||
+                                serv_type == SERV_TYPE_TH_SENSOR ||
+                                serv_type == SERV_TYPE_LIGHT_SENSOR ||
+                                serv_type == SERV_TYPE_BATTERY ||
+                                serv_type == SERV_TYPE_POWER_MONITOR ||
+                                serv_type == SERV_TYPE_FREE_MONITOR ||
+                                serv_type == SERV_TYPE_FREE_MONITOR_ACCUMULATVE ||
+                                serv_type == SERV_TYPE_DATA_HISTORY);
+        
+        if (cJSON_GetObjectItemCaseSensitive(json_accessory, HOMEKIT_EVENT_TELEMETRY) != NULL) {
+            event_telemetry = (bool) cJSON_GetObjectItemCaseSensitive(json_accessory, HOMEKIT_EVENT_TELEMETRY)->valuedouble;
+        }
+        
+        if (event_telemetry) {
+            for (ch_group_t* ch_group = main_config.ch_groups; ch_group && ch_group != last_ch_group; ch_group = ch_group->next) {
+                for (unsigned int i = 0; i < ch_group->chs; i++) {
+                    if (ch_group->ch[i]) {
+                        ch_group->ch[i]->telemetry = true;
+                    }
+                }
+            }
+            
+            INFO("Ev telemetry");
+        }
+        
         show_freeheap();
     }
     
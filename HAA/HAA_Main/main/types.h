@@ -173,6 +173,10 @@ typedef struct _ch_group {
     TimerHandle_t timer;
     TimerHandle_t timer2;
     
+    TimerHandle_t homekit_event_timer;
+    uint32_t homekit_event_pending;     // Bitmask of ch indexes with delayed event
+    bool homekit_event_window;          // Not a bitfield: written from several tasks
+    
     char* ir_protocol;
     
     action_copy_t* action_copy;
@@ -25,6 +25,11 @@ ifdef component_compile_rules
     #HOMEKIT_OVERCLOCK_PAIR_SETUP
     # Define it to enable overclock on pair-verify function.
     #HOMEKIT_OVERCLOCK_PAIR_VERIFY ?= 0
+    # Define HOMEKIT_STATS in homekit_CFLAGS to collect server latency statistics.
+    #HOMEKIT_STATS
+    # Define HOMEKIT_ACCESSORIES_CACHE_MAX_SIZE in homekit_CFLAGS to cache GET /accessories
+    # response template in RAM, up to given size (e.g. 8192). Disabled by default.
+    #HOMEKIT_ACCESSORIES_CACHE_MAX_SIZE
 
     INC_DIRS += $(homekit_ROOT)/include
 
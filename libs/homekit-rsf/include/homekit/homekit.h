@@ -55,8 +55,34 @@ void homekit_server_init(homekit_server_config_t *config);
 void homekit_set_max_clients(const unsigned int clients);
 #endif // HOMEKIT_CHANGE_MAX_CLIENTS
 
-// Remove oldest client to free some DRAM
-void homekit_remove_oldest_client();
+#ifdef HOMEKIT_STATS
+// Server latency and traffic statistics, also printed periodically by logger
+#define HOMEKIT_STATS_VALUE_MAX_LEN         (256)
+homekit_value_t homekit_stats_getter(const homekit_characteristic_t *ch);
+
+#ifndef HOMEKIT_DISABLE_MAXLEN_CHECK
+#define HOMEKIT_STATS_MAX_LEN_              .max_len = (int[]) { HOMEKIT_STATS_VALUE_MAX_LEN },
+#else
+#define HOMEKIT_STATS_MAX_LEN_
+#endif
+
+// Read only custom characteristic with statistics. Usage: HOMEKIT_CHARACTERISTIC(CUSTOM_SERVER_STATS)
+#define HOMEKIT_CHARACTERISTIC_CUSTOM_SERVER_STATS "F00000FF-0218-2017-81BF-AF2B7C833922"
+#define HOMEKIT_DECLARE_CHARACTERISTIC_CUSTOM_SERVER_STATS(...) \
+    .type = HOMEKIT_CHARACTERISTIC_CUSTOM_SERVER_STATS, \
+    .description = "HK Stats", \
+    .format = HOMEKIT_FORMAT_STRING, \
+    .permissions = HOMEKIT_PERMISSIONS_PAIRED_READ, \
+    HOMEKIT_STATS_MAX_LEN_ \
+    .getter_ex = homekit_stats_getter, \
+    ##__VA_ARGS__
+#endif // HOMEKIT_STATS
+
+// Remove client most idle, without subscriptions or admin permissions, to free some DRAM
+void homekit_evict_client();
+
+// Former name of homekit_evict_client()
+#define homekit_remove_oldest_client    homekit_evict_client
 
 // Reset HomeKit accessory server, removing all pairings
 void homekit_server_reset();
@@ -15,6 +15,7 @@
 #define TLVType_Permissions         (0x0B)
 #define TLVType_FragmentData        (0x0C)
 #define TLVType_FragmentLast        (0x0D)
+#define TLVType_SessionID           (0x0E)
 #define TLVType_Flags               (0x13)
 #define TLVType_Separator           (0xFF)
 
@@ -23,6 +24,7 @@
 #define TLVMethod_AddPairing        (3)
 #define TLVMethod_RemovePairing     (4)
 #define TLVMethod_ListPairings      (5)
+#define TLVMethod_PairResume        (6)
 
 typedef unsigned char byte;
 
@@ -166,10 +166,8 @@ typedef struct {
 } homekit_valid_values_ranges_t;
 #endif //HOMEKIT_DISABLE_VALUE_RANGES
 
-typedef struct _homekit_characteristic_subscription {
-    void *context;
-    struct _homekit_characteristic_subscription *next;
-} homekit_characteristic_subscription_t;
+// Max number of clients that can subscribe to events, one bit per client slot
+#define HOMEKIT_SUBSCRIPTION_SLOTS      (32)
 
 
 struct _homekit_characteristic {
@@ -181,7 +179,8 @@ struct _homekit_characteristic {
     homekit_format_t format: 4;
     homekit_unit_t unit: 3;
     homekit_permissions_t permissions: 6;
-    int _align: 3;
+    bool telemetry: 1;          // Events are batched, and sent after interactive ones
+    int _align: 2;
     
     homekit_value_t value;
     
@@ -200,7 +199,12 @@ struct _homekit_characteristic {
     homekit_valid_values_ranges_t valid_values_ranges;
 #endif //HOMEKIT_DISABLE_VALUE_RANGES
     
-    homekit_characteristic_subscription_t* subscriptions;
+    uint32_t subscriptions;     // Bitmask of subscribed client slots
+    uint32_t events_pending;    // Client slots whose event was dropped while they were slow
+    
+    // Already queued in server notifications. Not a bitfield: written by notifying tasks
+    // under critical section, while bitfields above are written without it
+    bool notify_pending;
     
     homekit_value_t (*getter_ex)(const homekit_characteristic_t *ch);
     void (*setter_ex)(homekit_characteristic_t *ch, const homekit_value_t value);
@@ -320,19 +324,19 @@ homekit_characteristic_t *homekit_characteristic_by_aid_and_iid(homekit_accessor
 void homekit_characteristic_notify(homekit_characteristic_t *ch);
 void homekit_characteristic_add_notify_subscription(
     homekit_characteristic_t *ch,
-    void *context
+    const uint8_t slot
 );
 void homekit_characteristic_remove_notify_subscription(
     homekit_characteristic_t *ch,
-    void *context
+    const uint8_t slot
 );
 void homekit_accessories_clear_notify_subscriptions(
     homekit_accessory_t **accessories,
-    void *context
+    const uint8_t slot
 );
 bool homekit_characteristic_has_notify_subscription(
     const homekit_characteristic_t *ch,
-    void *context
+    const uint8_t slot
 );
 
 
@@ -0,0 +1,114 @@
+// JSON serialization throughput of a characteristics body, as written by server:
+// json_stream flushing a 1024 bytes buffer, against formatting same body with snprintf
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "harness.h"
+#include "json.h"
+
+#define CHARACTERISTICS         (40)
+#define ROUNDS                  (20000)
+#define BUFFER_SIZE             (1024)
+
+static uint8_t buffer[BUFFER_SIZE];
+static size_t written;
+
+static double now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static int on_flush(uint8_t *data, size_t size, void *context) {
+    written += size;
+    return 0;
+}
+
+// Characteristic i value is an integer, a float, a boolean or a string
+static void json_body(json_stream *json, const unsigned int round) {
+    json_object_start(json);
+    json_string(json, "characteristics");
+    json_array_start(json);
+
+    for (unsigned int i = 0; i < CHARACTERISTICS; i++) {
+        json_object_start(json);
+        json_string(json, "aid"); json_integer(json, 2 + i / 4);
+        json_string(json, "iid"); json_integer(json, 9 + i % 4);
+        json_string(json, "value");
+        switch (i % 4) {
+            case 0:
+                json_integer(json, round + i);
+                break;
+            case 1:
+                json_float(json, 20.5f + (round % 100) * 0.1f);
+                break;
+            case 2:
+                json_boolean(json, round & 1);
+                break;
+            default:
+                json_string(json, "Synthetic");
+        }
+        json_object_end(json);
+    }
+
+    json_array_end(json);
+    json_object_end(json);
+    json_flush(json);
+}
+
+static size_t snprintf_body(char *data, const size_t size, const unsigned int round) {
+    size_t pos = snprintf(data, size, "{\"characteristics\":[");
+
+    for (unsigned int i = 0; i < CHARACTERISTICS; i++) {
+        pos += snprintf(data + pos, size - pos, "%s{\"aid\":%u,\"iid\":%u,\"value\":", i ? "," : "", 2 + i / 4, 9 + i % 4);
+        switch (i % 4) {
+            case 0:
+                pos += snprintf(data + pos, size - pos, "%u}", round + i);
+                break;
+            case 1:
+                pos += snprintf(data + pos, size - pos, "%1.7g}", 20.5f + (round % 100) * 0.1f);
+                break;
+            case 2:
+                pos += snprintf(data + pos, size - pos, "%s}", (round & 1) ? "true" : "false");
+                break;
+            default:
+                pos += snprintf(data + pos, size - pos, "\"%s\"}", "Synthetic");
+        }
+    }
+
+    pos += snprintf(data + pos, size - pos, "]}");
+
+    return pos;
+}
+
+int main() {
+    json_stream json = { .buffer = buffer, .size = sizeof(buffer), .on_flush = on_flush };
+
+    written = 0;
+    double start = now_ns();
+    for (unsigned int round = 0; round < ROUNDS; round++) {
+        json_init(&json, NULL);
+        json_body(&json, round);
+        HARNESS_CHECK(!json.error);
+    }
+    const double json_ns = now_ns() - start;
+    const size_t json_bytes = written;
+
+    static char reference[CHARACTERISTICS * 64];
+    size_t reference_bytes = 0;
+    start = now_ns();
+    for (unsigned int round = 0; round < ROUNDS; round++) {
+        reference_bytes += snprintf_body(reference, sizeof(reference), round);
+    }
+    const double snprintf_ns = now_ns() - start;
+
+    HARNESS_CHECK(json_bytes == reference_bytes);
+
+    printf("body %u bytes, %u characteristics\n", (unsigned int) (json_bytes / ROUNDS), CHARACTERISTICS);
+    printf("json_stream    %.1f MB/s\n", json_bytes * 1e3 / json_ns);
+    printf("snprintf       %.1f MB/s\n", reference_bytes * 1e3 / snprintf_ns);
+
+    return 0;
+}
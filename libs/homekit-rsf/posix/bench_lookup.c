@@ -0,0 +1,99 @@
+// Characteristic lookup by aid and iid: binary search in index built by
+// homekit_accessories_init(), against linear scan of accessory database.
+// A copy of accessories array is not indexed, so lookups on it take the scan
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "harness.h"
+#include "synthetic_accessories.h"
+
+#define CHARACTERISTICS         (500)
+#define ROUNDS                  (2000)
+
+// Bridge has 6 characteristics, and each bridged lightbulb 8
+#define LIGHTS                  ((CHARACTERISTICS - 6 + 7) / 8)
+
+typedef struct {
+    int aid;
+    int iid;
+} lookup_id_t;
+
+static double now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static double bench(homekit_accessory_t **accessories, const lookup_id_t *ids, const unsigned int count,
+                    homekit_characteristic_t **found) {
+    const double start = now_ns();
+    for (unsigned int round = 0; round < ROUNDS; round++) {
+        for (unsigned int i = 0; i < count; i++) {
+            found[i] = homekit_characteristic_by_aid_and_iid(accessories, ids[i].aid, ids[i].iid);
+        }
+    }
+
+    return (now_ns() - start) / ((double) ROUNDS * count);
+}
+
+int main() {
+    homekit_accessory_t **accessories = synthetic_accessories_new(LIGHTS);
+    HARNESS_CHECK(accessories);
+    homekit_accessories_init(accessories);
+
+    unsigned int count = 0;
+    for (homekit_accessory_t **accessory_it = accessories; *accessory_it; accessory_it++) {
+        for (homekit_service_t **service_it = (*accessory_it)->services; *service_it; service_it++) {
+            for (homekit_characteristic_t **ch_it = (*service_it)->characteristics; *ch_it; ch_it++) {
+                count++;
+            }
+        }
+    }
+
+    lookup_id_t *ids = malloc(count * sizeof(lookup_id_t));
+    homekit_characteristic_t **indexed = malloc(count * sizeof(homekit_characteristic_t*));
+    homekit_characteristic_t **scanned = malloc(count * sizeof(homekit_characteristic_t*));
+    HARNESS_CHECK(ids && indexed && scanned);
+
+    unsigned int i = 0;
+    for (homekit_accessory_t **accessory_it = accessories; *accessory_it; accessory_it++) {
+        for (homekit_service_t **service_it = (*accessory_it)->services; *service_it; service_it++) {
+            for (homekit_characteristic_t **ch_it = (*service_it)->characteristics; *ch_it; ch_it++) {
+                ids[i].aid = (*accessory_it)->id;
+                ids[i].iid = (*ch_it)->id;
+                i++;
+            }
+        }
+    }
+
+    // Controllers ask characteristics in any order
+    srand(1);
+    for (i = count - 1; i > 0; i--) {
+        const unsigned int j = rand() % (i + 1);
+        const lookup_id_t id = ids[i];
+        ids[i] = ids[j];
+        ids[j] = id;
+    }
+
+    const unsigned int accessories_count = LIGHTS + 1;
+    homekit_accessory_t **unindexed = calloc(accessories_count + 1, sizeof(homekit_accessory_t*));
+    HARNESS_CHECK(unindexed);
+    memcpy(unindexed, accessories, accessories_count * sizeof(homekit_accessory_t*));
+
+    const double scan_ns = bench(unindexed, ids, count, scanned);
+    const double index_ns = bench(accessories, ids, count, indexed);
+
+    for (i = 0; i < count; i++) {
+        HARNESS_CHECK(indexed[i] && indexed[i] == scanned[i]);
+    }
+
+    printf("characteristics %u, lookups %u\n", count, ROUNDS * count);
+    printf("linear scan    %.1f ns/lookup\n", scan_ns);
+    printf("index          %.1f ns/lookup\n", index_ns);
+    printf("speedup        %.1fx\n", scan_ns / index_ns);
+
+    return 0;
+}
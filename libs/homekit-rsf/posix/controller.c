@@ -0,0 +1,654 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <homekit/tlv.h>
+
+#include "controller.h"
+
+// Max plaintext of an encrypted frame
+#define FRAME_SIZE          (1024)
+#define FRAME_TAG_SIZE      (16)
+
+#define READ_SIZE           (4096)
+
+
+controller_t *controller_new(const char *device_id, const ed25519_key *key) {
+    controller_t *controller = calloc(1, sizeof(controller_t));
+    if (!controller) {
+        return NULL;
+    }
+
+    controller->device_id = device_id;
+    controller->key = key;
+    controller->socket = -1;
+
+    return controller;
+}
+
+void controller_free(controller_t *controller) {
+    if (!controller) {
+        return;
+    }
+
+    controller_disconnect(controller);
+    free(controller);
+}
+
+int controller_connect(controller_t *controller, const uint16_t port) {
+    controller_disconnect(controller);
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        return -1;
+    }
+
+    if (controller->receive_buffer > 0) {
+        setsockopt(s, SOL_SOCKET, SO_RCVBUF, &controller->receive_buffer, sizeof(controller->receive_buffer));
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (connect(s, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(s);
+        return -1;
+    }
+
+    const int nodelay = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    controller->socket = s;
+
+    return 0;
+}
+
+void controller_disconnect(controller_t *controller) {
+    if (controller->socket >= 0) {
+        close(controller->socket);
+        controller->socket = -1;
+    }
+
+    controller->encrypted = false;
+    controller->read_count = 0;
+    controller->write_count = 0;
+
+    free(controller->frames);
+    controller->frames = NULL;
+    controller->frames_length = 0;
+
+    free(controller->data);
+    controller->data = NULL;
+    controller->data_length = 0;
+}
+
+double controller_time_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static void frame_nonce(byte *nonce, uint64_t count) {
+    memset(nonce, 0, 12);
+    for (int i = 4; i < 12; i++) {
+        nonce[i] = count % 256;
+        count /= 256;
+    }
+}
+
+static int write_all(int s, const byte *data, size_t size) {
+    while (size > 0) {
+        ssize_t r = write(s, data, size);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += r;
+        size -= r;
+    }
+
+    return 0;
+}
+
+int controller_send(controller_t *controller, const void *data, size_t size) {
+    if (!controller->encrypted) {
+        return write_all(controller->socket, data, size);
+    }
+
+    // All frames are sent with a single write, so server receives them together
+    const size_t frames = (size + FRAME_SIZE - 1) / FRAME_SIZE;
+    byte *buffer = malloc(size + frames * (2 + FRAME_TAG_SIZE));
+    if (!buffer) {
+        return -1;
+    }
+
+    const byte *plain = data;
+    size_t pos = 0;
+    while (size > 0) {
+        const size_t chunk_size = (size < FRAME_SIZE) ? size : FRAME_SIZE;
+
+        byte *aad = buffer + pos;
+        aad[0] = chunk_size % 256;
+        aad[1] = chunk_size / 256;
+
+        byte nonce[12];
+        frame_nonce(nonce, controller->write_count++);
+
+        size_t encrypted_size = chunk_size + FRAME_TAG_SIZE;
+        if (crypto_chacha20poly1305_encrypt(controller->write_key, nonce, aad, 2,
+                plain, chunk_size, buffer + pos + 2, &encrypted_size)) {
+            free(buffer);
+            return -1;
+        }
+
+        pos += 2 + encrypted_size;
+        plain += chunk_size;
+        size -= chunk_size;
+    }
+
+    const int r = write_all(controller->socket, buffer, pos);
+    free(buffer);
+
+    return r;
+}
+
+int controller_format_request(char *buffer, size_t buffer_size, const char *method, const char *path,
+                              const char *content_type, const void *body, size_t body_size) {
+    int size;
+    if (body) {
+        size = snprintf(buffer, buffer_size,
+            "%s %s HTTP/1.1\r\n"
+            "Host: homekit.local\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n\r\n",
+            method, path, content_type, body_size);
+    } else {
+        size = snprintf(buffer, buffer_size,
+            "%s %s HTTP/1.1\r\n"
+            "Host: homekit.local\r\n\r\n",
+            method, path);
+    }
+
+    if (size < 0 || size + body_size >= buffer_size) {
+        return -1;
+    }
+
+    if (body) {
+        memcpy(buffer + size, body, body_size);
+        size += body_size;
+    }
+
+    return size;
+}
+
+static int send_request(controller_t *controller, const char *method, const char *path,
+                        const char *content_type, const void *body, size_t body_size) {
+    const size_t buffer_size = body_size + 256 + strlen(path);
+    char *buffer = malloc(buffer_size);
+    if (!buffer) {
+        return -1;
+    }
+
+    int r = controller_format_request(buffer, buffer_size, method, path, content_type, body, body_size);
+    if (r >= 0) {
+        r = controller_send(controller, buffer, r);
+    }
+
+    free(buffer);
+
+    return r;
+}
+
+int controller_request(controller_t *controller, const char *method, const char *path, const char *body) {
+    return send_request(controller, method, path, "application/hap+json", body, body ? strlen(body) : 0);
+}
+
+static int append(byte **buffer, size_t *length, const byte *data, size_t size) {
+    byte *new_buffer = realloc(*buffer, *length + size + 1);
+    if (!new_buffer) {
+        return -1;
+    }
+
+    memcpy(new_buffer + *length, data, size);
+    *length += size;
+    new_buffer[*length] = 0;
+    *buffer = new_buffer;
+
+    return 0;
+}
+
+static void consume(byte *buffer, size_t *length, size_t size) {
+    memmove(buffer, buffer + size, *length - size);
+    *length -= size;
+}
+
+// Moves complete frames to data
+static int decrypt_frames(controller_t *controller) {
+    while (controller->frames_length >= 2) {
+        const size_t chunk_size = controller->frames[0] + controller->frames[1] * 256;
+        const size_t frame_size = 2 + chunk_size + FRAME_TAG_SIZE;
+        if (chunk_size > FRAME_SIZE) {
+            return -1;
+        }
+        if (controller->frames_length < frame_size) {
+            break;
+        }
+
+        byte nonce[12];
+        frame_nonce(nonce, controller->read_count++);
+
+        byte plain[FRAME_SIZE];
+        size_t plain_size = sizeof(plain);
+        if (crypto_chacha20poly1305_decrypt(controller->read_key, nonce, controller->frames, 2,
+                controller->frames + 2, chunk_size + FRAME_TAG_SIZE, plain, &plain_size)) {
+            return -1;
+        }
+
+        if (append(&controller->data, &controller->data_length, plain, plain_size)) {
+            return -1;
+        }
+
+        consume(controller->frames, &controller->frames_length, frame_size);
+    }
+
+    return 0;
+}
+
+static const char *find_header(const char *headers, const char *end, const char *name) {
+    const size_t name_size = strlen(name);
+    for (const char *line = strstr(headers, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")) {
+        if (!strncasecmp(line + 2, name, name_size) && line[2 + name_size] == ':') {
+            return line + 2 + name_size + 1;
+        }
+    }
+
+    return NULL;
+}
+
+// Parses one message from data. Returns 1 if parsed, 0 if incomplete
+static int parse_message(controller_t *controller, controller_response_t *response) {
+    if (!controller->data) {
+        return 0;
+    }
+
+    char *data = (char*) controller->data;
+    char *headers_end = strstr(data, "\r\n\r\n");
+    if (!headers_end) {
+        return 0;
+    }
+
+    size_t pos = headers_end + 4 - data;
+    byte *body = NULL;
+    size_t body_size = 0;
+
+    const char *content_length = find_header(data, headers_end, "Content-Length");
+    const char *transfer_encoding = find_header(data, headers_end, "Transfer-Encoding");
+    if (transfer_encoding && strstr(transfer_encoding, "chunked") < headers_end) {
+        for (;;) {
+            char *chunk_end = strstr(data + pos, "\r\n");
+            if (!chunk_end) {
+                free(body);
+                return 0;
+            }
+
+            const size_t chunk_size = strtoul(data + pos, NULL, 16);
+            const size_t chunk_start = chunk_end + 2 - data;
+            if (controller->data_length < chunk_start + chunk_size + 2) {
+                free(body);
+                return 0;
+            }
+
+            pos = chunk_start + chunk_size + 2;
+            if (chunk_size == 0) {
+                break;
+            }
+
+            if (append(&body, &body_size, controller->data + chunk_start, chunk_size)) {
+                free(body);
+                return -1;
+            }
+        }
+    } else if (content_length) {
+        body_size = strtoul(content_length, NULL, 10);
+        if (controller->data_length < pos + body_size) {
+            return 0;
+        }
+
+        size_t size = 0;
+        if (append(&body, &size, controller->data + pos, body_size)) {
+            return -1;
+        }
+        pos += body_size;
+    }
+
+    if (!body) {
+        body = calloc(1, 1);
+    }
+
+    response->event = !strncmp(data, "EVENT/", 6);
+    response->status = atoi(strchr(data, ' ') ? strchr(data, ' ') + 1 : "0");
+    response->body = body;
+    response->body_size = body_size;
+
+    consume(controller->data, &controller->data_length, pos);
+    controller->data[controller->data_length] = 0;
+
+    return 1;
+}
+
+int controller_read(controller_t *controller, controller_response_t *response, const int timeout_ms) {
+    memset(response, 0, sizeof(*response));
+
+    const double deadline = controller_time_ms() + timeout_ms;
+    for (;;) {
+        const int r = parse_message(controller, response);
+        if (r != 0) {
+            return r > 0 ? 0 : -1;
+        }
+
+        const int wait = deadline - controller_time_ms();
+        struct pollfd pfd = { controller->socket, POLLIN, 0 };
+        if (wait <= 0 || poll(&pfd, 1, wait) <= 0) {
+            return -1;
+        }
+
+        byte buffer[READ_SIZE];
+        const ssize_t size = read(controller->socket, buffer, sizeof(buffer));
+        if (size <= 0) {
+            return -1;
+        }
+
+        if (controller->encrypted) {
+            if (append(&controller->frames, &controller->frames_length, buffer, size) ||
+                decrypt_frames(controller)) {
+                return -1;
+            }
+        } else if (append(&controller->data, &controller->data_length, buffer, size)) {
+            return -1;
+        }
+    }
+}
+
+void controller_response_free(controller_response_t *response) {
+    free(response->body);
+    response->body = NULL;
+}
+
+// Sends a TLV request to a pairing endpoint, and parses TLV response
+static tlv_values_t *tlv_request(controller_t *controller, const char *path, tlv_values_t *request) {
+    size_t size = 0;
+    tlv_format(request, NULL, &size);
+
+    byte *data = malloc(size);
+    if (!data || tlv_format(request, data, &size) ||
+        send_request(controller, "POST", path, "application/pairing+tlv8", data, size)) {
+        free(data);
+        return NULL;
+    }
+    free(data);
+
+    controller_response_t response;
+    if (controller_read(controller, &response, 10000)) {
+        return NULL;
+    }
+
+    tlv_values_t *values = tlv_new();
+    if (response.status != 200 || tlv_parse(response.body, response.body_size, values) ||
+        tlv_get_value(values, TLVType_Error)) {
+        tlv_free(values);
+        values = NULL;
+    }
+
+    controller_response_free(&response);
+
+    return values;
+}
+
+static int hkdf(const byte *key, const char *salt, size_t salt_size, const char *info, byte *output, size_t output_size) {
+    return crypto_hkdf(key, CONTROLLER_KEY_SIZE, (const byte*) salt, salt_size,
+                       (const byte*) info, strlen(info), output, &output_size);
+}
+
+static int start_session(controller_t *controller, const byte *secret) {
+    byte session_id[32];
+    const char salt[] = "Control-Salt";
+    if (hkdf(secret, salt, sizeof(salt) - 1, "Control-Read-Encryption-Key", controller->read_key, CONTROLLER_KEY_SIZE) ||
+        hkdf(secret, salt, sizeof(salt) - 1, "Control-Write-Encryption-Key", controller->write_key, CONTROLLER_KEY_SIZE)) {
+        return -1;
+    }
+
+    if (secret != controller->secret) {
+        const char session_salt[] = "Pair-Verify-ResumeSessionID-Salt";
+        if (hkdf(secret, session_salt, sizeof(session_salt) - 1, "Pair-Verify-ResumeSessionID-Info",
+                 session_id, sizeof(session_id))) {
+            return -1;
+        }
+        memcpy(controller->session_id, session_id, CONTROLLER_SESSION_ID_SIZE);
+        memcpy(controller->secret, secret, CONTROLLER_KEY_SIZE);
+    }
+
+    controller->resumable = true;
+    controller->encrypted = true;
+    controller->read_count = 0;
+    controller->write_count = 0;
+
+    return 0;
+}
+
+int controller_pair_verify(controller_t *controller) {
+    int r = -1;
+    tlv_values_t *response = NULL;
+    byte *sub_data = NULL;
+    byte *device_info = NULL;
+
+    curve25519_key *my_key = crypto_curve25519_generate();
+    curve25519_key *accessory_key = crypto_curve25519_new();
+    if (!my_key || !accessory_key) {
+        goto end;
+    }
+
+    byte my_public[32];
+    size_t my_public_size = sizeof(my_public);
+    if (crypto_curve25519_export_public(my_key, my_public, &my_public_size)) {
+        goto end;
+    }
+
+    tlv_values_t *request = tlv_new();
+    tlv_add_integer_value(request, TLVType_State, 1, 1);
+    tlv_add_value(request, TLVType_PublicKey, my_public, my_public_size);
+    response = tlv_request(controller, "/pair-verify", request);
+    tlv_free(request);
+
+    tlv_t *accessory_public = response ? tlv_get_value(response, TLVType_PublicKey) : NULL;
+    tlv_t *encrypted = response ? tlv_get_value(response, TLVType_EncryptedData) : NULL;
+    if (!accessory_public || !encrypted || tlv_get_integer_value(response, TLVType_State, -1) != 2 ||
+        crypto_curve25519_import_public(accessory_key, accessory_public->value, accessory_public->size)) {
+        goto end;
+    }
+
+    byte secret[32];
+    size_t secret_size = sizeof(secret);
+    byte session_key[32];
+    const char salt[] = "Pair-Verify-Encrypt-Salt";
+    if (crypto_curve25519_shared_secret(my_key, accessory_key, secret, &secret_size) ||
+        hkdf(secret, salt, sizeof(salt) - 1, "Pair-Verify-Encrypt-Info", session_key, sizeof(session_key))) {
+        goto end;
+    }
+
+    // Accessory sub-TLV must be decrypted to check server proof of shared secret
+    byte m2[256];
+    size_t m2_size = sizeof(m2);
+    if (encrypted->size > sizeof(m2) ||
+        crypto_chacha20poly1305_decrypt(session_key, (byte*) "\x0\x0\x0\x0PV-Msg02", NULL, 0,
+            encrypted->value, encrypted->size, m2, &m2_size)) {
+        goto end;
+    }
+
+    const size_t device_id_size = strlen(controller->device_id);
+    const size_t device_info_size = my_public_size + device_id_size + accessory_public->size;
+    device_info = malloc(device_info_size);
+    memcpy(device_info, my_public, my_public_size);
+    memcpy(device_info + my_public_size, controller->device_id, device_id_size);
+    memcpy(device_info + my_public_size + device_id_size, accessory_public->value, accessory_public->size);
+
+    byte signature[64];
+    size_t signature_size = sizeof(signature);
+    if (crypto_ed25519_sign(controller->key, device_info, device_info_size, signature, &signature_size)) {
+        goto end;
+    }
+
+    tlv_values_t *sub_request = tlv_new();
+    tlv_add_value(sub_request, TLVType_Identifier, (const byte*) controller->device_id, device_id_size);
+    tlv_add_value(sub_request, TLVType_Signature, signature, signature_size);
+
+    size_t sub_size = 0;
+    tlv_format(sub_request, NULL, &sub_size);
+    sub_data = malloc(sub_size + FRAME_TAG_SIZE);
+    r = tlv_format(sub_request, sub_data, &sub_size);
+    tlv_free(sub_request);
+    if (r) {
+        r = -1;
+        goto end;
+    }
+
+    byte m3[256];
+    size_t m3_size = sizeof(m3);
+    if (sub_size + FRAME_TAG_SIZE > sizeof(m3) ||
+        crypto_chacha20poly1305_encrypt(session_key, (byte*) "\x0\x0\x0\x0PV-Msg03", NULL, 0,
+            sub_data, sub_size, m3, &m3_size)) {
+        r = -1;
+        goto end;
+    }
+
+    tlv_free(response);
+    request = tlv_new();
+    tlv_add_integer_value(request, TLVType_State, 1, 3);
+    tlv_add_value(request, TLVType_EncryptedData, m3, m3_size);
+    response = tlv_request(controller, "/pair-verify", request);
+    tlv_free(request);
+
+    r = -1;
+    if (response && tlv_get_integer_value(response, TLVType_State, -1) == 4) {
+        r = start_session(controller, secret);
+    }
+
+end:
+    if (response) {
+        tlv_free(response);
+    }
+    free(device_info);
+    free(sub_data);
+    if (my_key) {
+        crypto_curve25519_free(my_key);
+    }
+    if (accessory_key) {
+        crypto_curve25519_free(accessory_key);
+    }
+
+    return r;
+}
+
+int controller_pair_setup_start(controller_t *controller) {
+    tlv_values_t *request = tlv_new();
+    tlv_add_integer_value(request, TLVType_State, 1, 1);
+    tlv_add_integer_value(request, TLVType_Method, 1, TLVMethod_PairSetup);
+    tlv_values_t *response = tlv_request(controller, "/pair-setup", request);
+    tlv_free(request);
+
+    if (!response) {
+        return -1;
+    }
+
+    const int r = (tlv_get_integer_value(response, TLVType_State, -1) == 2 &&
+                   tlv_get_value(response, TLVType_Salt) &&
+                   tlv_get_value(response, TLVType_PublicKey)) ? 0 : -1;
+    tlv_free(response);
+
+    return r;
+}
+
+// Salt of Pair Resume keys: a new controller public key followed by a session ID
+static int resume_key(const byte *secret, const byte *public_key, const byte *session_id, const char *info, byte *key) {
+    byte salt[32 + CONTROLLER_SESSION_ID_SIZE];
+    memcpy(salt, public_key, 32);
+    memcpy(salt + 32, session_id, CONTROLLER_SESSION_ID_SIZE);
+
+    return hkdf(secret, (const char*) salt, sizeof(salt), info, key, CONTROLLER_KEY_SIZE);
+}
+
+int controller_pair_resume(controller_t *controller) {
+    if (!controller->resumable) {
+        return -1;
+    }
+
+    // Only public key is used, as salt
+    curve25519_key *my_key = crypto_curve25519_generate();
+    if (!my_key) {
+        return -1;
+    }
+
+    byte my_public[32];
+    size_t my_public_size = sizeof(my_public);
+    int r = crypto_curve25519_export_public(my_key, my_public, &my_public_size);
+    crypto_curve25519_free(my_key);
+    if (r || my_public_size != sizeof(my_public)) {
+        return -1;
+    }
+
+    byte key[CONTROLLER_KEY_SIZE];
+    byte tag[FRAME_TAG_SIZE];
+    if (resume_key(controller->secret, my_public, controller->session_id, "Pair-Resume-Request-Info", key) ||
+        crypto_chacha20poly1305_empty_tag(key, (byte*) "\x0\x0\x0\x0PR-Msg01", tag)) {
+        return -1;
+    }
+
+    tlv_values_t *request = tlv_new();
+    tlv_add_integer_value(request, TLVType_State, 1, 1);
+    tlv_add_integer_value(request, TLVType_Method, 1, TLVMethod_PairResume);
+    tlv_add_value(request, TLVType_PublicKey, my_public, sizeof(my_public));
+    tlv_add_value(request, TLVType_SessionID, controller->session_id, CONTROLLER_SESSION_ID_SIZE);
+    tlv_add_value(request, TLVType_EncryptedData, tag, sizeof(tag));
+    tlv_values_t *response = tlv_request(controller, "/pair-verify", request);
+    tlv_free(request);
+
+    // Accessory answers with Pair Verify M2 when session is not resumed
+    tlv_t *session_id = response ? tlv_get_value(response, TLVType_SessionID) : NULL;
+    tlv_t *response_tag = response ? tlv_get_value(response, TLVType_EncryptedData) : NULL;
+    r = -1;
+    if (session_id && session_id->size == CONTROLLER_SESSION_ID_SIZE &&
+        response_tag && response_tag->size == FRAME_TAG_SIZE &&
+        tlv_get_integer_value(response, TLVType_State, -1) == 2 &&
+        tlv_get_integer_value(response, TLVType_Method, -1) == TLVMethod_PairResume) {
+        byte secret[CONTROLLER_KEY_SIZE];
+        if (!resume_key(controller->secret, my_public, session_id->value, "Pair-Resume-Response-Info", key) &&
+            !crypto_chacha20poly1305_empty_tag(key, (byte*) "\x0\x0\x0\x0PR-Msg02", tag) &&
+            !memcmp(tag, response_tag->value, sizeof(tag)) &&
+            !resume_key(controller->secret, my_public, session_id->value, "Pair-Resume-Shared-Secret-Info", secret)) {
+            memcpy(controller->session_id, session_id->value, CONTROLLER_SESSION_ID_SIZE);
+            memcpy(controller->secret, secret, CONTROLLER_KEY_SIZE);
+            r = start_session(controller, controller->secret);
+        }
+    }
+
+    if (response) {
+        tlv_free(response);
+    }
+
+    return r;
+}
@@ -0,0 +1,80 @@
+#ifndef __HOMEKIT_POSIX_CONTROLLER_H__
+#define __HOMEKIT_POSIX_CONTROLLER_H__
+
+// HAP controller for host tests and load generator. Does Pair Verify and Pair Resume
+// with a pairing already stored by accessory, and encrypted HTTP requests, over a
+// blocking loopback socket. Accessory signature is not checked
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "crypto.h"
+
+#define CONTROLLER_SESSION_ID_SIZE      (8)
+#define CONTROLLER_KEY_SIZE             (32)
+
+typedef struct {
+    const char *device_id;
+    const ed25519_key *key;
+
+    int socket;
+    int receive_buffer;     // SO_RCVBUF set before connecting, if not 0
+    bool encrypted;
+    byte read_key[CONTROLLER_KEY_SIZE];     // Accessory to controller
+    byte write_key[CONTROLLER_KEY_SIZE];    // Controller to accessory
+    uint64_t read_count;
+    uint64_t write_count;
+
+    // Last verified or resumed session
+    bool resumable;
+    byte session_id[CONTROLLER_SESSION_ID_SIZE];
+    byte secret[CONTROLLER_KEY_SIZE];
+
+    // Received frames not decrypted yet, and received data not parsed yet
+    byte *frames;
+    size_t frames_length;
+    byte *data;
+    size_t data_length;
+} controller_t;
+
+typedef struct {
+    int status;
+    bool event;             // EVENT/1.0 message, not a response
+    byte *body;             // Followed by a 0, so it can be used as string
+    size_t body_size;
+} controller_response_t;
+
+// Key is not copied, and must be kept while controller is used
+controller_t *controller_new(const char *device_id, const ed25519_key *key);
+void controller_free(controller_t *controller);
+
+int controller_connect(controller_t *controller, const uint16_t port);
+void controller_disconnect(controller_t *controller);
+
+// Establish an encrypted session. Pair Resume needs a previous session of this controller
+int controller_pair_verify(controller_t *controller);
+int controller_pair_resume(controller_t *controller);
+
+// Sends Pair Setup M1, and checks that accessory answers with its SRP salt and public key.
+// Pairing is not completed. Accessory must be unpaired, or configured with re_pair
+int controller_pair_setup_start(controller_t *controller);
+
+// Sends raw HTTP data, encrypted when there is a session
+int controller_send(controller_t *controller, const void *data, size_t size);
+
+// Formats an HTTP request into buffer, returning its size or -1 if it does not fit
+int controller_format_request(char *buffer, size_t buffer_size, const char *method, const char *path,
+                              const char *content_type, const void *body, size_t body_size);
+
+// Sends a request with JSON body, or no body if NULL
+int controller_request(controller_t *controller, const char *method, const char *path, const char *body);
+
+// Waits up to timeout_ms for next response or event. Returns -1 on timeout, error or disconnection
+int controller_read(controller_t *controller, controller_response_t *response, const int timeout_ms);
+void controller_response_free(controller_response_t *response);
+
+// Milliseconds of a monotonic clock shared by all processes, with microseconds precision
+double controller_time_ms();
+
+#endif // __HOMEKIT_POSIX_CONTROLLER_H__
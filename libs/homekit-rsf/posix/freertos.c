@@ -0,0 +1,407 @@
+// FreeRTOS tasks, timers and heap emulated with pthreads and glibc malloc
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <malloc.h>
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <timers.h>
+#include <semphr.h>
+
+#include "homekit_posix.h"
+
+#ifndef HOMEKIT_POSIX_HEAP_SIZE
+#define HOMEKIT_POSIX_HEAP_SIZE     (1024 * 1024)
+#endif
+
+
+// Tasks
+
+typedef struct {
+    TaskFunction_t task;
+    void *args;
+} task_start_t;
+
+static void *task_run(void *arg) {
+    task_start_t start = *(task_start_t*) arg;
+    free(arg);
+
+    start.task(start.args);
+
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack_depth, void *args, UBaseType_t priority, TaskHandle_t *handle) {
+    task_start_t *start = malloc(sizeof(task_start_t));
+    if (!start) {
+        return pdFAIL;
+    }
+
+    start->task = task;
+    start->args = args;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, task_run, start)) {
+        free(start);
+        return pdFAIL;
+    }
+
+    pthread_detach(thread);
+
+    if (handle) {
+        *handle = (TaskHandle_t) (uintptr_t) thread;
+    }
+
+    return pdPASS;
+}
+
+// Only calling task can be deleted
+void vTaskDelete(TaskHandle_t task) {
+    if (!task || pthread_equal((pthread_t) (uintptr_t) task, pthread_self())) {
+        pthread_exit(NULL);
+    }
+}
+
+void vTaskDelay(const TickType_t ticks) {
+    struct timespec delay = { ticks * portTICK_PERIOD_MS / 1000, (ticks * portTICK_PERIOD_MS % 1000) * 1000000 };
+    while (nanosleep(&delay, &delay) < 0 && errno == EINTR);
+}
+
+TickType_t xTaskGetTickCount() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (TickType_t) (now.tv_sec * 1000 + now.tv_nsec / 1000000) / portTICK_PERIOD_MS;
+}
+
+static pthread_mutex_t critical_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+void vPortEnterCritical() {
+    pthread_mutex_lock(&critical_mutex);
+}
+
+void vPortExitCritical() {
+    pthread_mutex_unlock(&critical_mutex);
+}
+
+
+// Semaphores. A mutex is a binary semaphore created given
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool given;
+} semaphore_t;
+
+static SemaphoreHandle_t semaphore_new(const bool given) {
+    semaphore_t *semaphore = malloc(sizeof(semaphore_t));
+    if (!semaphore) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&semaphore->mutex, NULL);
+    pthread_cond_init(&semaphore->cond, NULL);
+    semaphore->given = given;
+
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+    return semaphore_new(false);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+    return semaphore_new(true);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t handle) {
+    semaphore_t *semaphore = handle;
+    pthread_cond_destroy(&semaphore->cond);
+    pthread_mutex_destroy(&semaphore->mutex);
+    free(semaphore);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, const TickType_t block_time) {
+    semaphore_t *semaphore = handle;
+    const TickType_t start = xTaskGetTickCount();
+
+    pthread_mutex_lock(&semaphore->mutex);
+
+    while (!semaphore->given) {
+        if (block_time == portMAX_DELAY) {
+            pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+            continue;
+        }
+
+        const TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= block_time) {
+            break;
+        }
+
+        const uint32_t wait = (block_time - elapsed) * portTICK_PERIOD_MS;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait / 1000;
+        deadline.tv_nsec += (wait % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&semaphore->cond, &semaphore->mutex, &deadline);
+    }
+
+    const bool taken = semaphore->given;
+    semaphore->given = false;
+
+    pthread_mutex_unlock(&semaphore->mutex);
+
+    return taken ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle) {
+    semaphore_t *semaphore = handle;
+
+    pthread_mutex_lock(&semaphore->mutex);
+    const bool given = semaphore->given;
+    semaphore->given = true;
+    pthread_cond_signal(&semaphore->cond);
+    pthread_mutex_unlock(&semaphore->mutex);
+
+    return given ? pdFALSE : pdTRUE;
+}
+
+
+// Heap. All allocations of process are counted, including libraries and test programs
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static size_t heap_size = HOMEKIT_POSIX_HEAP_SIZE;
+static size_t heap_used = 0;
+static size_t heap_peak = 0;
+
+static void heap_add(const size_t size) {
+    const size_t used = __atomic_add_fetch(&heap_used, size, __ATOMIC_RELAXED);
+
+    size_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+    while (used > peak && !__atomic_compare_exchange_n(&heap_peak, &peak, used, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void heap_sub(const size_t size) {
+    __atomic_sub_fetch(&heap_used, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    if (ptr) {
+        heap_add(malloc_usable_size(ptr));
+    }
+
+    return ptr;
+}
+
+void *calloc(size_t count, size_t size) {
+    void *ptr = __libc_calloc(count, size);
+    if (ptr) {
+        heap_add(malloc_usable_size(ptr));
+    }
+
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    const size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+
+    void *new_ptr = __libc_realloc(ptr, size);
+    if (new_ptr) {
+        heap_sub(old_size);
+        heap_add(malloc_usable_size(new_ptr));
+    } else if (size == 0) {
+        heap_sub(old_size);
+    }
+
+    return new_ptr;
+}
+
+void free(void *ptr) {
+    if (ptr) {
+        heap_sub(malloc_usable_size(ptr));
+        __libc_free(ptr);
+    }
+}
+
+uint32_t xPortGetFreeHeapSize() {
+    const size_t used = __atomic_load_n(&heap_used, __ATOMIC_RELAXED);
+
+    return (used < heap_size) ? heap_size - used : 0;
+}
+
+void homekit_posix_heap_size_set(const size_t size) {
+    heap_size = size;
+}
+
+size_t homekit_posix_heap_used() {
+    return __atomic_load_n(&heap_used, __ATOMIC_RELAXED);
+}
+
+size_t homekit_posix_heap_peak() {
+    return __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+}
+
+void homekit_posix_heap_peak_reset() {
+    __atomic_store_n(&heap_peak, __atomic_load_n(&heap_used, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+
+// Timers. A single service task runs expired timer callbacks, in expiry order
+
+struct _homekit_posix_timer {
+    TickType_t period;
+    TickType_t expiry;
+    void *timer_id;
+    TimerCallbackFunction_t callback;
+    bool auto_reload: 1;
+    bool active: 1;
+    struct _homekit_posix_timer *next;
+};
+
+static pthread_mutex_t timers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timers_cond = PTHREAD_COND_INITIALIZER;
+static struct _homekit_posix_timer *timers = NULL;
+static bool timers_task_started = false;
+
+static void timers_task(void *args) {
+    pthread_mutex_lock(&timers_mutex);
+
+    for (;;) {
+        struct _homekit_posix_timer *next = NULL;
+        for (struct _homekit_posix_timer *timer = timers; timer; timer = timer->next) {
+            if (timer->active && (!next || (int32_t) (timer->expiry - next->expiry) < 0)) {
+                next = timer;
+            }
+        }
+
+        if (!next) {
+            pthread_cond_wait(&timers_cond, &timers_mutex);
+            continue;
+        }
+
+        const int32_t wait = next->expiry - xTaskGetTickCount();
+        if (wait > 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += wait / 1000;
+            deadline.tv_nsec += (wait % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+
+            pthread_cond_timedwait(&timers_cond, &timers_mutex, &deadline);
+            continue;
+        }
+
+        if (next->auto_reload) {
+            next->expiry += next->period;
+        } else {
+            next->active = false;
+        }
+
+        // Callback can use timer API
+        pthread_mutex_unlock(&timers_mutex);
+        next->callback(next);
+        pthread_mutex_lock(&timers_mutex);
+    }
+}
+
+TimerHandle_t xTimerCreate(const char *name, const TickType_t period, const UBaseType_t auto_reload, void *timer_id, TimerCallbackFunction_t callback) {
+    struct _homekit_posix_timer *timer = calloc(1, sizeof(*timer));
+    if (!timer) {
+        return NULL;
+    }
+
+    timer->period = period;
+    timer->timer_id = timer_id;
+    timer->callback = callback;
+    timer->auto_reload = auto_reload;
+
+    pthread_mutex_lock(&timers_mutex);
+
+    if (!timers_task_started) {
+        if (xTaskCreate(timers_task, "Tmr", 0, NULL, 0, NULL) != pdPASS) {
+            pthread_mutex_unlock(&timers_mutex);
+            free(timer);
+            return NULL;
+        }
+        timers_task_started = true;
+    }
+
+    timer->next = timers;
+    timers = timer;
+
+    pthread_mutex_unlock(&timers_mutex);
+
+    return timer;
+}
+
+void *pvTimerGetTimerID(const TimerHandle_t timer) {
+    return timer->timer_id;
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, const TickType_t block_time) {
+    pthread_mutex_lock(&timers_mutex);
+    timer->expiry = xTaskGetTickCount() + timer->period;
+    timer->active = true;
+    pthread_cond_signal(&timers_cond);
+    pthread_mutex_unlock(&timers_mutex);
+
+    return pdPASS;
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, const TickType_t block_time) {
+    pthread_mutex_lock(&timers_mutex);
+    timer->active = false;
+    pthread_cond_signal(&timers_cond);
+    pthread_mutex_unlock(&timers_mutex);
+
+    return pdPASS;
+}
+
+// Timer must not be deleted while its callback runs
+BaseType_t xTimerDelete(TimerHandle_t timer, const TickType_t block_time) {
+    pthread_mutex_lock(&timers_mutex);
+
+    struct _homekit_posix_timer **it = &timers;
+    while (*it && *it != timer) {
+        it = &(*it)->next;
+    }
+    if (*it) {
+        *it = timer->next;
+    }
+
+    pthread_cond_signal(&timers_cond);
+    pthread_mutex_unlock(&timers_mutex);
+
+    free(timer);
+
+    return pdPASS;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, const TickType_t period, const TickType_t block_time) {
+    pthread_mutex_lock(&timers_mutex);
+    timer->period = period;
+    timer->expiry = xTaskGetTickCount() + period;
+    timer->active = true;
+    pthread_cond_signal(&timers_cond);
+    pthread_mutex_unlock(&timers_mutex);
+
+    return pdPASS;
+}
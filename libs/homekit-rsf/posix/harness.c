@@ -0,0 +1,71 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "port.h"
+#include "storage.h"
+
+#include "harness.h"
+
+int harness_flash_reset() {
+    if (unlink(HOMEKIT_POSIX_FLASH_FILE) < 0 && errno != ENOENT) {
+        return -1;
+    }
+
+    return homekit_storage_init() < 0 ? -1 : 0;
+}
+
+int harness_pairing_add(harness_pairing_t *pairing, const unsigned int index) {
+    snprintf(pairing->device_id, sizeof(pairing->device_id),
+             "00000000-0000-4000-8000-%012X", index);
+
+    pairing->key = crypto_ed25519_generate();
+    if (!pairing->key) {
+        return -1;
+    }
+
+    return homekit_storage_add_pairing(pairing->device_id, pairing->key, pairing_permissions_admin);
+}
+
+void harness_server_start(homekit_server_config_t *config) {
+    if (!getenv("HARNESS_VERBOSE")) {
+        const int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            fflush(stdout);
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+    }
+
+    homekit_server_init(config);
+}
+
+int harness_connect(controller_t *controller, const int timeout_ms) {
+    const double deadline = controller_time_ms() + timeout_ms;
+    while (controller_connect(controller, HARNESS_PORT)) {
+        if (controller_time_ms() > deadline) {
+            return -1;
+        }
+
+        const struct timespec delay = { 0, 50000000 };
+        nanosleep(&delay, NULL);
+    }
+
+    return 0;
+}
+
+controller_t *harness_controller_new(harness_pairing_t *pairing) {
+    controller_t *controller = controller_new(pairing->device_id, pairing->key);
+    if (!controller) {
+        return NULL;
+    }
+
+    if (harness_connect(controller, 5000) || controller_pair_verify(controller)) {
+        controller_free(controller);
+        return NULL;
+    }
+
+    return controller;
+}
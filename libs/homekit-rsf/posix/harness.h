@@ -0,0 +1,46 @@
+#ifndef __HOMEKIT_POSIX_HARNESS_H__
+#define __HOMEKIT_POSIX_HARNESS_H__
+
+// Setup shared by host tests and load generator: emulated flash with controller pairings,
+// accessory server started in this process, and controllers connected to it
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <homekit/homekit.h>
+
+#include "crypto.h"
+#include "controller.h"
+
+#define HARNESS_PORT                (5556)
+#define HARNESS_DEVICE_ID_SIZE      (36)
+
+typedef struct {
+    char device_id[HARNESS_DEVICE_ID_SIZE + 1];
+    ed25519_key *key;
+} harness_pairing_t;
+
+// Starts from an empty emulated flash, removing one of previous runs
+int harness_flash_reset();
+
+// Stores an admin pairing with a new controller key. Must be done before server starts
+int harness_pairing_add(harness_pairing_t *pairing, const unsigned int index);
+
+// Server logs go to stdout, which is discarded unless HARNESS_VERBOSE is set in environment.
+// Results must be written to stderr
+void harness_server_start(homekit_server_config_t *config);
+
+// Connects to server, waiting up to timeout_ms for it to listen
+int harness_connect(controller_t *controller, const int timeout_ms);
+
+// Connects and establishes a verified session
+controller_t *harness_controller_new(harness_pairing_t *pairing);
+
+#define HARNESS_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+#endif // __HOMEKIT_POSIX_HARNESS_H__
@@ -0,0 +1,752 @@
+// Load generator: accessory server with synthetic accessories in a process, and
+// controllers in another one doing Pair Verify, event subscriptions, polling GETs and
+// PUT bursts. Reports throughput, request and event latencies, and server peak heap.
+// Server heap of scene writes, setting all lightbulbs at once, is measured before.
+// Slow consumers subscribe to events and then read them at a throttled rate. A pairing
+// controller can run Pair Setup M1, with its SRP computation, and Pair Verify in a loop.
+// Event sweep mode only subscribes 1 to N controllers in turn, reporting events/sec of each step
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <FreeRTOS.h>
+#include <timers.h>
+
+#include "harness.h"
+#include "homekit_posix.h"
+#include "stats.h"
+#include "synthetic_accessories.h"
+
+#define MAX_CONTROLLERS         (30)
+#define LIGHTS_PER_REQUEST      (4)
+#define NOTIFIED_RING_SIZE      (4096)
+#define REQUEST_TIMEOUT         (10000)
+
+// Slow consumers read every period, with a small receive window
+#define SLOW_READ_PERIOD        (100)
+#define SLOW_RECEIVE_BUFFER     (2048)
+
+typedef struct {
+    unsigned int controllers;
+    unsigned int accessories;
+    unsigned int duration;          // Seconds
+    unsigned int notify_period;     // Milliseconds
+    unsigned int put_every;         // One of these requests is a PUT burst
+    unsigned int scenes;            // Scene writes of heap measurement
+    unsigned int slow_consumers;
+    unsigned int slow_read_size;    // Bytes read by slow consumers every period, 0 to stall them
+    bool pairing;
+    bool sweep;                     // Event sweep, each step lasting duration
+} options_t;
+
+static options_t options = {
+    .controllers = 8,
+    .accessories = 20,
+    .duration = 10,
+    .notify_period = 100,
+    .put_every = 10,
+    .scenes = 20,
+    .slow_read_size = 256,
+};
+
+// Controllers, then slow consumers, then pairing controller
+static unsigned int clients_count() {
+    return options.controllers + options.slow_consumers + (options.pairing ? 1 : 0);
+}
+
+// Shared by both processes. Monotonic clock is the same for all of them
+typedef struct {
+    uint32_t sequence;
+    double notified[NOTIFIED_RING_SIZE];
+} shared_t;
+
+static shared_t *shared;
+
+// Controllers process asks server heap through pipes: 'R' resets peak, 'P' only reads it.
+// Answer is used and peak heap
+static int heap_requests[2];
+static int heap_responses[2];
+
+static homekit_accessory_t **accessories;
+static harness_pairing_t pairings[MAX_CONTROLLERS];
+
+typedef struct {
+    double *values;
+    size_t count;
+    size_t size;
+} samples_t;
+
+static void samples_add(samples_t *samples, const double value) {
+    if (samples->count == samples->size) {
+        samples->size = samples->size ? samples->size * 2 : 1024;
+        samples->values = realloc(samples->values, samples->size * sizeof(double));
+    }
+
+    samples->values[samples->count++] = value;
+}
+
+static void samples_merge(samples_t *samples, const samples_t *other) {
+    for (size_t i = 0; i < other->count; i++) {
+        samples_add(samples, other->values[i]);
+    }
+}
+
+static int compare_double(const void *a, const void *b) {
+    const double x = *(const double*) a;
+    const double y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+static void samples_print(const char *name, samples_t *samples) {
+    if (samples->count == 0) {
+        fprintf(stderr, "%-10s none\n", name);
+        return;
+    }
+
+    qsort(samples->values, samples->count, sizeof(double), compare_double);
+    fprintf(stderr, "%-10s n %zu, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", name, samples->count,
+            samples->values[samples->count / 2],
+            samples->values[(samples->count * 99) / 100],
+            samples->values[samples->count - 1]);
+}
+
+
+// Server process
+
+static void *heap_server_run(void *arg) {
+    char command;
+    while (read(heap_requests[0], &command, 1) == 1) {
+        if (command == 'R') {
+            homekit_posix_heap_peak_reset();
+        }
+
+        const size_t heap[2] = { homekit_posix_heap_used(), homekit_posix_heap_peak() };
+        if (write(heap_responses[1], heap, sizeof(heap)) != sizeof(heap)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void notifier_callback(TimerHandle_t timer) {
+    homekit_characteristic_t *ch = pvTimerGetTimerID(timer);
+
+    const uint32_t sequence = shared->sequence + 1;
+    shared->notified[sequence % NOTIFIED_RING_SIZE] = controller_time_ms();
+    __atomic_store_n(&shared->sequence, sequence, __ATOMIC_RELEASE);
+
+    ch->value = HOMEKIT_UINT32(sequence);
+    homekit_characteristic_notify(ch);
+}
+
+static int run_server(const pid_t controllers_pid) {
+    static homekit_server_config_t config;
+    config.accessories = accessories;
+    config.category = HOMEKIT_DEVICE_CATEGORY_BRIDGE;
+    config.setup_id = "LOAD";
+    config.max_clients = clients_count();
+    // Pair Setup is refused by a paired accessory
+    config.re_pair = options.pairing;
+
+    const size_t heap_start = homekit_posix_heap_used();
+    homekit_posix_heap_peak_reset();
+
+    harness_server_start(&config);
+
+    pthread_t heap_thread;
+    pthread_create(&heap_thread, NULL, heap_server_run, NULL);
+
+    TimerHandle_t notifier = xTimerCreate("Ntf", pdMS_TO_TICKS(options.notify_period), pdTRUE,
+                                          synthetic_accessories_sequence(accessories), notifier_callback);
+    xTimerStart(notifier, 0);
+
+    int status = 1;
+    waitpid(controllers_pid, &status, 0);
+
+    xTimerStop(notifier, 0);
+
+    fprintf(stderr, "server events sent %u, deferred %u\n", homekit_stats.events_sent, homekit_stats.events_deferred);
+    fprintf(stderr, "server loop n %u, max %.2f ms\n", homekit_stats.sections[HOMEKIT_STATS_LOOP].count,
+            homekit_stats.sections[HOMEKIT_STATS_LOOP].max / 1000000.0);
+    fprintf(stderr, "server heap: start %zu, peak %zu bytes\n", heap_start, homekit_posix_heap_peak());
+
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : 1;
+}
+
+
+// Controllers process
+
+typedef struct {
+    unsigned int index;
+    double deadline;
+
+    unsigned int requests;
+    unsigned int events;
+    unsigned int notified;          // Probe notifications while subscribed
+    unsigned int errors;
+    samples_t request_latency;
+    samples_t event_latency;
+    samples_t verify_latency;
+    samples_t setup_latency;
+
+    // Slow consumer
+    size_t bytes_read;
+    double disconnected;            // Seconds after start, or 0
+    bool closed;                    // Found closed after run, by draining unread data
+} worker_t;
+
+static char sequence_pattern[32];
+
+static void event_received(worker_t *worker, const controller_response_t *event, const double now) {
+    const char *found = strstr((const char*) event->body, sequence_pattern);
+    if (found) {
+        const uint32_t sequence = strtoul(found + strlen(sequence_pattern), NULL, 10);
+        if (sequence > 0) {
+            samples_add(&worker->event_latency, now - shared->notified[sequence % NOTIFIED_RING_SIZE]);
+        }
+    }
+}
+
+// Reads response of last request, handling events received before it
+static int wait_response(worker_t *worker, controller_t *controller, const int expected_status) {
+    for (;;) {
+        controller_response_t response;
+        if (controller_read(controller, &response, REQUEST_TIMEOUT)) {
+            return -1;
+        }
+
+        const double now = controller_time_ms();
+        const int status = response.status;
+        const bool event = response.event;
+        if (event) {
+            event_received(worker, &response, now);
+        }
+        controller_response_free(&response);
+
+        if (!event) {
+            return status == expected_status ? 0 : -1;
+        }
+    }
+}
+
+static int append_id(char *buffer, size_t size, int pos, homekit_characteristic_t *ch) {
+    return pos + snprintf(buffer + pos, size - pos, "%s%d.%d", pos && buffer[pos - 1] != '=' ? "," : "",
+                          ch->service->accessory->id, ch->id);
+}
+
+static int append_write(char *buffer, size_t size, int pos, homekit_characteristic_t *ch, const char *field, const char *value) {
+    return pos + snprintf(buffer + pos, size - pos, "%s{\"aid\":%d,\"iid\":%d,\"%s\":%s}",
+                          buffer[pos - 1] == '[' ? "" : ",", ch->service->accessory->id, ch->id, field, value);
+}
+
+static int subscribe(worker_t *worker, controller_t *controller) {
+    char body[4096];
+    int pos = snprintf(body, sizeof(body), "{\"characteristics\":[");
+    pos = append_write(body, sizeof(body), pos, synthetic_accessories_sequence(accessories), "ev", "true");
+    for (unsigned int i = 0; i < options.accessories; i++) {
+        pos = append_write(body, sizeof(body), pos, synthetic_accessories_ch(accessories, i, HOMEKIT_CHARACTERISTIC_ON), "ev", "true");
+    }
+    snprintf(body + pos, sizeof(body) - pos, "]}");
+
+    if (controller_request(controller, "PUT", "/characteristics", body)) {
+        return -1;
+    }
+
+    return wait_response(worker, controller, 204);
+}
+
+static int poll_lights(worker_t *worker, controller_t *controller, const unsigned int first) {
+    char path[512];
+    int pos = snprintf(path, sizeof(path), "/characteristics?id=");
+    for (unsigned int i = 0; i < LIGHTS_PER_REQUEST; i++) {
+        const unsigned int index = (first + i) % options.accessories;
+        pos = append_id(path, sizeof(path), pos, synthetic_accessories_ch(accessories, index, HOMEKIT_CHARACTERISTIC_ON));
+        pos = append_id(path, sizeof(path), pos, synthetic_accessories_ch(accessories, index, HOMEKIT_CHARACTERISTIC_BRIGHTNESS));
+        pos = append_id(path, sizeof(path), pos, synthetic_accessories_ch(accessories, index, HOMEKIT_CHARACTERISTIC_CURRENT_TEMPERATURE));
+    }
+
+    if (controller_request(controller, "GET", path, NULL)) {
+        return -1;
+    }
+
+    return wait_response(worker, controller, 200);
+}
+
+static int write_lights(worker_t *worker, controller_t *controller, const unsigned int first, const unsigned int count, const bool on) {
+    const size_t body_size = 64 + count * 2 * 48;
+    char *body = malloc(body_size);
+    int pos = snprintf(body, body_size, "{\"characteristics\":[");
+    for (unsigned int i = 0; i < count; i++) {
+        const unsigned int index = (first + i) % options.accessories;
+        char brightness[8];
+        snprintf(brightness, sizeof(brightness), "%u", (first + i) % 100);
+        pos = append_write(body, body_size, pos, synthetic_accessories_ch(accessories, index, HOMEKIT_CHARACTERISTIC_ON), "value", on ? "true" : "false");
+        pos = append_write(body, body_size, pos, synthetic_accessories_ch(accessories, index, HOMEKIT_CHARACTERISTIC_BRIGHTNESS), "value", brightness);
+    }
+    snprintf(body + pos, body_size - pos, "]}");
+
+    const int r = controller_request(controller, "PUT", "/characteristics", body);
+    free(body);
+    if (r) {
+        return -1;
+    }
+
+    return wait_response(worker, controller, 204);
+}
+
+static void server_heap(const char command, size_t *used, size_t *peak) {
+    size_t heap[2] = { 0, 0 };
+    if (write(heap_requests[1], &command, 1) != 1 ||
+        read(heap_responses[0], heap, sizeof(heap)) != sizeof(heap)) {
+        fprintf(stderr, "server heap not available\n");
+    }
+
+    *used = heap[0];
+    *peak = heap[1];
+}
+
+// Peak server heap over idle while a controller sends scene writes of count lightbulbs
+static int measure_scenes(const unsigned int count) {
+    worker_t worker;
+    memset(&worker, 0, sizeof(worker));
+
+    controller_t *controller = harness_controller_new(&pairings[0]);
+    if (!controller) {
+        return -1;
+    }
+
+    // First write allocates buffers kept by server
+    int r = write_lights(&worker, controller, 0, count, true);
+
+    size_t idle, peak;
+    server_heap('R', &idle, &peak);
+
+    for (unsigned int i = 0; i < options.scenes && !r; i++) {
+        r = write_lights(&worker, controller, 0, count, i % 2);
+    }
+
+    server_heap('P', &idle, &peak);
+    controller_free(controller);
+
+    if (r) {
+        return -1;
+    }
+
+    fprintf(stderr, "scene      %u writes of %u characteristics, server heap peak +%zu bytes\n",
+            options.scenes, count * 2, peak - idle);
+
+    return 0;
+}
+
+static void *worker_run(void *arg) {
+    worker_t *worker = arg;
+
+    controller_t *controller = controller_new(pairings[worker->index].device_id, pairings[worker->index].key);
+    if (harness_connect(controller, 5000)) {
+        worker->errors++;
+        controller_free(controller);
+        return NULL;
+    }
+
+    const double verify_start = controller_time_ms();
+    if (controller_pair_verify(controller) || subscribe(worker, controller)) {
+        worker->errors++;
+        controller_free(controller);
+        return NULL;
+    }
+    samples_add(&worker->verify_latency, controller_time_ms() - verify_start);
+
+    for (unsigned int i = 0; controller_time_ms() < worker->deadline; i++) {
+        const unsigned int first = worker->index * LIGHTS_PER_REQUEST + i;
+
+        const double start = controller_time_ms();
+        int r;
+        if (options.put_every > 0 && i % options.put_every == options.put_every - 1) {
+            r = write_lights(worker, controller, first, LIGHTS_PER_REQUEST, (i / options.put_every) % 2);
+        } else {
+            r = poll_lights(worker, controller, first);
+        }
+
+        if (r) {
+            worker->errors++;
+            break;
+        }
+
+        samples_add(&worker->request_latency, controller_time_ms() - start);
+        worker->requests++;
+    }
+
+    controller_free(controller);
+
+    return NULL;
+}
+
+static void *slow_consumer_run(void *arg) {
+    worker_t *worker = arg;
+    const double start = controller_time_ms();
+
+    controller_t *controller = controller_new(pairings[worker->index].device_id, pairings[worker->index].key);
+    controller->receive_buffer = SLOW_RECEIVE_BUFFER;
+    if (harness_connect(controller, 5000) || controller_pair_verify(controller) || subscribe(worker, controller)) {
+        worker->errors++;
+        controller_free(controller);
+        return NULL;
+    }
+
+    // Data is discarded without decrypting it
+    while (controller_time_ms() < worker->deadline) {
+        const struct timespec delay = { 0, SLOW_READ_PERIOD * 1000000 };
+        nanosleep(&delay, NULL);
+
+        // Server closing is seen before unread data
+        struct pollfd pfd = { controller->socket, POLLRDHUP, 0 };
+        if (poll(&pfd, 1, 0) > 0) {
+            worker->disconnected = (controller_time_ms() - start) / 1000.0;
+            break;
+        }
+
+        if (options.slow_read_size > 0) {
+            byte buffer[options.slow_read_size];
+            const ssize_t r = recv(controller->socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (r > 0) {
+                worker->bytes_read += r;
+            }
+        }
+    }
+
+    // Closing of a stalled consumer is only sent after data it did not read
+    const double drain_deadline = controller_time_ms() + 2000;
+    while (!worker->disconnected && controller_time_ms() < drain_deadline) {
+        byte buffer[4096];
+        struct pollfd pfd = { controller->socket, POLLIN, 0 };
+        if (poll(&pfd, 1, 500) <= 0) {
+            break;
+        }
+        if (recv(controller->socket, buffer, sizeof(buffer), 0) <= 0) {
+            worker->closed = true;
+            break;
+        }
+    }
+
+    controller_free(controller);
+
+    return NULL;
+}
+
+static int pair_again(worker_t *worker, controller_t *controller) {
+    if (harness_connect(controller, 5000)) {
+        return -1;
+    }
+
+    double start = controller_time_ms();
+    if (controller_pair_setup_start(controller)) {
+        return -1;
+    }
+    samples_add(&worker->setup_latency, controller_time_ms() - start);
+
+    if (harness_connect(controller, 5000)) {
+        return -1;
+    }
+
+    start = controller_time_ms();
+    if (controller_pair_verify(controller)) {
+        return -1;
+    }
+    samples_add(&worker->verify_latency, controller_time_ms() - start);
+
+    controller_disconnect(controller);
+
+    return 0;
+}
+
+static void *pairing_run(void *arg) {
+    worker_t *worker = arg;
+
+    controller_t *controller = controller_new(pairings[worker->index].device_id, pairings[worker->index].key);
+    while (controller_time_ms() < worker->deadline) {
+        if (pair_again(worker, controller)) {
+            worker->errors++;
+            break;
+        }
+    }
+
+    controller_free(controller);
+
+    return NULL;
+}
+
+// Event sweep listener: subscribes and only receives events
+static void *listener_run(void *arg) {
+    worker_t *worker = arg;
+
+    controller_t *controller = controller_new(pairings[worker->index].device_id, pairings[worker->index].key);
+    if (harness_connect(controller, 5000) || controller_pair_verify(controller) || subscribe(worker, controller)) {
+        worker->errors++;
+        controller_free(controller);
+        return NULL;
+    }
+
+    const uint32_t sequence = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+    for (;;) {
+        const double now = controller_time_ms();
+        if (now >= worker->deadline) {
+            break;
+        }
+
+        controller_response_t response;
+        if (controller_read(controller, &response, worker->deadline - now + 1)) {
+            // Timeout at deadline, to a whole millisecond, or server closed connection
+            if (controller_time_ms() + 1 < worker->deadline) {
+                worker->errors++;
+            }
+            break;
+        }
+
+        if (response.event) {
+            event_received(worker, &response, controller_time_ms());
+            worker->events++;
+        }
+        controller_response_free(&response);
+    }
+    worker->notified = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE) - sequence;
+
+    controller_free(controller);
+
+    return NULL;
+}
+
+// Steps from 1 to options.controllers subscribed controllers. Each controller should receive
+// every probe notification sent while it is subscribed, so events/sec of a step is compared with them
+static int run_sweep() {
+    worker_t *workers = calloc(options.controllers, sizeof(worker_t));
+    pthread_t *threads = calloc(options.controllers, sizeof(pthread_t));
+    unsigned int errors = 0;
+
+    for (unsigned int count = 1; count <= options.controllers; count++) {
+        const double start = controller_time_ms();
+
+        memset(workers, 0, options.controllers * sizeof(worker_t));
+        for (unsigned int i = 0; i < count; i++) {
+            workers[i].index = i;
+            workers[i].deadline = start + options.duration * 1000.0;
+            pthread_create(&threads[i], NULL, listener_run, &workers[i]);
+        }
+
+        worker_t total;
+        memset(&total, 0, sizeof(total));
+        for (unsigned int i = 0; i < count; i++) {
+            pthread_join(threads[i], NULL);
+
+            total.events += workers[i].events;
+            total.notified += workers[i].notified;
+            total.errors += workers[i].errors;
+            samples_merge(&total.event_latency, &workers[i].event_latency);
+            free(workers[i].event_latency.values);
+        }
+        const double elapsed = (controller_time_ms() - start) / 1000.0;
+
+        char name[16];
+        snprintf(name, sizeof(name), "sweep %u", count);
+        fprintf(stderr, "%-10s events %.1f/s of %.1f/s, errors %u\n", name,
+                total.events / elapsed, total.notified / elapsed, total.errors);
+        samples_print("event", &total.event_latency);
+        free(total.event_latency.values);
+
+        errors += total.errors;
+    }
+
+    return errors > 0 ? 1 : 0;
+}
+
+static int run_controllers() {
+    homekit_characteristic_t *sequence = synthetic_accessories_sequence(accessories);
+    snprintf(sequence_pattern, sizeof(sequence_pattern), "\"aid\":%d,\"iid\":%d,\"value\":",
+             sequence->service->accessory->id, sequence->id);
+
+    // Server is ready when a controller can connect
+    controller_t *probe = controller_new(pairings[0].device_id, pairings[0].key);
+    if (harness_connect(probe, 5000)) {
+        fprintf(stderr, "server not started\n");
+        return 1;
+    }
+    controller_free(probe);
+
+    if (options.scenes > 0 &&
+        (measure_scenes(LIGHTS_PER_REQUEST) || measure_scenes(options.accessories))) {
+        fprintf(stderr, "scene writes failed\n");
+        return 1;
+    }
+
+    if (options.sweep) {
+        return run_sweep();
+    }
+
+    const unsigned int count = clients_count();
+    worker_t *workers = calloc(count, sizeof(worker_t));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+
+    const double start = controller_time_ms();
+    for (unsigned int i = 0; i < count; i++) {
+        workers[i].index = i;
+        workers[i].deadline = start + options.duration * 1000.0;
+        void *(*run)(void*) = worker_run;
+        if (i >= options.controllers + options.slow_consumers) {
+            run = pairing_run;
+        } else if (i >= options.controllers) {
+            run = slow_consumer_run;
+        }
+        pthread_create(&threads[i], NULL, run, &workers[i]);
+    }
+
+    worker_t total;
+    memset(&total, 0, sizeof(total));
+    for (unsigned int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+
+        total.requests += workers[i].requests;
+        total.errors += workers[i].errors;
+        samples_merge(&total.request_latency, &workers[i].request_latency);
+        samples_merge(&total.event_latency, &workers[i].event_latency);
+        samples_merge(&total.verify_latency, &workers[i].verify_latency);
+        samples_merge(&total.setup_latency, &workers[i].setup_latency);
+    }
+    const double elapsed = (controller_time_ms() - start) / 1000.0;
+
+    fprintf(stderr, "controllers %u, accessories %u, duration %.1f s, notify period %u ms\n",
+            options.controllers, options.accessories, elapsed, options.notify_period);
+    fprintf(stderr, "requests %u, %.1f/s, errors %u\n", total.requests, total.requests / elapsed, total.errors);
+    samples_print("request", &total.request_latency);
+    samples_print("event", &total.event_latency);
+    samples_print("verify", &total.verify_latency);
+    if (options.pairing) {
+        samples_print("setup M1", &total.setup_latency);
+    }
+
+    for (unsigned int i = options.controllers; i < options.controllers + options.slow_consumers; i++) {
+        if (workers[i].disconnected > 0) {
+            fprintf(stderr, "slow       read %zu bytes, disconnected after %.1f s\n",
+                    workers[i].bytes_read, workers[i].disconnected);
+        } else {
+            fprintf(stderr, "slow       read %zu bytes, %s\n", workers[i].bytes_read,
+                    workers[i].closed ? "closed by server" : "still connected");
+        }
+    }
+
+    return total.errors > 0 ? 1 : 0;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -c N   controllers, max %u with the other ones (default %u)\n"
+        "  -a N   bridged lightbulbs (default %u)\n"
+        "  -t N   duration in seconds (default %u)\n"
+        "  -n N   period of probe notifications in ms (default %u)\n"
+        "  -w N   one of N requests is a PUT, 0 for none (default %u)\n"
+        "  -s N   scene writes of heap measurement, 0 for none (default %u)\n"
+        "  -l N   slow consumers, reading every %u ms (default %u)\n"
+        "  -r N   bytes read by slow consumers, 0 to stall them (default %u)\n"
+        "  -p     adds a controller running Pair Setup M1 and Pair Verify in a loop\n"
+        "  -e     event sweep from 1 to N controllers only receiving events, each step lasting duration\n",
+        program, MAX_CONTROLLERS, options.controllers, options.accessories,
+        options.duration, options.notify_period, options.put_every, options.scenes,
+        SLOW_READ_PERIOD, options.slow_consumers, options.slow_read_size);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "c:a:t:n:w:s:l:r:peh")) != -1) {
+        switch (opt) {
+            case 'c':
+                options.controllers = atoi(optarg);
+                break;
+            case 'a':
+                options.accessories = atoi(optarg);
+                break;
+            case 't':
+                options.duration = atoi(optarg);
+                break;
+            case 'n':
+                options.notify_period = atoi(optarg);
+                break;
+            case 'w':
+                options.put_every = atoi(optarg);
+                break;
+            case 's':
+                options.scenes = atoi(optarg);
+                break;
+            case 'l':
+                options.slow_consumers = atoi(optarg);
+                break;
+            case 'r':
+                options.slow_read_size = atoi(optarg);
+                break;
+            case 'p':
+                options.pairing = true;
+                break;
+            case 'e':
+                options.sweep = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (options.controllers < 1 || clients_count() > MAX_CONTROLLERS ||
+        options.accessories < 1 || options.notify_period < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    shared = mmap(NULL, sizeof(shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    // Both processes need same database and controller keys
+    accessories = synthetic_accessories_new(options.accessories);
+    homekit_accessories_init(accessories);
+
+    if (harness_flash_reset()) {
+        fprintf(stderr, "flash reset failed\n");
+        return 1;
+    }
+    for (unsigned int i = 0; i < clients_count(); i++) {
+        if (harness_pairing_add(&pairings[i], i)) {
+            fprintf(stderr, "pairing %u failed\n", i);
+            return 1;
+        }
+    }
+
+    if (pipe(heap_requests) || pipe(heap_responses)) {
+        perror("pipe");
+        return 1;
+    }
+
+    fflush(NULL);
+    const pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    if (pid == 0) {
+        return run_controllers();
+    }
+
+    return run_server(pid);
+}
@@ -0,0 +1,16 @@
+#ifndef __HOMEKIT_POSIX_H__
+#define __HOMEKIT_POSIX_H__
+
+// Host only helpers of POSIX port, used by test and benchmark programs
+
+#include <stddef.h>
+
+// Size of emulated heap. Free heap seen by server is this size minus heap used
+void homekit_posix_heap_size_set(const size_t size);
+
+// Bytes allocated by whole process, now and at peak since start or last reset
+size_t homekit_posix_heap_used();
+size_t homekit_posix_heap_peak();
+void homekit_posix_heap_peak_reset();
+
+#endif // __HOMEKIT_POSIX_H__
@@ -0,0 +1,52 @@
+#ifndef __HOMEKIT_POSIX_FREERTOS_H__
+#define __HOMEKIT_POSIX_FREERTOS_H__
+
+// Subset of FreeRTOS used by homekit-rsf, implemented with pthreads by freertos.c.
+// Ticks are milliseconds, and priorities and stack sizes are ignored
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef int32_t BaseType_t;
+typedef uint32_t UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint32_t StackType_t;
+
+typedef void (*TaskFunction_t)(void *);
+typedef void *TaskHandle_t;
+
+struct _homekit_posix_timer;
+typedef struct _homekit_posix_timer *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+
+typedef void *SemaphoreHandle_t;
+
+#define pdFALSE                     (0)
+#define pdTRUE                      (1)
+#define pdFAIL                      (0)
+#define pdPASS                      (1)
+
+#define portTICK_PERIOD_MS          (1)
+#define portMAX_DELAY               (0xFFFFFFFF)
+#define pdMS_TO_TICKS(ms)           ((TickType_t) (ms) / portTICK_PERIOD_MS)
+
+#define tskIDLE_PRIORITY            (0)
+
+#define IRAM
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack_depth, void *args, UBaseType_t priority, TaskHandle_t *handle);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(const TickType_t ticks);
+TickType_t xTaskGetTickCount();
+
+// Critical sections exclude each other across all tasks
+void vPortEnterCritical();
+void vPortExitCritical();
+#define taskENTER_CRITICAL()        vPortEnterCritical()
+#define taskEXIT_CRITICAL()         vPortExitCritical()
+
+// Emulated heap size, HOMEKIT_POSIX_HEAP_SIZE by default, minus malloc() usage of whole process
+uint32_t xPortGetFreeHeapSize();
+
+#endif // __HOMEKIT_POSIX_FREERTOS_H__
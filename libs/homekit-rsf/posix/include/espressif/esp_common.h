@@ -0,0 +1 @@
+// No SDK functions are needed by homekit-rsf on POSIX. See port.h
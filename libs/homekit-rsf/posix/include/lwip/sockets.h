@@ -0,0 +1,24 @@
+#ifndef __HOMEKIT_POSIX_LWIP_SOCKETS_H__
+#define __HOMEKIT_POSIX_LWIP_SOCKETS_H__
+
+// lwIP sockets API is provided by host BSD sockets
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define lwip_fcntl                  fcntl
+
+// Loopback is always available, so server loop can be woken up by notifications.
+// Defined to 0 by build of homekit_load_poll
+#ifndef LWIP_NETIF_LOOPBACK
+#define LWIP_NETIF_LOOPBACK         (1)
+#endif
+
+#endif // __HOMEKIT_POSIX_LWIP_SOCKETS_H__
@@ -0,0 +1,15 @@
+#ifndef __HOMEKIT_POSIX_SEMPHR_H__
+#define __HOMEKIT_POSIX_SEMPHR_H__
+
+// Binary semaphores and mutexes. Mutexes are not recursive, and have no priority inheritance
+
+#include <FreeRTOS.h>
+
+SemaphoreHandle_t xSemaphoreCreateBinary();
+SemaphoreHandle_t xSemaphoreCreateMutex();
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, const TickType_t block_time);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+
+#endif // __HOMEKIT_POSIX_SEMPHR_H__
@@ -0,0 +1,28 @@
+#ifndef __HOMEKIT_POSIX_SYSPARAM_H__
+#define __HOMEKIT_POSIX_SYSPARAM_H__
+
+// Subset of esp-open-rtos sysparam, with key/value pairs kept in RAM by sysparam.c
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef enum {
+    SYSPARAM_OK           = 0,
+    SYSPARAM_NOTFOUND     = 1,
+    SYSPARAM_PARSEFAILED  = 2,
+    SYSPARAM_ERR_BADVALUE = -2,
+    SYSPARAM_ERR_NOMEM    = -6,
+} sysparam_status_t;
+
+sysparam_status_t sysparam_get_data(const char *key, uint8_t **destptr, size_t *actual_length, bool *is_binary);
+sysparam_status_t sysparam_get_string(const char *key, char **destptr);
+sysparam_status_t sysparam_get_int32(const char *key, int32_t *result);
+sysparam_status_t sysparam_get_int8(const char *key, int8_t *result);
+
+sysparam_status_t sysparam_set_data(const char *key, const uint8_t *value, size_t value_len, bool binary);
+sysparam_status_t sysparam_set_string(const char *key, const char *value);
+sysparam_status_t sysparam_set_int32(const char *key, int32_t value);
+sysparam_status_t sysparam_set_int8(const char *key, int8_t value);
+
+#endif // __HOMEKIT_POSIX_SYSPARAM_H__
@@ -0,0 +1 @@
+#include <FreeRTOS.h>
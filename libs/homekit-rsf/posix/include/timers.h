@@ -0,0 +1,19 @@
+#ifndef __HOMEKIT_POSIX_TIMERS_H__
+#define __HOMEKIT_POSIX_TIMERS_H__
+
+// Software timers, with callbacks run by a timer service task like in FreeRTOS
+
+#include <FreeRTOS.h>
+
+TimerHandle_t xTimerCreate(const char *name, const TickType_t period, const UBaseType_t auto_reload, void *timer_id, TimerCallbackFunction_t callback);
+void *pvTimerGetTimerID(const TimerHandle_t timer);
+
+BaseType_t xTimerStart(TimerHandle_t timer, const TickType_t block_time);
+BaseType_t xTimerStop(TimerHandle_t timer, const TickType_t block_time);
+BaseType_t xTimerDelete(TimerHandle_t timer, const TickType_t block_time);
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, const TickType_t period, const TickType_t block_time);
+
+#define xTimerStartFromISR(timer, woken)    ((void) (woken), xTimerStart((timer), 0))
+#define xTimerStopFromISR(timer, woken)     ((void) (woken), xTimerStop((timer), 0))
+
+#endif // __HOMEKIT_POSIX_TIMERS_H__
@@ -0,0 +1,23 @@
+#ifndef wolfcrypt_user_settings_h
+#define wolfcrypt_user_settings_h
+
+// wolfCrypt settings of POSIX port, replacing those of esp-open-rtos
+
+#include <stdint.h>
+#include <stddef.h>
+
+void homekit_random_fill(uint8_t *data, size_t size);
+
+static inline int homekit_posix_generate_block(uint8_t *buf, size_t len) {
+    homekit_random_fill(buf, len);
+    return 0;
+}
+
+#define WC_NO_HARDEN
+#define NO_WOLFSSL_DIR
+#define SINGLE_THREADED
+#define NO_WRITEV
+
+#define CUSTOM_RAND_GENERATE_BLOCK homekit_posix_generate_block
+
+#endif
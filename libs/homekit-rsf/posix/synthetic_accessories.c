@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "synthetic_accessories.h"
+
+static homekit_service_t *accessory_information_new(const char *name) {
+    return NEW_HOMEKIT_SERVICE(ACCESSORY_INFORMATION, .characteristics=(homekit_characteristic_t*[]) {
+        NEW_HOMEKIT_CHARACTERISTIC(NAME, strdup(name)),
+        NEW_HOMEKIT_CHARACTERISTIC(MANUFACTURER, "RavenSystem"),
+        NEW_HOMEKIT_CHARACTERISTIC(SERIAL_NUMBER, strdup(name)),
+        NEW_HOMEKIT_CHARACTERISTIC(MODEL, "Synthetic"),
+        NEW_HOMEKIT_CHARACTERISTIC(FIRMWARE_REVISION, "1.0.0"),
+        NULL
+    });
+}
+
+// HOMEKIT_ACCESSORY() pastes its arguments after a brace, which host compilers reject
+static homekit_accessory_t *accessory_new(homekit_service_t **services) {
+    homekit_accessory_t accessory = { .services = services };
+    return homekit_accessory_clone(&accessory);
+}
+
+homekit_accessory_t **synthetic_accessories_new(const unsigned int count) {
+    homekit_accessory_t **accessories = calloc(count + 2, sizeof(homekit_accessory_t*));
+    if (!accessories) {
+        return NULL;
+    }
+
+    accessories[0] = accessory_new((homekit_service_t*[]) {
+        accessory_information_new("Bridge"),
+        NEW_HOMEKIT_SERVICE(SYNTHETIC_PROBE, .characteristics=(homekit_characteristic_t*[]) {
+            NEW_HOMEKIT_CHARACTERISTIC(SYNTHETIC_SEQUENCE, 0),
+            NULL
+        }),
+        NULL
+    });
+
+    for (unsigned int i = 0; i < count; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "Light %u", i + 1);
+
+        accessories[i + 1] = accessory_new((homekit_service_t*[]) {
+            accessory_information_new(name),
+            NEW_HOMEKIT_SERVICE(LIGHTBULB, .primary=true, .characteristics=(homekit_characteristic_t*[]) {
+                NEW_HOMEKIT_CHARACTERISTIC(ON, false),
+                NEW_HOMEKIT_CHARACTERISTIC(BRIGHTNESS, 100),
+                NULL
+            }),
+            NEW_HOMEKIT_SERVICE(TEMPERATURE_SENSOR, .characteristics=(homekit_characteristic_t*[]) {
+                NEW_HOMEKIT_CHARACTERISTIC(CURRENT_TEMPERATURE, 20),
+                NULL
+            }),
+            NULL
+        });
+    }
+
+    return accessories;
+}
+
+static homekit_characteristic_t *find_ch(homekit_accessory_t *accessory, const char *type) {
+    for (homekit_service_t **service_it = accessory->services; *service_it; service_it++) {
+        homekit_characteristic_t *ch = homekit_service_characteristic_by_type(*service_it, type);
+        if (ch) {
+            return ch;
+        }
+    }
+
+    return NULL;
+}
+
+homekit_characteristic_t *synthetic_accessories_ch(homekit_accessory_t **accessories, const unsigned int index, const char *type) {
+    return find_ch(accessories[index + 1], type);
+}
+
+homekit_characteristic_t *synthetic_accessories_sequence(homekit_accessory_t **accessories) {
+    return find_ch(accessories[0], HOMEKIT_CHARACTERISTIC_SYNTHETIC_SEQUENCE);
+}
@@ -0,0 +1,31 @@
+#ifndef __HOMEKIT_POSIX_SYNTHETIC_ACCESSORIES_H__
+#define __HOMEKIT_POSIX_SYNTHETIC_ACCESSORIES_H__
+
+// Accessory database of host tests and load generator: a bridge with a probe
+// characteristic notifying a sequence number, followed by bridged lightbulbs with a
+// temperature sensor each. IDs are assigned by homekit_accessories_init()
+
+#include <homekit/homekit.h>
+#include <homekit/characteristics.h>
+
+#define HOMEKIT_SERVICE_SYNTHETIC_PROBE             "F0000100-0218-2017-81BF-AF2B7C833922"
+
+#define HOMEKIT_CHARACTERISTIC_SYNTHETIC_SEQUENCE   "F0000101-0218-2017-81BF-AF2B7C833922"
+#define HOMEKIT_DECLARE_CHARACTERISTIC_SYNTHETIC_SEQUENCE(_value, ...) \
+    .type = HOMEKIT_CHARACTERISTIC_SYNTHETIC_SEQUENCE, \
+    .description = "Sequence", \
+    .format = HOMEKIT_FORMAT_UINT32, \
+    .permissions = HOMEKIT_PERMISSIONS_PAIRED_READ \
+                 | HOMEKIT_PERMISSIONS_NOTIFY, \
+    .value = HOMEKIT_UINT32_(_value), \
+    ##__VA_ARGS__
+
+// NULL terminated, with count bridged lightbulbs
+homekit_accessory_t **synthetic_accessories_new(const unsigned int count);
+
+// Characteristic of given type of bridged lightbulb index, from 0 to count - 1
+homekit_characteristic_t *synthetic_accessories_ch(homekit_accessory_t **accessories, const unsigned int index, const char *type);
+
+homekit_characteristic_t *synthetic_accessories_sequence(homekit_accessory_t **accessories);
+
+#endif // __HOMEKIT_POSIX_SYNTHETIC_ACCESSORIES_H__
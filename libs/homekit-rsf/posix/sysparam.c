@@ -0,0 +1,179 @@
+// sysparam key/value pairs kept in RAM. Nothing is persisted across runs
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <sysparam.h>
+
+typedef struct _sysparam_entry {
+    char *key;
+    uint8_t *value;
+    size_t value_len;
+    bool binary;
+    struct _sysparam_entry *next;
+} sysparam_entry_t;
+
+static pthread_mutex_t sysparam_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sysparam_entry_t *sysparam_entries = NULL;
+
+static sysparam_entry_t *sysparam_find(const char *key) {
+    for (sysparam_entry_t *entry = sysparam_entries; entry; entry = entry->next) {
+        if (!strcmp(entry->key, key)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Value is always followed by a 0, so it can be read as string
+sysparam_status_t sysparam_get_data(const char *key, uint8_t **destptr, size_t *actual_length, bool *is_binary) {
+    pthread_mutex_lock(&sysparam_mutex);
+
+    sysparam_status_t status = SYSPARAM_NOTFOUND;
+    sysparam_entry_t *entry = sysparam_find(key);
+    if (entry) {
+        uint8_t *value = malloc(entry->value_len + 1);
+        if (value) {
+            memcpy(value, entry->value, entry->value_len + 1);
+            *destptr = value;
+            if (actual_length) {
+                *actual_length = entry->value_len;
+            }
+            if (is_binary) {
+                *is_binary = entry->binary;
+            }
+            status = SYSPARAM_OK;
+        } else {
+            status = SYSPARAM_ERR_NOMEM;
+        }
+    }
+
+    pthread_mutex_unlock(&sysparam_mutex);
+
+    return status;
+}
+
+sysparam_status_t sysparam_get_string(const char *key, char **destptr) {
+    uint8_t *value;
+    bool binary;
+    sysparam_status_t status = sysparam_get_data(key, &value, NULL, &binary);
+    if (status != SYSPARAM_OK) {
+        return status;
+    }
+
+    if (binary) {
+        free(value);
+        return SYSPARAM_PARSEFAILED;
+    }
+
+    *destptr = (char*) value;
+
+    return SYSPARAM_OK;
+}
+
+static sysparam_status_t sysparam_get_binary(const char *key, void *result, const size_t size) {
+    uint8_t *value;
+    size_t value_len;
+    bool binary;
+    sysparam_status_t status = sysparam_get_data(key, &value, &value_len, &binary);
+    if (status != SYSPARAM_OK) {
+        return status;
+    }
+
+    if (binary && value_len == size) {
+        memcpy(result, value, size);
+    } else {
+        status = SYSPARAM_PARSEFAILED;
+    }
+
+    free(value);
+
+    return status;
+}
+
+sysparam_status_t sysparam_get_int32(const char *key, int32_t *result) {
+    return sysparam_get_binary(key, result, sizeof(*result));
+}
+
+sysparam_status_t sysparam_get_int8(const char *key, int8_t *result) {
+    return sysparam_get_binary(key, result, sizeof(*result));
+}
+
+// Empty value deletes key
+sysparam_status_t sysparam_set_data(const char *key, const uint8_t *value, size_t value_len, bool binary) {
+    if (!key || !key[0]) {
+        return SYSPARAM_ERR_BADVALUE;
+    }
+
+    if (!value) {
+        value_len = 0;
+    }
+
+    uint8_t *new_value = NULL;
+    if (value_len > 0) {
+        new_value = malloc(value_len + 1);
+        if (!new_value) {
+            return SYSPARAM_ERR_NOMEM;
+        }
+        memcpy(new_value, value, value_len);
+        new_value[value_len] = 0;
+    }
+
+    pthread_mutex_lock(&sysparam_mutex);
+
+    sysparam_entry_t **it = &sysparam_entries;
+    while (*it && strcmp((*it)->key, key)) {
+        it = &(*it)->next;
+    }
+
+    sysparam_status_t status = SYSPARAM_OK;
+    sysparam_entry_t *entry = *it;
+    if (!new_value) {
+        if (entry) {
+            *it = entry->next;
+            free(entry->key);
+            free(entry->value);
+            free(entry);
+        }
+    } else {
+        if (!entry) {
+            entry = calloc(1, sizeof(*entry));
+            if (entry && !(entry->key = strdup(key))) {
+                free(entry);
+                entry = NULL;
+            }
+            if (entry) {
+                entry->next = sysparam_entries;
+                sysparam_entries = entry;
+            }
+        }
+
+        if (entry) {
+            free(entry->value);
+            entry->value = new_value;
+            entry->value_len = value_len;
+            entry->binary = binary;
+        } else {
+            free(new_value);
+            status = SYSPARAM_ERR_NOMEM;
+        }
+    }
+
+    pthread_mutex_unlock(&sysparam_mutex);
+
+    return status;
+}
+
+sysparam_status_t sysparam_set_string(const char *key, const char *value) {
+    return sysparam_set_data(key, (const uint8_t*) value, value ? strlen(value) : 0, false);
+}
+
+sysparam_status_t sysparam_set_int32(const char *key, int32_t value) {
+    return sysparam_set_data(key, (const uint8_t*) &value, sizeof(value), true);
+}
+
+sysparam_status_t sysparam_set_int8(const char *key, int8_t value) {
+    return sysparam_set_data(key, (const uint8_t*) &value, sizeof(value), true);
+}
@@ -0,0 +1,85 @@
+// Floats written by json_float() match printf "%1.7g", used before by json.c:
+// edge values, rounding carries, and random bit patterns
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "harness.h"
+#include "json.h"
+
+#define RANDOM_FLOATS           (1000000)
+
+static float edge_values[] = {
+    0.0f, -0.0f, 1.0f, -1.0f, 0.5f, -0.5f,
+    1e-7f, -1e-7f, 1e-5f, 1e-4f, 0.0001f, 0.00012345678f,
+    1e7f, -1e7f, 1e6f, 9999999.0f, 12345678.0f, 1e38f,
+    FLT_MAX, -FLT_MAX, FLT_MIN, -FLT_MIN, 1e-45f, 1.17549421e-38f,
+    // Rounding carries into next digit or next decimal exponent
+    9.9999995f, 9.999999f, 0.99999995f, 0.099999994f, 999999.94f, 999999.5f,
+    9999999.5f, 99999995.0f, 0.00009999999f, 1.0000001f, 2.5f, 0.125f,
+    123456.75f, 1234567.5f, 21.5f, 20.05f, -273.15f, 100.0f,
+    INFINITY, -INFINITY, NAN,
+};
+
+typedef struct {
+    char data[64];
+    size_t size;
+} output_t;
+
+static int on_flush(uint8_t *buffer, size_t size, void *context) {
+    output_t *output = context;
+    if (output->size + size >= sizeof(output->data)) {
+        return -1;
+    }
+
+    memcpy(output->data + output->size, buffer, size);
+    output->size += size;
+
+    return 0;
+}
+
+// Small buffer, so some floats are written across flushes
+static void check_float(const float x) {
+    uint8_t buffer[8];
+    output_t output = { .size = 0 };
+
+    json_stream json = { .buffer = buffer, .size = sizeof(buffer), .on_flush = on_flush };
+    json_init(&json, &output);
+    json_float(&json, x);
+    json_flush(&json);
+    HARNESS_CHECK(!json.error);
+    output.data[output.size] = 0;
+
+    char expected[64];
+    snprintf(expected, sizeof(expected), "%1.7g", x);
+    if (strcmp(output.data, expected)) {
+        uint32_t bits;
+        memcpy(&bits, &x, sizeof(bits));
+        fprintf(stderr, "test_json_float: 0x%08x written as %s, expected %s\n", bits, output.data, expected);
+        exit(1);
+    }
+}
+
+int main() {
+    for (unsigned int i = 0; i < sizeof(edge_values) / sizeof(*edge_values); i++) {
+        check_float(edge_values[i]);
+    }
+
+    srand(1);
+    for (unsigned int i = 0; i < RANDOM_FLOATS; i++) {
+        const uint32_t bits = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+        float x;
+        memcpy(&x, &bits, sizeof(x));
+
+        // Sign of NaN is not written
+        if (!isnan(x)) {
+            check_float(x);
+        }
+    }
+
+    fprintf(stderr, "test_json_float: OK\n");
+
+    return 0;
+}
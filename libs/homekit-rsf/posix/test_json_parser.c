@@ -0,0 +1,90 @@
+// Separators of objects and arrays are required between keys and items, and only there
+
+#include <stdio.h>
+#include <string.h>
+
+#include "json_parser.h"
+
+// Walks a characteristics body as server does. Returns true if it is well formed
+static bool parse(const char *document) {
+    char data[256];
+    strncpy(data, document, sizeof(data) - 1);
+    data[sizeof(data) - 1] = 0;
+
+    json_parser_t parser;
+    json_parser_init(&parser, data);
+
+    char *key;
+    json_parser_object_start(&parser);
+    while (json_parser_object_next_key(&parser, &key)) {
+        json_parser_value_t value;
+        if (strcmp(key, "characteristics")) {
+            json_parser_value(&parser, &value);
+            continue;
+        }
+
+        if (!json_parser_array_start(&parser)) {
+            break;
+        }
+
+        while (json_parser_array_next(&parser)) {
+            if (!json_parser_object_start(&parser)) {
+                break;
+            }
+
+            char *ch_key;
+            while (json_parser_object_next_key(&parser, &ch_key)) {
+                json_parser_value(&parser, &value);
+            }
+        }
+    }
+
+    return json_parser_end(&parser);
+}
+
+static const char *valid[] = {
+    "{}",
+    "{\"characteristics\":[]}",
+    "{\"characteristics\":[{}]}",
+    "{\"characteristics\":[{\"aid\":1,\"iid\":9,\"value\":true}]}",
+    " { \"characteristics\" : [ { \"aid\" : 1 , \"iid\" : 9 } , { \"aid\" : 2 , \"iid\" : 9 } ] , \"pid\" : 5 } ",
+    "{\"pid\":5,\"characteristics\":[{\"aid\":1,\"iid\":9,\"value\":[1,2]},{\"aid\":2,\"iid\":9,\"value\":{\"a\":1}}]}",
+    "{\"characteristics\":[{},{}],\"pid\":5}",
+};
+
+static const char *invalid[] = {
+    "{,}",
+    "{,\"pid\":5}",
+    "{\"pid\":5,}",
+    "{\"pid\":5 \"characteristics\":[]}",
+    "{\"pid\":5,,\"characteristics\":[]}",
+    "{\"characteristics\":[,]}",
+    "{\"characteristics\":[,{\"aid\":1}]}",
+    "{\"characteristics\":[{\"aid\":1},]}",
+    "{\"characteristics\":[{\"aid\":1}{\"aid\":2}]}",
+    "{\"characteristics\":[{\"aid\":1 \"iid\":9}]}",
+    "{\"characteristics\":[{,\"aid\":1}]}",
+    "{\"characteristics\":[] \"pid\":5}",
+    "{\"characteristics\":[{\"aid\":1}] \"pid\":5}",
+    "{\"characteristics\":[{\"aid\":1}]",
+};
+
+int main() {
+    for (unsigned int i = 0; i < sizeof(valid) / sizeof(*valid); i++) {
+        if (!parse(valid[i])) {
+            fprintf(stderr, "test_json_parser: refused %s\n", valid[i]);
+            return 1;
+        }
+    }
+
+    for (unsigned int i = 0; i < sizeof(invalid) / sizeof(*invalid); i++) {
+        if (parse(invalid[i])) {
+            fprintf(stderr, "test_json_parser: accepted %s\n", invalid[i]);
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "test_json_parser: OK\n");
+
+    return 0;
+}
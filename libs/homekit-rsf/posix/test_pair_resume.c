@@ -0,0 +1,77 @@
+// Pair Resume of a verified session on new connections, with session ID rotation,
+// and fallback to Pair Verify for unknown session IDs
+
+#include <string.h>
+
+#include "harness.h"
+#include "synthetic_accessories.h"
+
+static homekit_accessory_t **accessories;
+
+static void check_get(controller_t *controller) {
+    homekit_characteristic_t *ch = synthetic_accessories_ch(accessories, 0, HOMEKIT_CHARACTERISTIC_BRIGHTNESS);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/characteristics?id=%d.%d", ch->service->accessory->id, ch->id);
+    HARNESS_CHECK(controller_request(controller, "GET", path, NULL) == 0);
+
+    controller_response_t response;
+    HARNESS_CHECK(controller_read(controller, &response, 2000) == 0);
+    HARNESS_CHECK(response.status == 200);
+    HARNESS_CHECK(strstr((const char*) response.body, "\"value\":100"));
+    controller_response_free(&response);
+}
+
+static void reconnect(controller_t *controller) {
+    controller_disconnect(controller);
+    HARNESS_CHECK(harness_connect(controller, 2000) == 0);
+}
+
+int main() {
+    accessories = synthetic_accessories_new(1);
+
+    harness_pairing_t pairing;
+    HARNESS_CHECK(harness_flash_reset() == 0);
+    HARNESS_CHECK(harness_pairing_add(&pairing, 0) == 0);
+
+    static homekit_server_config_t config;
+    config.accessories = accessories;
+    config.category = HOMEKIT_DEVICE_CATEGORY_BRIDGE;
+    config.setup_id = "TEST";
+    harness_server_start(&config);
+
+    controller_t *controller = harness_controller_new(&pairing);
+    HARNESS_CHECK(controller);
+    check_get(controller);
+
+    // Resumed session is encrypted with keys derived from new shared secret
+    reconnect(controller);
+    const controller_t verified = *controller;
+    HARNESS_CHECK(controller_pair_resume(controller) == 0);
+    HARNESS_CHECK(memcmp(controller->session_id, verified.session_id, CONTROLLER_SESSION_ID_SIZE));
+    HARNESS_CHECK(memcmp(controller->secret, verified.secret, CONTROLLER_KEY_SIZE));
+    check_get(controller);
+
+    // Resumed session can be resumed again
+    reconnect(controller);
+    const controller_t resumed = *controller;
+    HARNESS_CHECK(controller_pair_resume(controller) == 0);
+    check_get(controller);
+
+    // Session IDs are single use: accessory answers with Pair Verify M2
+    reconnect(controller);
+    memcpy(controller->session_id, resumed.session_id, CONTROLLER_SESSION_ID_SIZE);
+    memcpy(controller->secret, resumed.secret, CONTROLLER_KEY_SIZE);
+    HARNESS_CHECK(controller_pair_resume(controller) < 0);
+
+    // Full Pair Verify still works after a refused resume
+    reconnect(controller);
+    HARNESS_CHECK(controller_pair_verify(controller) == 0);
+    check_get(controller);
+
+    controller_free(controller);
+
+    fprintf(stderr, "test_pair_resume: OK\n");
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Requests sent back to back in one encrypted write are all answered, in order,
+// by the server loop iteration that reads them
+
+#include <string.h>
+#include <time.h>
+
+#include "harness.h"
+#include "stats.h"
+#include "synthetic_accessories.h"
+
+// HOMEKIT_ENDPOINT_GET_CHARACTERISTICS of server.c
+#define STATS_CH_GET            (5)
+
+#define LIGHTS                  (4)
+
+static homekit_accessory_t **accessories;
+
+static void settle() {
+    // Server loop ends its iteration after last response is sent
+    const struct timespec delay = { 0, 100000000 };
+    nanosleep(&delay, NULL);
+}
+
+static int format_request(char *buffer, size_t size, const char *method, homekit_characteristic_t *ch, const char *value) {
+    char path[64];
+    char body[128];
+    if (value) {
+        snprintf(path, sizeof(path), "/characteristics");
+        snprintf(body, sizeof(body), "{\"characteristics\":[{\"aid\":%d,\"iid\":%d,\"value\":%s}]}",
+                 ch->service->accessory->id, ch->id, value);
+    } else {
+        snprintf(path, sizeof(path), "/characteristics?id=%d.%d", ch->service->accessory->id, ch->id);
+    }
+
+    return controller_format_request(buffer, size, method, path, "application/hap+json",
+                                     value ? body : NULL, value ? strlen(body) : 0);
+}
+
+static void check_response(controller_t *controller, const int status, homekit_characteristic_t *ch, const char *value) {
+    controller_response_t response;
+    HARNESS_CHECK(controller_read(controller, &response, 2000) == 0);
+    HARNESS_CHECK(!response.event);
+    HARNESS_CHECK(response.status == status);
+
+    if (value) {
+        char expected[64];
+        snprintf(expected, sizeof(expected), "\"aid\":%d,\"iid\":%d,\"value\":%s",
+                 ch->service->accessory->id, ch->id, value);
+        HARNESS_CHECK(strstr((const char*) response.body, expected));
+    }
+
+    controller_response_free(&response);
+}
+
+static void test_gets_in_one_iteration(controller_t *controller) {
+    char batch[1024];
+    int size = 0;
+    for (unsigned int i = 0; i < LIGHTS; i++) {
+        homekit_characteristic_t *ch = synthetic_accessories_ch(accessories, i, HOMEKIT_CHARACTERISTIC_BRIGHTNESS);
+        const int r = format_request(batch + size, sizeof(batch) - size, "GET", ch, NULL);
+        HARNESS_CHECK(r > 0);
+        size += r;
+    }
+
+    settle();
+    const uint32_t loops = homekit_stats.sections[HOMEKIT_STATS_LOOP].count;
+    const uint32_t gets = homekit_stats.sections[STATS_CH_GET].count;
+
+    // One frame, received with a single read
+    HARNESS_CHECK(controller_send(controller, batch, size) == 0);
+
+    for (unsigned int i = 0; i < LIGHTS; i++) {
+        homekit_characteristic_t *ch = synthetic_accessories_ch(accessories, i, HOMEKIT_CHARACTERISTIC_BRIGHTNESS);
+        check_response(controller, 200, ch, "100");
+    }
+
+    settle();
+    HARNESS_CHECK(homekit_stats.sections[STATS_CH_GET].count - gets == LIGHTS);
+    HARNESS_CHECK(homekit_stats.sections[HOMEKIT_STATS_LOOP].count - loops == 1);
+}
+
+static void test_put_then_get(controller_t *controller) {
+    homekit_characteristic_t *on = synthetic_accessories_ch(accessories, 0, HOMEKIT_CHARACTERISTIC_ON);
+    homekit_characteristic_t *brightness = synthetic_accessories_ch(accessories, 0, HOMEKIT_CHARACTERISTIC_BRIGHTNESS);
+
+    char batch[1024];
+    int size = 0;
+    size += format_request(batch + size, sizeof(batch) - size, "PUT", on, "true");
+    size += format_request(batch + size, sizeof(batch) - size, "PUT", brightness, "42");
+    size += format_request(batch + size, sizeof(batch) - size, "GET", on, NULL);
+    size += format_request(batch + size, sizeof(batch) - size, "GET", brightness, NULL);
+
+    HARNESS_CHECK(controller_send(controller, batch, size) == 0);
+
+    // GETs see values written by PUTs before them
+    check_response(controller, 204, NULL, NULL);
+    check_response(controller, 204, NULL, NULL);
+    check_response(controller, 200, on, "true");
+    check_response(controller, 200, brightness, "42");
+}
+
+static void test_split_request(controller_t *controller) {
+    homekit_characteristic_t *ch = synthetic_accessories_ch(accessories, 1, HOMEKIT_CHARACTERISTIC_CURRENT_TEMPERATURE);
+
+    char batch[1024];
+    int size = 0;
+    size += format_request(batch + size, sizeof(batch) - size, "GET", ch, NULL);
+    const int first_size = size;
+    size += format_request(batch + size, sizeof(batch) - size, "GET", ch, NULL);
+
+    // Second request ends in next frame
+    const int split = first_size + (size - first_size) / 2;
+    HARNESS_CHECK(controller_send(controller, batch, split) == 0);
+
+    check_response(controller, 200, ch, "20");
+
+    controller_response_t response;
+    HARNESS_CHECK(controller_read(controller, &response, 300) < 0);
+
+    HARNESS_CHECK(controller_send(controller, batch + split, size - split) == 0);
+    check_response(controller, 200, ch, "20");
+}
+
+int main() {
+    accessories = synthetic_accessories_new(LIGHTS);
+
+    harness_pairing_t pairing;
+    HARNESS_CHECK(harness_flash_reset() == 0);
+    HARNESS_CHECK(harness_pairing_add(&pairing, 0) == 0);
+
+    static homekit_server_config_t config;
+    config.accessories = accessories;
+    config.category = HOMEKIT_DEVICE_CATEGORY_BRIDGE;
+    config.setup_id = "TEST";
+    harness_server_start(&config);
+
+    controller_t *controller = harness_controller_new(&pairing);
+    HARNESS_CHECK(controller);
+
+    test_gets_in_one_iteration(controller);
+    test_put_then_get(controller);
+    test_split_request(controller);
+
+    controller_free(controller);
+
+    fprintf(stderr, "test_pipelined_requests: OK\n");
+
+    return 0;
+}
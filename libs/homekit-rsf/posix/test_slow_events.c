@@ -0,0 +1,92 @@
+// Events of a controller not reading its queued data are deferred, and sent once,
+// with latest values, when it has caught up
+
+#include <string.h>
+#include <time.h>
+
+#include "harness.h"
+#include "stats.h"
+#include "synthetic_accessories.h"
+
+#define LIGHTS                  (10)
+#define NOTIFICATIONS           (5)
+
+// Small enough to keep GET /accessories response queued by server
+#define RECEIVE_BUFFER          (2048)
+
+static homekit_accessory_t **accessories;
+
+static void sleep_ms(const unsigned int ms) {
+    const struct timespec delay = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&delay, NULL);
+}
+
+static void subscribe(controller_t *controller, homekit_characteristic_t *ch) {
+    char body[128];
+    snprintf(body, sizeof(body), "{\"characteristics\":[{\"aid\":%d,\"iid\":%d,\"ev\":true}]}",
+             ch->service->accessory->id, ch->id);
+    HARNESS_CHECK(controller_request(controller, "PUT", "/characteristics", body) == 0);
+
+    controller_response_t response;
+    HARNESS_CHECK(controller_read(controller, &response, 2000) == 0);
+    HARNESS_CHECK(response.status == 204);
+    controller_response_free(&response);
+}
+
+int main() {
+    accessories = synthetic_accessories_new(LIGHTS);
+
+    harness_pairing_t pairing;
+    HARNESS_CHECK(harness_flash_reset() == 0);
+    HARNESS_CHECK(harness_pairing_add(&pairing, 0) == 0);
+
+    static homekit_server_config_t config;
+    config.accessories = accessories;
+    config.category = HOMEKIT_DEVICE_CATEGORY_BRIDGE;
+    config.setup_id = "TEST";
+    harness_server_start(&config);
+
+    controller_t *controller = controller_new(pairing.device_id, pairing.key);
+    HARNESS_CHECK(controller);
+    controller->receive_buffer = RECEIVE_BUFFER;
+    HARNESS_CHECK(harness_connect(controller, 5000) == 0);
+    HARNESS_CHECK(controller_pair_verify(controller) == 0);
+
+    homekit_characteristic_t *ch = synthetic_accessories_sequence(accessories);
+    subscribe(controller, ch);
+
+    // Response is not read yet, so server keeps part of it queued
+    HARNESS_CHECK(controller_request(controller, "GET", "/accessories", NULL) == 0);
+    sleep_ms(200);
+
+    const uint32_t deferred = homekit_stats.events_deferred;
+    for (unsigned int i = 1; i <= NOTIFICATIONS; i++) {
+        ch->value = HOMEKIT_UINT32(i);
+        homekit_characteristic_notify(ch);
+        sleep_ms(50);
+    }
+    HARNESS_CHECK(homekit_stats.events_deferred - deferred == NOTIFICATIONS);
+
+    controller_response_t response;
+    HARNESS_CHECK(controller_read(controller, &response, 2000) == 0);
+    HARNESS_CHECK(!response.event);
+    HARNESS_CHECK(response.status == 200);
+    controller_response_free(&response);
+
+    // Deferred events are coalesced into the latest value
+    char expected[64];
+    snprintf(expected, sizeof(expected), "\"aid\":%d,\"iid\":%d,\"value\":%d",
+             ch->service->accessory->id, ch->id, NOTIFICATIONS);
+    HARNESS_CHECK(controller_read(controller, &response, 2000) == 0);
+    HARNESS_CHECK(response.event);
+    HARNESS_CHECK(strstr((const char*) response.body, expected));
+    controller_response_free(&response);
+
+    HARNESS_CHECK(controller_read(controller, &response, 300) < 0);
+
+    controller_free(controller);
+
+    fprintf(stderr, "test_slow_events: OK\n");
+
+    return 0;
+}
@@ -220,6 +220,7 @@ homekit_characteristic_t* homekit_characteristic_clone(homekit_characteristic_t*
     clone->format = ch->format;
     clone->unit = ch->unit;
     clone->permissions = ch->permissions;
+    clone->telemetry = ch->telemetry;
     homekit_value_copy(&clone->value, &ch->value);
 
     if (ch->min_value) {
@@ -366,6 +367,63 @@ homekit_accessory_t* homekit_accessory_clone(homekit_accessory_t* ac) {
     return clone;
 }
 
+// Characteristics sorted by (aid, iid), built by homekit_accessories_init()
+static homekit_accessory_t **characteristic_index_accessories = NULL;
+static homekit_characteristic_t **characteristic_index = NULL;
+static unsigned int characteristic_index_size = 0;
+
+static int characteristic_index_compare(const void *a, const void *b) {
+    const homekit_characteristic_t *ch_a = *(homekit_characteristic_t **) a;
+    const homekit_characteristic_t *ch_b = *(homekit_characteristic_t **) b;
+
+    if (ch_a->service->accessory->id != ch_b->service->accessory->id)
+        return ch_a->service->accessory->id < ch_b->service->accessory->id ? -1 : 1;
+
+    if (ch_a->id != ch_b->id)
+        return ch_a->id < ch_b->id ? -1 : 1;
+
+    return 0;
+}
+
+static void characteristic_index_build(homekit_accessory_t **accessories) {
+    if (characteristic_index) {
+        free(characteristic_index);
+        characteristic_index = NULL;
+    }
+    characteristic_index_accessories = NULL;
+    characteristic_index_size = 0;
+
+    unsigned int count = 0;
+    for (homekit_accessory_t **accessory_it = accessories; *accessory_it; accessory_it++) {
+        for (homekit_service_t **service_it = (*accessory_it)->services; *service_it; service_it++) {
+            for (homekit_characteristic_t **ch_it = (*service_it)->characteristics; *ch_it; ch_it++) {
+                count++;
+            }
+        }
+    }
+
+    if (count == 0)
+        return;
+
+    characteristic_index = malloc(count * sizeof(homekit_characteristic_t*));
+    if (!characteristic_index)
+        return;     // Lookups fall back to linear search
+
+    unsigned int i = 0;
+    for (homekit_accessory_t **accessory_it = accessories; *accessory_it; accessory_it++) {
+        for (homekit_service_t **service_it = (*accessory_it)->services; *service_it; service_it++) {
+            for (homekit_characteristic_t **ch_it = (*service_it)->characteristics; *ch_it; ch_it++) {
+                characteristic_index[i++] = *ch_it;
+            }
+        }
+    }
+
+    qsort(characteristic_index, count, sizeof(homekit_characteristic_t*), characteristic_index_compare);
+
+    characteristic_index_accessories = accessories;
+    characteristic_index_size = count;
+}
+
 void homekit_accessories_init(homekit_accessory_t **accessories) {
     int aid = 1;
     for (homekit_accessory_t **accessory_it = accessories; *accessory_it; accessory_it++) {
@@ -402,6 +460,8 @@ void homekit_accessories_init(homekit_accessory_t **accessories) {
             }
         }
     }
+
+    characteristic_index_build(accessories);
 }
 
 homekit_accessory_t *homekit_accessory_by_id(homekit_accessory_t **accessories, int aid) {
@@ -438,6 +498,27 @@ homekit_characteristic_t *homekit_service_characteristic_by_type(homekit_service
 }
 
 homekit_characteristic_t *homekit_characteristic_by_aid_and_iid(homekit_accessory_t **accessories, int aid, int iid) {
+    if (accessories == characteristic_index_accessories) {
+        unsigned int low = 0;
+        unsigned int high = characteristic_index_size;
+        while (low < high) {
+            const unsigned int mid = (low + high) / 2;
+            homekit_characteristic_t *ch = characteristic_index[mid];
+            const int ch_aid = ch->service->accessory->id;
+
+            if (ch_aid == aid && ch->id == iid)
+                return ch;
+
+            if (ch_aid < aid || (ch_aid == aid && ch->id < iid)) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        return NULL;
+    }
+
     for (homekit_accessory_t **accessory_it = accessories; *accessory_it; accessory_it++) {
         homekit_accessory_t *accessory = *accessory_it;
 
@@ -485,69 +566,34 @@ homekit_characteristic_t *homekit_characteristic_find_by_type(homekit_accessory_
 
 void homekit_characteristic_add_notify_subscription(
     homekit_characteristic_t *ch,
-    void *context
+    const uint8_t slot
 ) {
-    homekit_characteristic_subscription_t *new_subscription = malloc(sizeof(homekit_characteristic_subscription_t));
-    new_subscription->context = context;
-    new_subscription->next = NULL;
-
-    if (!ch->subscriptions) {
-        ch->subscriptions = new_subscription;
-    } else {
-        homekit_characteristic_subscription_t *subscription = ch->subscriptions;
-        if (subscription->context == context) {
-            free(new_subscription);
-            return;
-        }
-
-        while (subscription->next) {
-            if (subscription->next->context == context) {
-                free(new_subscription);
-                return;
-            }
-            subscription = subscription->next;
-        }
-
-        subscription->next = new_subscription;
-    }
+    ch->subscriptions |= (1UL << slot);
 }
 
 
 void homekit_characteristic_remove_notify_subscription(
     homekit_characteristic_t *ch,
-    void *context
+    const uint8_t slot
 ) {
-    while (ch->subscriptions) {
-        if (ch->subscriptions->context != context) {
-            break;
-        }
-
-        homekit_characteristic_subscription_t *c = ch->subscriptions;
-        ch->subscriptions = ch->subscriptions->next;
-        free(c);
-    }
-
-    if (!ch->subscriptions)
-        return;
-
-    homekit_characteristic_subscription_t *subscription = ch->subscriptions;
-    while (subscription->next) {
-        if (subscription->next->context == context) {
-            homekit_characteristic_subscription_t *c = subscription->next;
-            subscription->next = subscription->next->next;
-            free(c);
-        } else {
-            subscription = subscription->next;
-        }
-    }
+    ch->subscriptions &= ~(1UL << slot);
+    ch->events_pending &= ~(1UL << slot);
 }
 
 
 // Removes particular subscription from all characteristics
 void homekit_accessories_clear_notify_subscriptions(
     homekit_accessory_t **accessories,
-    void *context
+    const uint8_t slot
 ) {
+    if (accessories == characteristic_index_accessories) {
+        for (unsigned int i = 0; i < characteristic_index_size; i++) {
+            homekit_characteristic_remove_notify_subscription(characteristic_index[i], slot);
+        }
+
+        return;
+    }
+
     for (homekit_accessory_t **accessory_it = accessories; *accessory_it; accessory_it++) {
         homekit_accessory_t *accessory = *accessory_it;
 
@@ -557,7 +603,7 @@ void homekit_accessories_clear_notify_subscriptions(
             for (homekit_characteristic_t **ch_it = service->characteristics; *ch_it; ch_it++) {
                 homekit_characteristic_t *ch = *ch_it;
 
-                homekit_characteristic_remove_notify_subscription(ch, context);
+                homekit_characteristic_remove_notify_subscription(ch, slot);
             }
         }
     }
@@ -566,16 +612,7 @@ void homekit_accessories_clear_notify_subscriptions(
 
 bool homekit_characteristic_has_notify_subscription(
     const homekit_characteristic_t *ch,
-    void *context
+    const uint8_t slot
 ) {
-    homekit_characteristic_subscription_t *subscription = ch->subscriptions;
-    while (subscription) {
-        if (subscription->context == context)
-            return true;
-
-        subscription = subscription->next;
-    }
-
-    return false;
+    return (ch->subscriptions & (1UL << slot)) != 0;
 }
-
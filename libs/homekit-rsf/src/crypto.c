@@ -7,6 +7,8 @@
 #include <wolfssl/wolfcrypt/curve25519.h>
 #include <wolfssl/wolfcrypt/sha512.h>
 #include <wolfssl/wolfcrypt/chacha20_poly1305.h>
+#include <wolfssl/wolfcrypt/chacha.h>
+#include <wolfssl/wolfcrypt/poly1305.h>
 #include <wolfssl/wolfcrypt/srp.h>
 #include <wolfssl/wolfcrypt/error-crypt.h>
 
@@ -327,6 +329,33 @@ int crypto_chacha20poly1305_encrypt(
 }
 
 
+int crypto_chacha20poly1305_empty_tag(const byte *key, const byte *nonce, byte *tag) {
+    byte poly1305_key[CHACHA20_POLY1305_AEAD_KEYSIZE];
+    memset(poly1305_key, 0, sizeof(poly1305_key));
+
+    ChaCha chacha;
+    int r = wc_Chacha_SetKey(&chacha, key, CHACHA20_POLY1305_AEAD_KEYSIZE);
+    if (!r)
+        r = wc_Chacha_SetIV(&chacha, nonce, 0);
+    if (!r)
+        r = wc_Chacha_Process(&chacha, poly1305_key, poly1305_key, sizeof(poly1305_key));
+    if (r)
+        return r;
+
+    // Only AAD and message lengths are authenticated, both 0
+    const byte lengths[16] = { 0 };
+
+    Poly1305 poly1305;
+    r = wc_Poly1305SetKey(&poly1305, poly1305_key, sizeof(poly1305_key));
+    if (!r)
+        r = wc_Poly1305Update(&poly1305, lengths, sizeof(lengths));
+    if (!r)
+        r = wc_Poly1305Final(&poly1305, tag);
+
+    return r;
+}
+
+
 ed25519_key *crypto_ed25519_new() {
     ed25519_key *key = malloc(sizeof(ed25519_key));
     int r = wc_ed25519_init(key);
@@ -342,6 +371,13 @@ void crypto_ed25519_free(ed25519_key *key) {
         free(key);
 }
 
+ed25519_key *crypto_ed25519_clone(const ed25519_key *key) {
+    ed25519_key *clone = malloc(sizeof(ed25519_key));
+    if (clone)
+        memcpy(clone, key, sizeof(ed25519_key));
+    return clone;
+}
+
 ed25519_key *crypto_ed25519_generate() {
     ed25519_key *key = crypto_ed25519_new();
     
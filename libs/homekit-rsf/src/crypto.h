@@ -52,6 +52,8 @@ int crypto_chacha20poly1305_decrypt(
     const byte *message, size_t message_size,
     byte *decrypted, size_t *descrypted_size
 );
+// Auth tag of an empty message without AAD, not supported by AEAD functions
+int crypto_chacha20poly1305_empty_tag(const byte *key, const byte *nonce, byte *tag);
 
 // ED25519
 struct _ed25519_key;
@@ -60,6 +62,7 @@ typedef struct _ed25519_key ed25519_key;
 ed25519_key *crypto_ed25519_new();
 ed25519_key *crypto_ed25519_generate();
 void crypto_ed25519_free(ed25519_key *key);
+ed25519_key *crypto_ed25519_clone(const ed25519_key *key);
 
 int crypto_ed25519_import_key(
     ed25519_key *key,
@@ -1,7 +1,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
+#include <string.h>
+#include <math.h>
 #include "json.h"
 #include "debug.h"
 
@@ -63,34 +64,217 @@ void json_flush(json_stream *json) {
     json->pos = 0;
 }
 
-void json_write(json_stream *json, const char *format, ...) {
-    va_list arg_ptr;
+void json_raw(json_stream *json, const uint8_t *data, size_t size) {
+    while (size > 0 && !json->error) {
+        if (json->pos == json->size) {
+            json_flush(json);
+            continue;
+        }
+        
+        size_t chunk_size = json->size - json->pos;
+        if (chunk_size > size) {
+            chunk_size = size;
+        }
+        
+        memcpy(json->buffer + json->pos, data, chunk_size);
+        json->pos += chunk_size;
+        data += chunk_size;
+        size -= chunk_size;
+    }
+}
+
+static inline void json_write(json_stream *json, const char *data, size_t size) {
+    if (json->error) {
+        return;
+    }
     
-    va_start(arg_ptr, format);
-    size_t len = vsnprintf((char *)json->buffer + json->pos, json->size - json->pos, format, arg_ptr);
-    va_end(arg_ptr);
+    if (json->size - json->pos >= size) {
+        memcpy(json->buffer + json->pos, data, size);
+        json->pos += size;
+    } else {
+        json_raw(json, (const uint8_t*) data, size);
+    }
+}
 
-    if (len + json->pos > json->size - 1) {
+static inline void json_write_char(json_stream *json, const char c) {
+    if (json->error) {
+        return;
+    }
+    
+    if (json->pos == json->size) {
         json_flush(json);
-        
         if (json->error) {
             return;
         }
+    }
+    
+    json->buffer[json->pos++] = c;
+}
 
-        va_start(arg_ptr, format);
-        size_t len2 = vsnprintf((char *)json->buffer + json->pos, json->size - json->pos, format, arg_ptr);
-        va_end(arg_ptr);
+#define json_write_literal(json, literal)   json_write(json, literal, sizeof(literal) - 1)
+
+static void json_write_integer(json_stream *json, long long x) {
+    char buffer[21];
+    char *p = buffer + sizeof(buffer);
+    
+    unsigned long long value = x < 0 ? -((unsigned long long) x) : (unsigned long long) x;
+    
+    if (value <= UINT32_MAX) {
+        // 32 bits division is much faster than 64 bits one
+        uint32_t value32 = value;
+        do {
+            *--p = '0' + (value32 % 10);
+            value32 /= 10;
+        } while (value32);
+    } else {
+        do {
+            *--p = '0' + (value % 10);
+            value /= 10;
+        } while (value);
+    }
+    
+    if (x < 0) {
+        *--p = '-';
+    }
+    
+    json_write(json, p, buffer + sizeof(buffer) - p);
+}
+
+static double json_pow10(unsigned int n) {
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    
+    double result = 1;
+    while (n > 22) {
+        result *= 1e22;
+        n -= 22;
+    }
+    
+    return result * pow10[n];
+}
+
+// Same output as printf "%1.7g"
+static void json_write_float(json_stream *json, float x) {
+    char buffer[24];
+    char *p = buffer;
+    
+    double value = x;
+    
+    if (value != value) {
+        json_write_literal(json, "nan");
+        return;
+    }
+    
+    if (signbit(x)) {
+        *p++ = '-';
+        value = -value;
+    }
+    
+    if (value == 0) {
+        *p++ = '0';
+        json_write(json, buffer, p - buffer);
+        return;
+    }
+    
+    if (isinf(value)) {
+        memcpy(p, "inf", 3);
+        p += 3;
+        json_write(json, buffer, p - buffer);
+        return;
+    }
+    
+    // Decimal exponent
+    int exponent = 0;
+    if (value >= 1) {
+        while (value >= json_pow10(exponent + 1)) {
+            exponent++;
+        }
+    } else {
+        while (value * json_pow10(-exponent) < 1) {
+            exponent--;
+        }
+    }
+    
+    // 7 significant digits
+    int shift = 6 - exponent;
+    double scaled = shift >= 0 ? value * json_pow10(shift) : value / json_pow10(-shift);
+    if (scaled < 1e6) {
+        scaled *= 10;
+        exponent--;
+    } else if (scaled >= 1e7) {
+        scaled /= 10;
+        exponent++;
+    }
+    
+    uint32_t mantissa = scaled;
+    const double fraction = scaled - mantissa;
+    if (fraction > 0.5 || (fraction == 0.5 && (mantissa & 1))) {
+        mantissa++;
+    }
+    
+    if (mantissa >= 10000000) {
+        mantissa /= 10;
+        exponent++;
+    }
+    
+    char digits[7];
+    for (int i = 6; i >= 0; i--) {
+        digits[i] = '0' + (mantissa % 10);
+        mantissa /= 10;
+    }
+    
+    int digits_count = 7;
+    while (digits_count > 1 && digits[digits_count - 1] == '0') {
+        digits_count--;
+    }
+    
+    if (exponent < -4 || exponent >= 7) {
+        *p++ = digits[0];
+        if (digits_count > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, digits_count - 1);
+            p += digits_count - 1;
+        }
         
-        if (len2 + 1 > json->size) {
-            ERROR("Too large %i/%i", len2, json->size);
-            DEBUG("Format = %s", format);
-            DEBUG("Data = %s", (char *)json->buffer);
+        *p++ = 'e';
+        if (exponent < 0) {
+            *p++ = '-';
+            exponent = -exponent;
         } else {
-            json->pos += len2;
+            *p++ = '+';
+        }
+        
+        if (exponent >= 100) {
+            *p++ = '0' + (exponent / 100);
+            exponent %= 100;
         }
+        *p++ = '0' + (exponent / 10);
+        *p++ = '0' + (exponent % 10);
+        
+    } else if (exponent < 0) {
+        *p++ = '0';
+        *p++ = '.';
+        for (int i = -1; i > exponent; i--) {
+            *p++ = '0';
+        }
+        memcpy(p, digits, digits_count);
+        p += digits_count;
+        
     } else {
-        json->pos += len;
+        for (int i = 0; i <= exponent; i++) {
+            *p++ = i < digits_count ? digits[i] : '0';
+        }
+        
+        if (digits_count > exponent + 1) {
+            *p++ = '.';
+            memcpy(p, digits + exponent + 1, digits_count - exponent - 1);
+            p += digits_count - exponent - 1;
+        }
     }
+    
+    json_write(json, buffer, p - buffer);
 }
 
 void json_object_start(json_stream *json) {
@@ -101,11 +285,11 @@ void json_object_start(json_stream *json) {
 
     switch (json->state) {
         case JSON_STATE_ARRAY_ITEM:
-            json_write(json, ",");
+            json_write_char(json, ',');
         case JSON_STATE_START:
         case JSON_STATE_OBJECT_KEY:
         case JSON_STATE_ARRAY:
-            json_write(json, "{");
+            json_write_char(json, '{');
 
             json->state = JSON_STATE_OBJECT;
             json->nesting[json->nesting_idx++] = JSON_NESTING_OBJECT;
@@ -126,7 +310,7 @@ void json_object_end(json_stream *json) {
     switch (json->state) {
         case JSON_STATE_OBJECT:
         case JSON_STATE_OBJECT_VALUE:
-            json_write(json, "}");
+            json_write_char(json, '}');
 
             json->nesting_idx--;
             if (!json->nesting_idx) {
@@ -157,11 +341,11 @@ void json_array_start(json_stream *json) {
 
     switch (json->state) {
         case JSON_STATE_ARRAY_ITEM:
-            json_write(json, ",");
+            json_write_char(json, ',');
         case JSON_STATE_START:
         case JSON_STATE_OBJECT_KEY:
         case JSON_STATE_ARRAY:
-            json_write(json, "[");
+            json_write_char(json, '[');
 
             json->state = JSON_STATE_ARRAY;
             json->nesting[json->nesting_idx++] = JSON_NESTING_ARRAY;
@@ -182,7 +366,7 @@ void json_array_end(json_stream *json) {
     switch (json->state) {
         case JSON_STATE_ARRAY:
         case JSON_STATE_ARRAY_ITEM:
-            json_write(json, "]");
+            json_write_char(json, ']');
 
             json->nesting_idx--;
             if (!json->nesting_idx) {
@@ -212,7 +396,7 @@ void json_integer(json_stream *json, long long x) {
         return;
 
     void _do_write() {
-        json_write(json, "%ld", x);
+        json_write_integer(json, x);
     }
 
     switch (json->state) {
@@ -221,7 +405,7 @@ void json_integer(json_stream *json, long long x) {
             json->state = JSON_STATE_END;
             break;
         case JSON_STATE_ARRAY_ITEM:
-            json_write(json, ",");
+            json_write_char(json, ',');
         case JSON_STATE_ARRAY:
             _do_write();
             json->state = JSON_STATE_ARRAY_ITEM;
@@ -244,8 +428,7 @@ void json_float(json_stream *json, float x) {
         return;
 
     void _do_write() {
-        //json_write(json, "%1.15g", x);
-        json_write(json, "%1.7g", x);
+        json_write_float(json, x);
     }
 
     switch (json->state) {
@@ -254,7 +437,7 @@ void json_float(json_stream *json, float x) {
             json->state = JSON_STATE_END;
             break;
         case JSON_STATE_ARRAY_ITEM:
-            json_write(json, ",");
+            json_write_char(json, ',');
         case JSON_STATE_ARRAY:
             _do_write();
             json->state = JSON_STATE_ARRAY_ITEM;
@@ -278,7 +461,9 @@ void json_string(json_stream *json, const char *x) {
 
     void _do_write() {
         // TODO: escape string
-        json_write(json, "\"%s\"", x);
+        json_write_char(json, '"');
+        json_write(json, x, strlen(x));
+        json_write_char(json, '"');
     }
 
     switch (json->state) {
@@ -287,16 +472,16 @@ void json_string(json_stream *json, const char *x) {
             json->state = JSON_STATE_END;
             break;
         case JSON_STATE_ARRAY_ITEM:
-            json_write(json, ",");
+            json_write_char(json, ',');
         case JSON_STATE_ARRAY:
             _do_write();
             json->state = JSON_STATE_ARRAY_ITEM;
             break;
         case JSON_STATE_OBJECT_VALUE:
-            json_write(json, ",");
+            json_write_char(json, ',');
         case JSON_STATE_OBJECT:
             _do_write();
-            json_write(json, ":");
+            json_write_char(json, ':');
             json->state = JSON_STATE_OBJECT_KEY;
             break;
         case JSON_STATE_OBJECT_KEY:
@@ -317,7 +502,11 @@ void json_boolean(json_stream *json, bool x) {
         return;
 
     void _do_write() {
-        json_write(json, (x) ? "true" : "false");
+        if (x) {
+            json_write_literal(json, "true");
+        } else {
+            json_write_literal(json, "false");
+        }
     }
 
     switch (json->state) {
@@ -326,7 +515,7 @@ void json_boolean(json_stream *json, bool x) {
             json->state = JSON_STATE_END;
             break;
         case JSON_STATE_ARRAY_ITEM:
-            json_write(json, ",");
+            json_write_char(json, ',');
         case JSON_STATE_ARRAY:
             _do_write();
             json->state = JSON_STATE_ARRAY_ITEM;
@@ -349,7 +538,7 @@ void json_null(json_stream *json) {
         return;
 
     void _do_write() {
-        json_write(json, "null");
+        json_write_literal(json, "null");
     }
 
     switch (json->state) {
@@ -358,7 +547,7 @@ void json_null(json_stream *json) {
             json->state = JSON_STATE_END;
             break;
         case JSON_STATE_ARRAY_ITEM:
-            json_write(json, ",");
+            json_write_char(json, ',');
         case JSON_STATE_ARRAY:
             _do_write();
             json->state = JSON_STATE_ARRAY_ITEM;
@@ -36,6 +36,9 @@ void json_buffer_free(json_stream *json);
 
 void json_flush(json_stream *json);
 
+// Writes already serialized JSON. Stream state is not changed
+void json_raw(json_stream *json, const uint8_t *data, size_t size);
+
 void json_object_start(json_stream *json);
 void json_object_end(json_stream *json);
 
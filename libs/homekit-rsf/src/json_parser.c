@@ -0,0 +1,390 @@
+#include <limits.h>
+#include <string.h>
+#include "json_parser.h"
+
+
+static void json_parser_skip_whitespace(json_parser_t *parser) {
+    while (*parser->pos == ' ' || *parser->pos == '\t' || *parser->pos == '\r' || *parser->pos == '\n') {
+        parser->pos++;
+    }
+}
+
+static bool json_parser_expect(json_parser_t *parser, const char c) {
+    if (parser->error) {
+        return false;
+    }
+
+    json_parser_skip_whitespace(parser);
+    if (*parser->pos != c) {
+        parser->error = true;
+        return false;
+    }
+
+    parser->pos++;
+    return true;
+}
+
+static int json_parser_hex(const char *s) {
+    int x = 0;
+    for (int i = 0; i < 4; i++) {
+        x <<= 4;
+        if (s[i] >= '0' && s[i] <= '9') {
+            x |= s[i] - '0';
+        } else if (s[i] >= 'a' && s[i] <= 'f') {
+            x |= s[i] - 'a' + 10;
+        } else if (s[i] >= 'A' && s[i] <= 'F') {
+            x |= s[i] - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+
+    return x;
+}
+
+// Unescapes string in place. Result is always shorter than source
+static char *json_parser_string(json_parser_t *parser) {
+    if (!json_parser_expect(parser, '"')) {
+        return NULL;
+    }
+
+    char *result = parser->pos;
+    char *out = parser->pos;
+    char *p = parser->pos;
+
+    while (*p != '"') {
+        if (*p == 0) {
+            parser->error = true;
+            return NULL;
+        }
+
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+
+        p++;
+        switch (*p) {
+            case '"':
+            case '\\':
+            case '/':
+                *out++ = *p++;
+                break;
+            case 'b': *out++ = '\b'; p++; break;
+            case 'f': *out++ = '\f'; p++; break;
+            case 'n': *out++ = '\n'; p++; break;
+            case 'r': *out++ = '\r'; p++; break;
+            case 't': *out++ = '\t'; p++; break;
+            case 'u': {
+                long code = json_parser_hex(p + 1);
+                if (code < 0) {
+                    parser->error = true;
+                    return NULL;
+                }
+                p += 5;
+
+                if (code >= 0xD800 && code <= 0xDBFF && p[0] == '\\' && p[1] == 'u') {
+                    const int low = json_parser_hex(p + 2);
+                    if (low >= 0xDC00 && low <= 0xDFFF) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                }
+
+                if (code < 0x80) {
+                    *out++ = code;
+                } else if (code < 0x800) {
+                    *out++ = 0xC0 | (code >> 6);
+                    *out++ = 0x80 | (code & 0x3F);
+                } else if (code < 0x10000) {
+                    *out++ = 0xE0 | (code >> 12);
+                    *out++ = 0x80 | ((code >> 6) & 0x3F);
+                    *out++ = 0x80 | (code & 0x3F);
+                } else {
+                    *out++ = 0xF0 | (code >> 18);
+                    *out++ = 0x80 | ((code >> 12) & 0x3F);
+                    *out++ = 0x80 | ((code >> 6) & 0x3F);
+                    *out++ = 0x80 | (code & 0x3F);
+                }
+                break;
+            }
+            default:
+                parser->error = true;
+                return NULL;
+        }
+    }
+
+    parser->pos = p + 1;
+    *out = 0;
+
+    return result;
+}
+
+static bool json_parser_number(json_parser_t *parser, double *number) {
+    char *p = parser->pos;
+
+    bool negative = false;
+    if (*p == '-') {
+        negative = true;
+        p++;
+    }
+
+    if (*p < '0' || *p > '9') {
+        parser->error = true;
+        return false;
+    }
+
+    double mantissa = 0;
+    int exponent = 0;
+
+    while (*p >= '0' && *p <= '9') {
+        mantissa = mantissa * 10 + (*p++ - '0');
+    }
+
+    if (*p == '.') {
+        p++;
+        while (*p >= '0' && *p <= '9') {
+            mantissa = mantissa * 10 + (*p++ - '0');
+            exponent--;
+        }
+    }
+
+    if (*p == 'e' || *p == 'E') {
+        p++;
+
+        bool exponent_negative = false;
+        if (*p == '-' || *p == '+') {
+            exponent_negative = (*p == '-');
+            p++;
+        }
+
+        int e = 0;
+        while (*p >= '0' && *p <= '9') {
+            if (e < 1000) {
+                e = e * 10 + (*p - '0');
+            }
+            p++;
+        }
+
+        exponent += exponent_negative ? -e : e;
+    }
+
+    while (exponent > 0) {
+        mantissa *= 10;
+        exponent--;
+    }
+
+    double divisor = 1;
+    while (exponent < 0) {
+        divisor *= 10;
+        exponent++;
+    }
+
+    *number = (negative ? -mantissa : mantissa) / divisor;
+    parser->pos = p;
+
+    return true;
+}
+
+static void json_parser_skip_compound(json_parser_t *parser) {
+    int depth = 0;
+    char *p = parser->pos;
+
+    do {
+        switch (*p) {
+            case 0:
+                parser->error = true;
+                return;
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                depth--;
+                break;
+            case '"':
+                p++;
+                while (*p != '"') {
+                    if (*p == 0) {
+                        parser->error = true;
+                        return;
+                    }
+                    if (*p == '\\' && p[1]) {
+                        p++;
+                    }
+                    p++;
+                }
+                break;
+        }
+
+        p++;
+    } while (depth > 0);
+
+    parser->pos = p;
+}
+
+void json_parser_init(json_parser_t *parser, char *data) {
+    parser->pos = data;
+    parser->error = false;
+    parser->separator = false;
+}
+
+bool json_parser_object_start(json_parser_t *parser) {
+    parser->separator = false;
+    return json_parser_expect(parser, '{');
+}
+
+bool json_parser_array_start(json_parser_t *parser) {
+    parser->separator = false;
+    return json_parser_expect(parser, '[');
+}
+
+// Consumes end of object or array, or separator of its next key or item. Ended object or
+// array is an item of its parent, so next one of parent needs a separator
+static bool json_parser_next(json_parser_t *parser, const char end) {
+    if (parser->error) {
+        return false;
+    }
+
+    json_parser_skip_whitespace(parser);
+    if (*parser->pos == end) {
+        parser->pos++;
+        parser->separator = true;
+        return false;
+    }
+
+    if (parser->separator != (*parser->pos == ',')) {
+        // Missing, or leading, separator
+        parser->error = true;
+        return false;
+    }
+
+    if (parser->separator) {
+        parser->pos++;
+    }
+    parser->separator = true;
+
+    return true;
+}
+
+bool json_parser_object_next_key(json_parser_t *parser, char **key) {
+    if (!json_parser_next(parser, '}')) {
+        return false;
+    }
+
+    *key = json_parser_string(parser);
+
+    return json_parser_expect(parser, ':');
+}
+
+bool json_parser_array_next(json_parser_t *parser) {
+    return json_parser_next(parser, ']');
+}
+
+bool json_parser_value(json_parser_t *parser, json_parser_value_t *value) {
+    memset(value, 0, sizeof(*value));
+
+    if (parser->error) {
+        return false;
+    }
+
+    json_parser_skip_whitespace(parser);
+
+    switch (*parser->pos) {
+        case '"':
+            value->valuestring = json_parser_string(parser);
+            value->type = JSON_PARSER_TYPE_STRING;
+            break;
+
+        case '{':
+        case '[':
+            json_parser_skip_compound(parser);
+            value->type = JSON_PARSER_TYPE_COMPOUND;
+            break;
+
+        case 't':
+            if (!strncmp(parser->pos, "true", 4)) {
+                parser->pos += 4;
+                value->type = JSON_PARSER_TYPE_TRUE;
+                value->valueint = 1;
+                value->valuedouble = 1;
+            } else {
+                parser->error = true;
+            }
+            break;
+
+        case 'f':
+            if (!strncmp(parser->pos, "false", 5)) {
+                parser->pos += 5;
+                value->type = JSON_PARSER_TYPE_FALSE;
+            } else {
+                parser->error = true;
+            }
+            break;
+
+        case 'n':
+            if (!strncmp(parser->pos, "null", 4)) {
+                parser->pos += 4;
+                value->type = JSON_PARSER_TYPE_NULL;
+            } else {
+                parser->error = true;
+            }
+            break;
+
+        default:
+            if (json_parser_number(parser, &value->valuedouble)) {
+                value->type = JSON_PARSER_TYPE_NUMBER;
+
+                // Same saturation as cJSON
+                if (value->valuedouble >= INT_MAX) {
+                    value->valueint = INT_MAX;
+                } else if (value->valuedouble <= (double) INT_MIN) {
+                    value->valueint = INT_MIN;
+                } else {
+                    value->valueint = (int) value->valuedouble;
+                }
+            }
+    }
+
+    if (parser->error) {
+        value->type = JSON_PARSER_TYPE_NONE;
+        return false;
+    }
+
+    return true;
+}
+
+bool json_parser_uint64(json_parser_t *parser, uint64_t *value) {
+    json_parser_skip_whitespace(parser);
+    const char *start = parser->pos;
+    
+    json_parser_value_t number;
+    if (!json_parser_value(parser, &number) || number.type != JSON_PARSER_TYPE_NUMBER) {
+        return false;
+    }
+    
+    uint64_t x = 0;
+    const char *p = start;
+    while (p < parser->pos) {
+        if (*p < '0' || *p > '9' || x > (UINT64_MAX - (*p - '0')) / 10) {
+            return false;
+        }
+        
+        x = x * 10 + (*p++ - '0');
+    }
+    
+    *value = x;
+    
+    return true;
+}
+
+bool json_parser_end(json_parser_t *parser) {
+    if (parser->error) {
+        return false;
+    }
+
+    json_parser_skip_whitespace(parser);
+
+    return *parser->pos == 0;
+}
@@ -0,0 +1,53 @@
+#ifndef __HOMEKIT_JSON_PARSER__
+#define __HOMEKIT_JSON_PARSER__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Pull JSON parser working in place over a mutable NUL terminated buffer.
+// Strings are unescaped in place, so nothing is allocated. Whole document must be
+// in buffer: parser is not incremental.
+
+#define JSON_PARSER_TYPE_NONE       (0)
+#define JSON_PARSER_TYPE_NULL       (1)
+#define JSON_PARSER_TYPE_FALSE      (2)
+#define JSON_PARSER_TYPE_TRUE       (3)
+#define JSON_PARSER_TYPE_NUMBER     (4)
+#define JSON_PARSER_TYPE_STRING     (5)
+#define JSON_PARSER_TYPE_COMPOUND   (6)     // Object or array, skipped
+
+typedef struct {
+    uint8_t type;
+    int valueint;           // Saturated integer value of a number
+    double valuedouble;
+    char *valuestring;      // Points inside parsed buffer
+} json_parser_value_t;
+
+typedef struct {
+    char *pos;
+    bool error;
+    bool separator;         // Next key or item of current object or array needs ','
+} json_parser_t;
+
+void json_parser_init(json_parser_t *parser, char *data);
+
+// Consume '{' or '['
+bool json_parser_object_start(json_parser_t *parser);
+bool json_parser_array_start(json_parser_t *parser);
+
+// Return false when object or array ends, or on error
+bool json_parser_object_next_key(json_parser_t *parser, char **key);
+bool json_parser_array_next(json_parser_t *parser);
+
+// Parse any value. Objects and arrays are skipped
+bool json_parser_value(json_parser_t *parser, json_parser_value_t *value);
+
+// Parse any value. Return true if it is an unsigned integer fitting 64 bits, without
+// precision loss of double
+bool json_parser_uint64(json_parser_t *parser, uint64_t *value);
+
+// Return true if only whitespace is left
+bool json_parser_end(json_parser_t *parser);
+
+#endif // __HOMEKIT_JSON_PARSER__
@@ -49,6 +49,135 @@ void homekit_mdns_configure_finalize(const uint16_t mdns_ttl, const uint16_t mdn
     */
 }
 
+#elif defined(HOMEKIT_POSIX)
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "port.h"
+
+void homekit_random_fill(uint8_t *data, size_t size) {
+    static int fd = -1;
+    if (fd < 0) {
+        fd = open("/dev/urandom", O_RDONLY);
+    }
+    
+    while (size > 0) {
+        ssize_t r = read(fd, data, size);
+        if (r <= 0) {
+            abort();
+        }
+        data += r;
+        size -= r;
+    }
+}
+
+uint32_t homekit_random() {
+    uint32_t x;
+    homekit_random_fill((uint8_t*) &x, sizeof(x));
+    return x;
+}
+
+void homekit_mdns_init() {
+}
+
+void homekit_mdns_buffer_set(const uint16_t size) {
+    (void) size;
+}
+
+static char mdns_instance_name[65] = {0};
+static char mdns_txt_rec[128] = {0};
+static int mdns_port = 80;
+
+void homekit_mdns_configure_init(const char *instance_name, int port) {
+    strncpy(mdns_instance_name, instance_name, sizeof(mdns_instance_name) - 1);
+    mdns_txt_rec[0] = 0;
+    mdns_port = port;
+}
+
+void homekit_mdns_add_txt(const char *key, const char *format, ...) {
+    va_list arg_ptr;
+    va_start(arg_ptr, format);
+
+    char value[128];
+    int value_len = vsnprintf(value, sizeof(value), format, arg_ptr);
+
+    va_end(arg_ptr);
+
+    const size_t txt_len = strlen(mdns_txt_rec);
+    if (value_len > 0 && value_len < (int) sizeof(value) - 1) {
+        const int r = snprintf(mdns_txt_rec + txt_len, sizeof(mdns_txt_rec) - txt_len, "%s%s=%s", txt_len ? " " : "", key, value);
+        if (r < 0 || (size_t) r >= sizeof(mdns_txt_rec) - txt_len) {
+            // Whole entry is dropped
+            mdns_txt_rec[txt_len] = 0;
+        }
+    }
+}
+
+// No mDNS responder. Controllers connect directly to printed port
+void homekit_mdns_configure_finalize(const uint16_t mdns_ttl, const uint16_t mdns_ttl_period) {
+    (void) mdns_ttl_period;
+    printf("mDNS: Name=%s %s Port=%d TTL=%d\n", mdns_instance_name, mdns_txt_rec, mdns_port, mdns_ttl);
+}
+
+void homekit_port_mdns_announce() {
+}
+
+void homekit_port_mdns_announce_pause() {
+}
+
+// Flash emulated by a file. Missing data reads as erased, and writes only clear bits
+static int flash_fd = -1;
+
+static bool flash_open() {
+    if (flash_fd < 0) {
+        flash_fd = open(HOMEKIT_POSIX_FLASH_FILE, O_RDWR | O_CREAT, 0644);
+    }
+    
+    return flash_fd >= 0;
+}
+
+bool spiflash_read(uint32_t addr, uint8_t *buffer, uint32_t size) {
+    if (!flash_open()) {
+        return false;
+    }
+    
+    memset(buffer, 0xFF, size);
+    
+    return pread(flash_fd, buffer, size, addr) >= 0;
+}
+
+bool spiflash_write(uint32_t addr, const uint8_t *data, uint32_t size) {
+    uint8_t *buffer = malloc(size);
+    if (!buffer || !spiflash_read(addr, buffer, size)) {
+        free(buffer);
+        return false;
+    }
+    
+    for (uint32_t i = 0; i < size; i++) {
+        buffer[i] &= data[i];
+    }
+    
+    const bool ok = pwrite(flash_fd, buffer, size, addr) == (ssize_t) size;
+    free(buffer);
+    
+    return ok;
+}
+
+bool spiflash_erase_sector(uint32_t addr) {
+    if (!flash_open()) {
+        return false;
+    }
+    
+    uint8_t sector[SPI_FLASH_SECTOR_SIZE];
+    memset(sector, 0xFF, sizeof(sector));
+    
+    addr -= addr % SPI_FLASH_SECTOR_SIZE;
+    
+    return pwrite(flash_fd, sector, sizeof(sector), addr) == (ssize_t) sizeof(sector);
+}
+
 #else
 
 #include <string.h>
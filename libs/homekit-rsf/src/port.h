@@ -14,6 +14,28 @@ void homekit_random_fill(uint8_t *data, size_t size);
 #define spiflash_erase_sector(addr)         (spi_flash_erase_sector((addr) / SPI_FLASH_SECTOR_SIZE) == ESP_OK)
 #define sdk_system_restart()                esp_restart()
 #define SERVER_TASK_STACK_PAIR              (12288)
+#define CURVE25519_POOL_TASK_STACK          (3072)
+#define CRYPTO_TASK_STACK                   (12288)
+
+#elif defined(HOMEKIT_POSIX)
+
+#include <stdbool.h>
+#include <stdlib.h>
+#define ESP_OK 0
+#define SPI_FLASH_SECTOR_SIZE               (4096)
+// Flash is emulated by HOMEKIT_POSIX_FLASH_FILE, in current directory
+#ifndef HOMEKIT_POSIX_FLASH_FILE
+#define HOMEKIT_POSIX_FLASH_FILE            "homekit_flash.bin"
+#endif
+bool spiflash_read(uint32_t addr, uint8_t *buffer, uint32_t size);
+bool spiflash_write(uint32_t addr, const uint8_t *data, uint32_t size);
+bool spiflash_erase_sector(uint32_t addr);
+#define sdk_system_restart()                exit(0)
+void homekit_port_mdns_announce();
+void homekit_port_mdns_announce_pause();
+#define SERVER_TASK_STACK_PAIR              (16384)
+#define CURVE25519_POOL_TASK_STACK          (4096)
+#define CRYPTO_TASK_STACK                   (16384)
 
 #else
 
@@ -23,11 +45,15 @@ void homekit_port_mdns_announce();
 void homekit_port_mdns_announce_pause();
 #define SERVER_TASK_STACK_PAIR              (1664)
 #define SERVER_TASK_STACK_NORMAL            (1280)
+#define CURVE25519_POOL_TASK_STACK          (768)
+#define CRYPTO_TASK_STACK                   (1664)
 
 #endif
 
 
 #define SERVER_TASK_PRIORITY                (tskIDLE_PRIORITY + 2)
+#define CURVE25519_POOL_TASK_PRIORITY       (tskIDLE_PRIORITY + 1)
+#define CRYPTO_TASK_PRIORITY                (tskIDLE_PRIORITY + 1)
 
 void homekit_mdns_init();
 void homekit_mdns_buffer_set(const uint16_t size);
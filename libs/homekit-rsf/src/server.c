@@ -13,11 +13,13 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 
 #else
 
 #include <FreeRTOS.h>
 #include <task.h>
+#include <semphr.h>
 #include <espressif/esp_common.h>
 #include <esplibs/libmain.h>
 
@@ -26,7 +28,6 @@
 #include <sysparam.h>
 
 #include <http-parser/http_parser.h>
-#include <cJSON.h>
 #include <wolfssl/wolfcrypt/hash.h>
 #include <wolfssl/wolfcrypt/coding.h>
 
@@ -38,6 +39,8 @@
 #include "storage.h"
 #include "query_params.h"
 #include "json.h"
+#include "json_parser.h"
+#include "stats.h"
 #include "debug.h"
 #include "port.h"
 
@@ -60,6 +63,20 @@
 #define HOMEKIT_MIN_FREEHEAP                    (14336)
 #endif
 
+// Eviction score added to idle seconds of clients without verified session, without
+// subscriptions, or without admin permissions. See homekit_evict_client()
+#ifndef HOMEKIT_EVICT_UNVERIFIED
+#define HOMEKIT_EVICT_UNVERIFIED                (1800)
+#endif
+
+#ifndef HOMEKIT_EVICT_UNSUBSCRIBED
+#define HOMEKIT_EVICT_UNSUBSCRIBED              (900)
+#endif
+
+#ifndef HOMEKIT_EVICT_NON_ADMIN
+#define HOMEKIT_EVICT_NON_ADMIN                 (300)
+#endif
+
 #ifndef HOMEKIT_NETWORK_FIRST_MIN_FREEHEAP
 #define HOMEKIT_NETWORK_FIRST_MIN_FREEHEAP      (25600)
 #endif
@@ -68,16 +85,92 @@
 #define HOMEKIT_NETWORK_MIN_FREEHEAP            (20480)
 #endif
 
-#ifndef HOMEKIT_NETWORK_PAUSE_COUNT
-#define HOMEKIT_NETWORK_PAUSE_COUNT             (5)
+#ifndef HOMEKIT_NOTIFICATIONS_QUEUE_SIZE
+#define HOMEKIT_NOTIFICATIONS_QUEUE_SIZE        (32)
+#endif
+
+// Events of telemetry characteristics are sent every HOMEKIT_TELEMETRY_PERIOD ms, or
+// when HOMEKIT_TELEMETRY_BATCH are pending. Interactive events are sent at once
+#ifndef HOMEKIT_TELEMETRY_PERIOD
+#define HOMEKIT_TELEMETRY_PERIOD                (3000)
+#endif
+
+#ifndef HOMEKIT_TELEMETRY_BATCH
+#define HOMEKIT_TELEMETRY_BATCH                 (HOMEKIT_NOTIFICATIONS_QUEUE_SIZE / 2)
+#endif
+
+// select() timeout in ms. Server is woken up by notifications when loopback is available
+#ifndef HOMEKIT_SERVER_SELECT_TIMEOUT
+#if LWIP_NETIF_LOOPBACK
+#define HOMEKIT_SERVER_SELECT_TIMEOUT           (2000)
+#else
+#define HOMEKIT_SERVER_SELECT_TIMEOUT           (80)
+#endif
+#endif
+
+// Max size of cached GET /accessories response template (up to 65535). 0 disables cache.
+// Disabled by default, as it is kept in heap while server runs. ESP-IDF builds enable it through Kconfig
+#ifndef HOMEKIT_ACCESSORIES_CACHE_MAX_SIZE
+#define HOMEKIT_ACCESSORIES_CACHE_MAX_SIZE      (0)
+#endif
+
+// Characteristics with cached JSON of their aid, iid and value, used by GET /characteristics and events. Set to 0 to disable
+#ifndef HOMEKIT_JSON_FRAGMENT_CACHE_SIZE
+#define HOMEKIT_JSON_FRAGMENT_CACHE_SIZE        (16)
+#endif
+
+// Pair Setup and Pair Verify requests are dispatched by a worker task, so server keeps serving
+// other clients during their crypto. Set to 0 to dispatch them in server loop
+#ifndef HOMEKIT_CRYPTO_WORKER
+#define HOMEKIT_CRYPTO_WORKER                   (1)
+#endif
+
+// Curve25519 key pairs generated ahead of Pair Verify by a low priority task. Set to 0 to disable
+#ifndef HOMEKIT_CURVE25519_POOL_SIZE
+#define HOMEKIT_CURVE25519_POOL_SIZE            (2)
+#endif
+
+// Verified sessions kept in RAM to be resumed without asymmetric crypto. Set to 0 to disable
+#ifndef HOMEKIT_RESUME_SESSIONS
+#define HOMEKIT_RESUME_SESSIONS                 (4)
+#endif
+
+// Max bytes queued per client while its socket is not writable (up to 65535).
+// Events needing more are dropped. Responses are queued past it, and requests of
+// a client are not read until its queue is sent
+#ifndef HOMEKIT_CLIENT_SEND_QUEUE_SIZE
+#define HOMEKIT_CLIENT_SEND_QUEUE_SIZE          (4096)
+#endif
+
+// Max ms a client can keep queued data without accepting any of it
+#ifndef HOMEKIT_CLIENT_SEND_TIMEOUT
+#define HOMEKIT_CLIENT_SEND_TIMEOUT             (3000)
+#endif
+
+// Heap in bytes charged to HAP clients and sessions. Set to 0 to use free heap
+// at server start, minus HOMEKIT_NETWORK_MIN_FREEHEAP
+#ifndef HOMEKIT_HEAP_BUDGET
+#define HOMEKIT_HEAP_BUDGET                     (0)
+#endif
+
+// Estimated lwIP heap of each client connection: PCB and buffered segments
+#ifndef HOMEKIT_BUDGET_LWIP_CLIENT
+#define HOMEKIT_BUDGET_LWIP_CLIENT              (3072)
 #endif
 
-#ifndef HOMEKIT_NETWORK_MIN_FREEHEAP_CRITIC
-#define HOMEKIT_NETWORK_MIN_FREEHEAP_CRITIC     (16384)
+// Estimated heap of Pair Setup SRP context and computations
+#ifndef HOMEKIT_BUDGET_PAIR_SETUP
+#define HOMEKIT_BUDGET_PAIR_SETUP               (6144)
 #endif
 
-#ifndef HOMEKIT_NETWORK_PAUSE_COUNT_CRITIC
-#define HOMEKIT_NETWORK_PAUSE_COUNT_CRITIC      (10)
+// Estimated peak heap of Pair Verify key exchange
+#ifndef HOMEKIT_BUDGET_PAIR_VERIFY
+#define HOMEKIT_BUDGET_PAIR_VERIFY              (2048)
+#endif
+
+// Period in ms of statistics printed by logger when HOMEKIT_STATS is defined
+#ifndef HOMEKIT_STATS_LOG_PERIOD
+#define HOMEKIT_STATS_LOG_PERIOD                (60000)
 #endif
 
 #ifdef HOMEKIT_DEBUG
@@ -141,14 +234,56 @@ typedef struct {
     size_t accessory_public_key_size;
 } pair_verify_context_t;
 
-typedef struct _notification {
+typedef struct {
     homekit_characteristic_t* ch;
-    struct _notification* next;
+    uint16_t json_offset;
+    uint16_t json_size;
 } notification_t;
 
+// Ring of pending notifications, filled by homekit_characteristic_notify()
+typedef struct {
+    homekit_characteristic_t* chs[HOMEKIT_NOTIFICATIONS_QUEUE_SIZE];
+    uint16_t head;
+    uint16_t count;
+} notifications_queue_t;
+
+// Static JSON of GET /accessories, with slots for dynamic fields of each characteristic
+typedef struct {
+    homekit_characteristic_t* ch;
+    uint16_t offset;            // End of static JSON preceding characteristic dynamic fields
+} accessories_cache_slot_t;
+
+typedef struct {
+    uint16_t config_number;
+    uint16_t slot_count;
+    uint16_t size;
+    accessories_cache_slot_t* slots;
+    byte* json;
+} accessories_cache_t;
+
+// Rendered "aid", "iid" and "value" keys of a characteristic. Stale if value changed
+#define JSON_FRAGMENT_SIZE      (48)
+typedef struct {
+    const homekit_characteristic_t* ch;
+    homekit_value_t value;
+    uint8_t size;
+    byte json[JSON_FRAGMENT_SIZE];
+} json_fragment_t;
+
+// Shared secret of a verified session, to accept Pair Resume
+#define RESUME_SESSION_ID_SIZE  (8)
+#define RESUME_SECRET_SIZE      (32)
+typedef struct {
+    uint32_t last_used;         // 0 if unused
+    int pairing_id;
+    byte permissions;
+    byte session_id[RESUME_SESSION_ID_SIZE];
+    byte secret[RESUME_SECRET_SIZE];
+} resume_session_t;
+
 #define BUFFER_DATA_SIZE        (1442)
 #define RECEIVED_DATA_SIZE      (1024 + 18)
-#define ENCRYPTED_DATA_SIZE     (768)
+#define ENCRYPTED_DATA_SIZE     (1024)      // HAP max frame size
 typedef struct {
     char *accessory_id;
     ed25519_key* accessory_key;
@@ -157,20 +292,72 @@ typedef struct {
     
     pairing_context_t* pairing_context;
     
+    accessories_cache_t* accessories_cache;
+    
     client_context_t* clients;
     
-    notification_t* notifications;
+    notifications_queue_t notifications;    // Interactive, sent at once
+    notifications_queue_t telemetry;        // Sent in batches
+    TickType_t telemetry_sent;
+    uint32_t notifications_overflow;
+    uint32_t notifications_overflow_logged;
+    
+    // Notifications being sent by homekit_server_process_notifications()
+    notification_t notifications_sending[HOMEKIT_NOTIFICATIONS_QUEUE_SIZE];
+    
+#if HOMEKIT_JSON_FRAGMENT_CACHE_SIZE > 0
+    json_fragment_t json_fragments[HOMEKIT_JSON_FRAGMENT_CACHE_SIZE];
+#endif
+    
+#if HOMEKIT_RESUME_SESSIONS > 0
+    resume_session_t resume_sessions[HOMEKIT_RESUME_SESSIONS];
+    uint32_t resume_sessions_clock;
+#endif
+    
+#if HOMEKIT_CURVE25519_POOL_SIZE > 0
+    // Filled by curve25519_pool_task()
+    curve25519_key* curve25519_pool[HOMEKIT_CURVE25519_POOL_SIZE];
+    uint8_t curve25519_pool_count;
+    volatile bool curve25519_pool_task_running;     // Cleared by pool task when it ends
+#endif
+    
+    // Estimated heap held by clients and sessions. See homekit_budget_admit()
+    uint32_t budget;
+    uint32_t budget_used;
+    uint32_t budget_peak;
+    uint32_t budget_rejected;
     
     int listen_fd;
+    int wakeup_fd;
     int max_fd;
     
-    size_t data_available: 16;
+    uint16_t send_pos;
+    client_context_t* send_context;
+    uint32_t client_slots;      // Bitmask of slots used by clients
+    uint16_t client_heap_cost;  // Heap freed by last closed clients, averaged
+    uint8_t max_clients;        // Limited by config max_clients and free heap
     uint8_t client_count: 6;
-    bool paired: 1;
-    bool is_pairing: 1;
-    bool pending_close: 1;
+    bool accessories_cache_too_large: 1;
+    bool sending_event: 1;      // Unsolicited data, dropped when client send queue is full
+    bool wakeup_pending;        // Not a bitfield: written from other tasks
+    
+    // Not bitfields: written by crypto worker while server loop writes other fields
+    volatile bool paired;
+    volatile bool is_pairing;
+    volatile bool pending_close;
+    
+    // Client whose request is dispatched by crypto_worker_task(), and heap charged for it
+    client_context_t* job_client;
+    uint32_t job_budget;
+    volatile bool job_done;     // Not a bitfield: written by worker task
+    
+    // Function run by server loop for crypto worker. See homekit_server_call()
+    void (*volatile job_call)(void *arg);
+    void *job_call_arg;
+    SemaphoreHandle_t job_call_done;
     
     json_stream json;
+    const char* json_status;    // Status line of JSON response whose headers are not sent yet
     
     byte data[BUFFER_DATA_SIZE + 18];
     byte encrypted[ENCRYPTED_DATA_SIZE + 18];
@@ -186,10 +373,30 @@ struct _client_context_t {
     
     char *body;
     size_t body_length: 16;
+    uint16_t pending_size;
+    byte *pending;              // Received data not processed yet, as an unfinished frame
+    uint16_t send_queue_size;
+    byte *send_queue;           // Sent data not accepted yet by socket
+    TickType_t send_progress;   // Last time socket accepted queued data
+    TickType_t last_activity;   // Last time data was received
+    uint16_t subscriptions;     // Characteristics with events enabled
+    bool events_pending;        // Characteristics have events dropped while client was slow
+    uint16_t job_response_size;
+    uint16_t job_following_size;
+    byte *job_response;         // Response of request dispatched by crypto worker
+    byte *job_following;        // Received data following request waiting for crypto worker
     byte permissions;
     uint8_t endpoint: 4;
     bool encrypted: 1;
     bool disconnect: 1;
+    bool prepared: 1;           // Timed write prepared by /prepare
+    bool request_complete: 1;   // Parser paused after a request, to be dispatched
+    bool job: 1;                // Request waiting for or dispatched by crypto worker. Socket is not read
+    bool job_encrypted: 1;      // Session was encrypted when request was parsed
+    uint8_t slot: 5;            // Index in characteristic subscriptions bitmask
+    
+    uint64_t prepare_pid;
+    TickType_t prepare_expiry;
     
     http_parser *parser;
 
@@ -209,6 +416,7 @@ void client_context_free(client_context_t *c);
 void pairing_context_free(pairing_context_t *context);
 void homekit_server_on_reset(client_context_t *context);
 int client_send_chunk(byte *data, size_t size, void *arg);
+int client_send_json(byte *data, size_t size, void *arg);
 
 #ifdef HOMEKIT_CHANGE_MAX_CLIENTS
 void homekit_set_max_clients(const unsigned int clients) {
@@ -224,10 +432,12 @@ homekit_server_t *server_new() {
     
     FD_ZERO(&homekit_server->fds);
     
+    homekit_server->wakeup_fd = -1;
+    
     json_init(&homekit_server->json, NULL);
-    homekit_server->json.size = BUFFER_DATA_SIZE + (18 - 2);   // 2 bytes reserved for client_send_chunk() end
+    homekit_server->json.size = BUFFER_DATA_SIZE + 18;
     homekit_server->json.buffer = homekit_server->data;
-    homekit_server->json.on_flush = client_send_chunk;
+    homekit_server->json.on_flush = client_send_json;
     
     return homekit_server;
 }
@@ -246,6 +456,16 @@ void server_free() {
         pairing_context_free(homekit_server->pairing_context);
     }
 
+    if (homekit_server->accessories_cache) {
+        free(homekit_server->accessories_cache);
+    }
+
+#if HOMEKIT_CURVE25519_POOL_SIZE > 0
+    for (int i = 0; i < homekit_server->curve25519_pool_count; i++) {
+        crypto_curve25519_free(homekit_server->curve25519_pool[i]);
+    }
+#endif
+
     if (homekit_server->clients) {
         client_context_t *client = homekit_server->clients;
         while (client) {
@@ -313,10 +533,76 @@ typedef enum {
 } HAPStatus;
 
 
+#define BUDGET_CLIENT           (sizeof(client_context_t) + sizeof(http_parser) + HOMEKIT_BUDGET_LWIP_CLIENT)
+#define BUDGET_VERIFY_CONTEXT   (sizeof(pair_verify_context_t) + 4 * 32)
+
+static void homekit_budget_log() {
+    HOMEKIT_INFO("Budget %u/%u, peak %u, rejected %u",
+        homekit_server->budget_used, homekit_server->budget,
+        homekit_server->budget_peak, homekit_server->budget_rejected);
+}
+
+// Work needing size bytes more is admitted only if it fits in budget, and charged too if asked.
+// Accounting is done by server loop and crypto worker, so it is in critical sections
+static bool homekit_budget_check(const size_t size, const bool charge) {
+    taskENTER_CRITICAL();
+    const bool admitted = (homekit_server->budget_used + size <= homekit_server->budget);
+    if (!admitted) {
+        homekit_server->budget_rejected++;
+    } else if (charge) {
+        homekit_server->budget_used += size;
+        if (homekit_server->budget_used > homekit_server->budget_peak) {
+            homekit_server->budget_peak = homekit_server->budget_used;
+        }
+    }
+    taskEXIT_CRITICAL();
+    
+    if (!admitted) {
+        HOMEKIT_ERROR("Budget %u", size);
+        homekit_budget_log();
+    }
+    
+    return admitted;
+}
+
+// Transient work of a request answered by server loop only needs to be admitted, as loop
+// answers one request at a time. State kept after a request must be charged until released
+static bool homekit_budget_admit(const size_t size) {
+    return homekit_budget_check(size, false);
+}
+
+// Work running concurrently with server loop, like crypto worker jobs, is admitted and
+// charged at once, and released when done
+static bool homekit_budget_reserve(const size_t size) {
+    return homekit_budget_check(size, true);
+}
+
+static void homekit_budget_charge(const size_t size) {
+    taskENTER_CRITICAL();
+    homekit_server->budget_used += size;
+    if (homekit_server->budget_used > homekit_server->budget_peak) {
+        homekit_server->budget_peak = homekit_server->budget_used;
+    }
+    taskEXIT_CRITICAL();
+}
+
+static void homekit_budget_release(const size_t size) {
+    taskENTER_CRITICAL();
+    if (homekit_server->budget_used > size) {
+        homekit_server->budget_used -= size;
+    } else {
+        homekit_server->budget_used = 0;
+    }
+    taskEXIT_CRITICAL();
+}
+
+
 pair_verify_context_t *pair_verify_context_new() {
     pair_verify_context_t *context = malloc(sizeof(pair_verify_context_t));
     memset(context, 0, sizeof(*context));
     
+    homekit_budget_charge(BUDGET_VERIFY_CONTEXT);
+    
     return context;
 }
 
@@ -335,6 +621,86 @@ void pair_verify_context_free(pair_verify_context_t **context) {
 
     free(*context);
     *context = NULL;
+    
+    homekit_budget_release(BUDGET_VERIFY_CONTEXT);
+}
+
+
+int client_derive_control_keys(client_context_t *context, const byte *secret, size_t secret_size) {
+    const byte salt[] = "Control-Salt";
+
+    size_t read_key_size = 32;
+    const byte read_info[] = "Control-Read-Encryption-Key";
+    int r = crypto_hkdf(
+        secret, secret_size,
+        salt, sizeof(salt)-1,
+        read_info, sizeof(read_info)-1,
+        context->read_key, &read_key_size
+    );
+    if (r) {
+        return r;
+    }
+
+    size_t write_key_size = 32;
+    const byte write_info[] = "Control-Write-Encryption-Key";
+    return crypto_hkdf(
+        secret, secret_size,
+        salt, sizeof(salt)-1,
+        write_info, sizeof(write_info)-1,
+        context->write_key, &write_key_size
+    );
+}
+
+
+#if HOMEKIT_RESUME_SESSIONS > 0
+// Keeps secret of a verified session, replacing given one, or an unused or least recently used one
+void resume_session_save(resume_session_t *session, const byte *session_id, const byte *secret, const int pairing_id, const byte permissions) {
+    if (!session) {
+        session = &homekit_server->resume_sessions[0];
+        for (int i = 1; i < HOMEKIT_RESUME_SESSIONS; i++) {
+            if (homekit_server->resume_sessions[i].last_used < session->last_used) {
+                session = &homekit_server->resume_sessions[i];
+            }
+        }
+    }
+
+    taskENTER_CRITICAL();
+    memcpy(session->session_id, session_id, RESUME_SESSION_ID_SIZE);
+    memcpy(session->secret, secret, RESUME_SECRET_SIZE);
+    session->pairing_id = pairing_id;
+    session->permissions = permissions;
+    session->last_used = ++homekit_server->resume_sessions_clock;
+    taskEXIT_CRITICAL();
+}
+
+resume_session_t *resume_session_find(const byte *session_id) {
+    for (int i = 0; i < HOMEKIT_RESUME_SESSIONS; i++) {
+        resume_session_t *session = &homekit_server->resume_sessions[i];
+        if (session->last_used && !memcmp(session->session_id, session_id, RESUME_SESSION_ID_SIZE)) {
+            return session;
+        }
+    }
+
+    return NULL;
+}
+#endif // HOMEKIT_RESUME_SESSIONS
+
+// Forgets resumable sessions of a pairing, or all of them with -1. Can be called from any task
+void resume_sessions_remove(const int pairing_id) {
+#if HOMEKIT_RESUME_SESSIONS > 0
+    if (!homekit_server) {
+        return;
+    }
+
+    taskENTER_CRITICAL();
+    for (int i = 0; i < HOMEKIT_RESUME_SESSIONS; i++) {
+        resume_session_t *session = &homekit_server->resume_sessions[i];
+        if (pairing_id < 0 || session->pairing_id == pairing_id) {
+            memset(session, 0, sizeof(*session));
+        }
+    }
+    taskEXIT_CRITICAL();
+#endif // HOMEKIT_RESUME_SESSIONS
 }
 
 
@@ -348,6 +714,8 @@ client_context_t *client_context_new() {
         c->parser = malloc(sizeof(*c->parser));
         http_parser_init(c->parser, HTTP_REQUEST);
         c->parser->data = c;
+        
+        homekit_budget_charge(BUDGET_CLIENT);
     }
 
     return c;
@@ -367,10 +735,25 @@ void client_context_free(client_context_t *c) {
     if (c->body)
         free(c->body);
 
+    if (c->pending)
+        free(c->pending);
+
+    if (c->send_queue)
+        free(c->send_queue);
+
+    if (c->job_response)
+        free(c->job_response);
+
+    if (c->job_following)
+        free(c->job_following);
+
+    homekit_budget_release(BUDGET_CLIENT + c->send_queue_size);
+
     free(c);
 }
 
 
+// HOMEKIT_BUDGET_PAIR_SETUP is reserved by caller, and released when context is freed
 pairing_context_t *pairing_context_new() {
     pairing_context_t *context = malloc(sizeof(pairing_context_t));
     memset(context, 0, sizeof(*context));
@@ -390,6 +773,8 @@ void pairing_context_free(pairing_context_t *context) {
     }
     
     free(context);
+    
+    homekit_budget_release(HOMEKIT_BUDGET_PAIR_SETUP);
 }
 
 static int IRAM homekit_low_dram() {
@@ -402,23 +787,110 @@ static int IRAM homekit_low_dram() {
     return false;
 }
 
+// Client state can be in use by crypto worker. Pairing context can be freed by worker, so
+// while it exists no client is taken as not being its owner
+static inline bool client_in_job(client_context_t *context) {
+    return homekit_server->job_client &&
+        (context == homekit_server->job_client || homekit_server->pairing_context);
+}
+
 void IRAM homekit_disconnect_client(client_context_t* context) {
     context->disconnect = true;
     homekit_server->pending_close = true;
 }
 
-void IRAM homekit_remove_oldest_client() {
+// Interrupts select() in server loop. Can be called from any task
+void IRAM homekit_server_wakeup() {
+#if LWIP_NETIF_LOOPBACK
+    if (homekit_server && homekit_server->wakeup_fd >= 0) {
+        taskENTER_CRITICAL();
+        const bool wakeup = !homekit_server->wakeup_pending;
+        homekit_server->wakeup_pending = true;
+        taskEXIT_CRITICAL();
+        
+        if (wakeup) {
+            const byte signal = 0;
+            if (send(homekit_server->wakeup_fd, &signal, 1, MSG_DONTWAIT) < 0) {
+                homekit_server->wakeup_pending = false;
+            }
+        }
+    }
+#endif
+}
+
+// Higher score is evicted first: long idle, unverified, unsubscribed and non admin clients.
+// Home hubs keep subscriptions and poll, so they are evicted last
+static uint32_t client_eviction_score(client_context_t *context, const TickType_t now) {
+    uint32_t score = (now - context->last_activity) / (1000 / portTICK_PERIOD_MS);
+    
+    if (!context->encrypted) {
+        score += HOMEKIT_EVICT_UNVERIFIED;
+    }
+    
+    if (context->subscriptions == 0) {
+        score += HOMEKIT_EVICT_UNSUBSCRIBED;
+    }
+    
+    if (!(context->permissions & pairing_permissions_admin)) {
+        score += HOMEKIT_EVICT_NON_ADMIN;
+    }
+    
+    return score;
+}
+
+// Closes client with highest eviction score
+void IRAM homekit_evict_client() {
     if (homekit_server && homekit_server->client_count > HOMEKIT_MIN_CLIENTS) {
+        const TickType_t now = xTaskGetTickCount();
+        
+        // Clients waiting for crypto worker are skipped, as worker can be changing their state
+        client_context_t* evicted = NULL;
+        uint32_t evicted_score = 0;
         client_context_t* context = homekit_server->clients;
         while (context) {
-            if (!context->next) {
-                CLIENT_INFO(context, "Closing oldest");
-                homekit_disconnect_client(context);
+            if (context->disconnect) {
+                // Heap is being freed already. Repeated calls must not close more clients
+                evicted = NULL;
+                break;
+            }
+            
+            if (!context->job) {
+                const uint32_t score = client_eviction_score(context, now);
+                // Oldest wins ties, as list starts with newest
+                if (!evicted || score >= evicted_score) {
+                    evicted = context;
+                    evicted_score = score;
+                }
             }
             
             context = context->next;
         }
+        
+        if (evicted) {
+            CLIENT_INFO(evicted, "Closing idle, score %u", evicted_score);
+            homekit_disconnect_client(evicted);
+        }
+        
+        homekit_server_wakeup();
+    }
+}
+
+// Clients fitting in free heap, measured with cost of closed clients
+static void homekit_update_max_clients(const uint32_t free_heap) {
+    unsigned int max_clients = homekit_server->client_count;
+    if (free_heap > HOMEKIT_NETWORK_MIN_FREEHEAP) {
+        max_clients += (free_heap - HOMEKIT_NETWORK_MIN_FREEHEAP) / homekit_server->client_heap_cost;
+    }
+    
+    if (max_clients < HOMEKIT_MIN_CLIENTS) {
+        max_clients = HOMEKIT_MIN_CLIENTS;
+    }
+    
+    if (max_clients > homekit_server->config->max_clients) {
+        max_clients = homekit_server->config->max_clients;
     }
+    
+    homekit_server->max_clients = max_clients;
 }
 
 
@@ -427,12 +899,68 @@ typedef enum {
     characteristic_format_meta   = (1 << 2),
     characteristic_format_perms  = (1 << 3),
     characteristic_format_events = (1 << 4),
+    characteristic_format_no_id  = (1 << 5),
+    characteristic_format_no_value = (1 << 6),
+    characteristic_format_no_cache = (1 << 7),
 } characteristic_format_t;
 
+#if HOMEKIT_JSON_FRAGMENT_CACHE_SIZE > 0
+void write_characteristic_json(json_stream *json, client_context_t *client, const homekit_characteristic_t *ch, characteristic_format_t format, const homekit_value_t *value);
+
+static int json_fragment_overflow(uint8_t *buffer, size_t size, void *context) {
+    return -1;
+}
+
+// Copies cached "aid", "iid" and "value" keys of a characteristic with a scalar value,
+// rendering them only when value is not the cached one
+static bool json_fragment_write(json_stream *json, const homekit_characteristic_t *ch, const homekit_value_t *value) {
+    homekit_value_t v = value ? *value : ch->value;
+    if (ch->getter_ex || !(ch->permissions & HOMEKIT_PERMISSIONS_PAIRED_READ) ||
+        v.is_null || v.format != ch->format || v.format > HOMEKIT_FORMAT_FLOAT) {
+        return false;
+    }
+    
+    json_fragment_t *fragment = &homekit_server->json_fragments[(ch->service->accessory->id * 31 + ch->id) % HOMEKIT_JSON_FRAGMENT_CACHE_SIZE];
+    if (fragment->ch != ch || !homekit_value_equal(&fragment->value, &v)) {
+        fragment->ch = NULL;
+        
+        json_stream fragment_json;
+        fragment_json.buffer = fragment->json;
+        fragment_json.size = JSON_FRAGMENT_SIZE;
+        fragment_json.on_flush = json_fragment_overflow;
+        json_init(&fragment_json, NULL);
+        
+        // Keys are written as inside an object, without braces
+        fragment_json.state = JSON_STATE_OBJECT;
+        write_characteristic_json(&fragment_json, NULL, ch, characteristic_format_no_cache, &v);
+        if (fragment_json.error || fragment_json.pos == JSON_FRAGMENT_SIZE) {
+            return false;
+        }
+        
+        fragment->ch = ch;
+        fragment->value = v;
+        fragment->size = fragment_json.pos;
+    }
+    
+    json_raw(json, fragment->json, fragment->size);
+    json->state = JSON_STATE_OBJECT_VALUE;
+    
+    return true;
+}
+#endif // HOMEKIT_JSON_FRAGMENT_CACHE_SIZE
+
 
 void write_characteristic_json(json_stream *json, client_context_t *client, const homekit_characteristic_t *ch, characteristic_format_t format, const homekit_value_t *value) {
-    json_string(json, "aid"); json_integer(json, ch->service->accessory->id);
-    json_string(json, "iid"); json_integer(json, ch->id);
+#if HOMEKIT_JSON_FRAGMENT_CACHE_SIZE > 0
+    if (format == 0 && json_fragment_write(json, ch, value)) {
+        return;
+    }
+#endif
+    
+    if (!(format & characteristic_format_no_id)) {
+        json_string(json, "aid"); json_integer(json, ch->service->accessory->id);
+        json_string(json, "iid"); json_integer(json, ch->id);
+    }
 
     if (format & characteristic_format_type) {
         json_string(json, "type"); json_string(json, ch->type);
@@ -456,7 +984,7 @@ void write_characteristic_json(json_stream *json, client_context_t *client, cons
     }
 
     if ((format & characteristic_format_events) && (ch->permissions & HOMEKIT_PERMISSIONS_NOTIFY)) {
-        int events = homekit_characteristic_has_notify_subscription(ch, client);
+        int events = homekit_characteristic_has_notify_subscription(ch, client->slot);
         json_string(json, "ev");
         json_boolean(json, events);
     }
@@ -547,7 +1075,7 @@ void write_characteristic_json(json_stream *json, client_context_t *client, cons
         
     }
     
-    if (ch->permissions & HOMEKIT_PERMISSIONS_PAIRED_READ) {
+    if ((ch->permissions & HOMEKIT_PERMISSIONS_PAIRED_READ) && !(format & characteristic_format_no_value)) {
         homekit_value_t v = value ? *value : ch->getter_ex ? ch->getter_ex(ch) : ch->value;
         
         if (v.is_null) {
@@ -638,7 +1166,7 @@ void write_characteristic_json(json_stream *json, client_context_t *client, cons
                         size_t encoded_data_size = base64_encoded_size(v.data_value, v.data_size);
                         byte* encoded_data = malloc(encoded_data_size + 1);
                         if (!encoded_data) {
-                            CLIENT_ERROR(client, "Allocate %d bytes for encoding data", encoded_data_size + 1);
+                            HOMEKIT_ERROR("Allocate %d bytes for encoding data", encoded_data_size + 1);
                             json_string(json, "");
                             break;
                         }
@@ -660,26 +1188,98 @@ void write_characteristic_json(json_stream *json, client_context_t *client, cons
     }
 }
 
-static void network_delay(const uint32_t free_heap) {
-    if (free_heap < HOMEKIT_NETWORK_MIN_FREEHEAP) {
-        unsigned int max_count = HOMEKIT_NETWORK_PAUSE_COUNT;
-        if (free_heap < HOMEKIT_NETWORK_MIN_FREEHEAP_CRITIC) {
-            max_count = HOMEKIT_NETWORK_PAUSE_COUNT_CRITIC;
+// Writes to non-blocking socket. Data not accepted is queued, and sent
+// by client_send_queue_drain() when socket becomes writable
+static void IRAM client_send_queue_drain(client_context_t *context);
+
+// Writes to socket without queueing. Returns 1 when all data is sent
+static int client_write_direct(client_context_t *context, const byte **data, size_t *size) {
+    int r = write(context->socket, *data, *size);
+    if (r < 0) {
+        if (errno != EAGAIN) {
+            CLIENT_ERROR(context, "Socket (%d)", errno);
+            return -1;
         }
         
-        unsigned int count = 0;
-        while (free_heap > xPortGetFreeHeapSize() && count < max_count) {
-            count++;
-            //HOMEKIT_INFO("Net Delay %i", count);
-            vTaskDelay(1);
+        r = 0;
+    }
+    
+    if (r == *size) {
+        return 1;
+    }
+    
+    *data += r;
+    *size -= r;
+    
+    return 0;
+}
+
+static int client_write(client_context_t *context, const byte *data, size_t size) {
+    if (context->send_queue_size == 0) {
+        int r = client_write_direct(context, &data, &size);
+        if (r != 0) {
+            return r < 0 ? r : 0;
         }
         
-    } else if (free_heap < HOMEKIT_NETWORK_FIRST_MIN_FREEHEAP) {
-        vTaskDelay(1);
+        context->send_progress = xTaskGetTickCount();
+    }
+    
+    // Responses are never dropped: queue grows past its size, charged to budget,
+    // and server loop does not read more requests until it is sent
+    if (homekit_server->sending_event && context->send_queue_size + size > HOMEKIT_CLIENT_SEND_QUEUE_SIZE) {
+        CLIENT_ERROR(context, "Send queue full");
+        return -1;
+    }
+    
+    if (context->send_queue_size + size > UINT16_MAX) {
+        CLIENT_ERROR(context, "Slow, %d bytes pending", context->send_queue_size + size);
+        return -1;
+    }
+    
+    if (!homekit_budget_reserve(size)) {
+        return -1;
+    }
+    
+    byte *send_queue = realloc(context->send_queue, context->send_queue_size + size);
+    if (!send_queue) {
+        CLIENT_ERROR(context, "DRAM");
+        homekit_budget_release(size);
+        return -1;
+    }
+    
+    memcpy(send_queue + context->send_queue_size, data, size);
+    context->send_queue = send_queue;
+    context->send_queue_size += size;
+    
+    CLIENT_DEBUG(context, "Queued %d bytes", context->send_queue_size);
+    
+    return 0;
+}
+
+static void IRAM client_send_queue_drain(client_context_t *context) {
+    int r = write(context->socket, context->send_queue, context->send_queue_size);
+    if (r < 0) {
+        if (errno != EAGAIN) {
+            CLIENT_ERROR(context, "Socket (%d). Closing", errno);
+            homekit_disconnect_client(context);
+        }
+        return;
+    }
+    
+    context->send_progress = xTaskGetTickCount();
+    context->send_queue_size -= r;
+    homekit_budget_release(r);
+    
+    if (context->send_queue_size == 0) {
+        free(context->send_queue);
+        context->send_queue = NULL;
+    } else {
+        memmove(context->send_queue, context->send_queue + r, context->send_queue_size);
     }
 }
 
-int client_send_encrypted(client_context_t *context, byte *payload, size_t size) {
+// Encrypts in place the frame staged in homekit_server->encrypted, and sends it
+int client_send_encrypted(client_context_t *context, size_t size) {
     if (!context || !context->encrypted) {
         return -1;
     }
@@ -687,130 +1287,107 @@ int client_send_encrypted(client_context_t *context, byte *payload, size_t size)
     byte nonce[12];
     memset(nonce, 0, sizeof(nonce));
     
-    size_t payload_offset = 0;
+    byte aead[2] = {size % 256, size / 256};
     
-    while (payload_offset < size) {
-        size_t chunk_size = size - payload_offset;
-        if (chunk_size > ENCRYPTED_DATA_SIZE)
-            chunk_size = ENCRYPTED_DATA_SIZE;
-        
-        byte aead[2] = {chunk_size % 256, chunk_size / 256};
-
-        memcpy(homekit_server->encrypted, aead, 2);
-
-        byte i = 4;
-        int x = context->count_reads++;
-        while (x) {
-            nonce[i++] = x % 256;
-            x /= 256;
-        }
-        
-        size_t available = ENCRYPTED_DATA_SIZE + (18 - 2);
-        int r = crypto_chacha20poly1305_encrypt(
-            context->read_key, nonce, aead, 2,
-            payload + payload_offset, chunk_size,
-            homekit_server->encrypted + 2, &available
-        );
-        if (r) {
-            CLIENT_ERROR(context, "Enc payload (%d)", r);
-            return -1;
-        }
-        
-        payload_offset += chunk_size;
-        
-        const uint32_t free_heap = xPortGetFreeHeapSize();
-        
-        r = write(context->socket, homekit_server->encrypted, available + 2);
-        
-        if (r < 0) {
-            CLIENT_ERROR(context, "Payload");
-            return r;
-        }
-        
-        network_delay(free_heap);
+    memcpy(homekit_server->encrypted, aead, 2);
+    
+    byte i = 4;
+    int x = context->count_reads++;
+    while (x) {
+        nonce[i++] = x % 256;
+        x /= 256;
+    }
+    
+    HOMEKIT_STATS_START(stats_start);
+    
+    size_t available = ENCRYPTED_DATA_SIZE + 16;
+    int r = crypto_chacha20poly1305_encrypt(
+        context->read_key, nonce, aead, 2,
+        homekit_server->encrypted + 2, size,
+        homekit_server->encrypted + 2, &available
+    );
+    
+    HOMEKIT_STATS_END(HOMEKIT_STATS_ENCRYPT, stats_start);
+    HOMEKIT_STATS_ADD(bytes_encrypted, size);
+    if (r) {
+        CLIENT_ERROR(context, "Enc payload (%d)", r);
+        return -1;
+    }
+    
+    r = client_write(context, homekit_server->encrypted, available + 2);
+    
+    if (r < 0) {
+        CLIENT_ERROR(context, "Payload");
+        return r;
     }
 
     return 0;
 }
 
 
-int client_decrypt(client_context_t *context, byte *payload, size_t payload_size, byte *decrypted, size_t *decrypted_size) {
+// Decrypts a complete frame in place. Plaintext is left at frame + 2
+int client_decrypt_frame(client_context_t *context, byte *frame, size_t frame_size) {
     if (!context || !context->encrypted)
         return -1;
 
-    const size_t block_size = 1024 + 16 + 2;
-    size_t required_decrypted_size = payload_size / block_size * 1024;
-    if (payload_size % block_size > 0)
-        required_decrypted_size += payload_size % block_size - 16 - 2;
-    
-    if (*decrypted_size < required_decrypted_size) {
-        *decrypted_size = required_decrypted_size;
-        return -2;
-    }
-
-    *decrypted_size = required_decrypted_size;
-
     byte nonce[12];
     memset(nonce, 0, sizeof(nonce));
 
-    size_t payload_offset = 0;
-    size_t decrypted_offset = 0;
+    byte i = 4;
+    int x = context->count_writes++;
+    while (x) {
+        nonce[i++] = x % 256;
+        x /= 256;
+    }
 
-    while (payload_offset < payload_size) {
-        size_t chunk_size = payload[payload_offset] + payload[payload_offset + 1] * 256;
-        if (chunk_size+18 > payload_size-payload_offset) {
-            // Unfinished chunk
-            break;
-        }
-
-        byte i = 4;
-        int x = context->count_writes++;
-        while (x) {
-            nonce[i++] = x % 256;
-            x /= 256;
-        }
-
-        size_t decrypted_len = *decrypted_size - decrypted_offset;
-        int r = crypto_chacha20poly1305_decrypt(
-            context->write_key, nonce, payload + payload_offset, 2,
-            payload + payload_offset + 2, chunk_size + 16,
-            decrypted, &decrypted_len
-        );
-        if (r) {
-            CLIENT_ERROR(context, "Decrypt payload (%d)", r);
-            return -1;
-        }
-
-        decrypted_offset += decrypted_len;
-        payload_offset += chunk_size + 18;
+    HOMEKIT_STATS_START(stats_start);
+    
+    size_t decrypted_size = frame_size;
+    int r = crypto_chacha20poly1305_decrypt(
+        context->write_key, nonce, frame, 2,
+        frame + 2, frame_size + 16,
+        frame + 2, &decrypted_size
+    );
+    
+    HOMEKIT_STATS_END(HOMEKIT_STATS_DECRYPT, stats_start);
+    HOMEKIT_STATS_ADD(bytes_decrypted, frame_size);
+    if (r) {
+        CLIENT_ERROR(context, "Decrypt payload (%d)", r);
+        return -1;
     }
 
-    return payload_offset;
+    return decrypted_size;
 }
 
 
 void homekit_setup_mdns();
 
 
-int client_send(client_context_t *context, byte *data, size_t data_size) {
-#if HOMEKIT_DEBUG
-    if (data_size < 4096) {
-        char *payload = binary_to_string(data, data_size);
-        CLIENT_DEBUG(context, "Sending payload: %s", payload);
-        free(payload);
+// Sends data staged in homekit_server->encrypted as a single frame
+int client_send_buffered_flush(client_context_t *context) {
+    if (context == homekit_server->job_client) {
+        return 0;
+    }
+    
+    const size_t size = homekit_server->send_pos;
+    homekit_server->send_pos = 0;
+
+    if (size == 0 || homekit_server->send_context != context) {
+        return 0;
     }
+
+#if HOMEKIT_DEBUG
+    char *payload = binary_to_string(homekit_server->encrypted + 2, size);
+    CLIENT_DEBUG(context, "Sending payload: %s", payload);
+    free(payload);
 #endif
 
     int r = -1;
     
     if (context->encrypted) {
-        r = client_send_encrypted(context, data, data_size);
+        r = client_send_encrypted(context, size);
     } else {
-        const uint32_t free_heap = xPortGetFreeHeapSize();
-        
-        r = write(context->socket, data, data_size);
-        
-        network_delay(free_heap);
+        r = client_write(context, homekit_server->encrypted + 2, size);
     }
     
     if (r < 0) {
@@ -821,6 +1398,61 @@ int client_send(client_context_t *context, byte *data, size_t data_size) {
     return 0;
 }
 
+// Stages data in homekit_server->encrypted, packing several buffers
+// in the same frame. Frame is sent when full or by client_send_buffered_flush()
+int client_send_buffered(client_context_t *context, const byte *data, size_t size) {
+    if (context == homekit_server->job_client) {
+        // Called by crypto worker. Response is sent by server loop when request is done
+        byte *job_response = realloc(context->job_response, context->job_response_size + size);
+        if (!job_response) {
+            CLIENT_ERROR(context, "DRAM");
+            return -1;
+        }
+        
+        memcpy(job_response + context->job_response_size, data, size);
+        context->job_response = job_response;
+        context->job_response_size += size;
+        
+        return 0;
+    }
+    
+    if (homekit_server->send_context != context) {
+        homekit_server->send_pos = 0;
+        homekit_server->send_context = context;
+    }
+    
+    while (size > 0) {
+        size_t chunk_size = ENCRYPTED_DATA_SIZE - homekit_server->send_pos;
+        if (chunk_size > size) {
+            chunk_size = size;
+        }
+
+        memcpy(homekit_server->encrypted + 2 + homekit_server->send_pos, data, chunk_size);
+        homekit_server->send_pos += chunk_size;
+        data += chunk_size;
+        size -= chunk_size;
+
+        if (homekit_server->send_pos == ENCRYPTED_DATA_SIZE) {
+            int r = client_send_buffered_flush(context);
+            if (r < 0) {
+                return r;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int client_send(client_context_t *context, const byte *data, size_t data_size) {
+    int r = client_send_buffered(context, data, data_size);
+    
+    if (r == 0) {
+        r = client_send_buffered_flush(context);
+    }
+    
+    return r;
+}
+
 
 int client_send_chunk(byte *data, size_t size, void *arg) {
     client_context_t* context = arg;
@@ -829,42 +1461,87 @@ int client_send_chunk(byte *data, size_t size, void *arg) {
     header[0] = 0;
     int header_size = snprintf((char*) header, sizeof(header), "%x\r\n", size);
     
-    int r = client_send(context, header, header_size);
+    // Chunk framing and body share frames with previous and next chunks
+    int r = client_send_buffered(context, header, header_size);
+    
+    if (r == 0 && size > 0) {
+        r = client_send_buffered(context, data, size);
+    }
     
     if (r == 0) {
-        if (size > 0) {
-            data[size] = '\r';
-            data[size + 1] = '\n';
-            r = client_send(context, data, size + 2);
-        } else {
-            byte end[2] = { '\r', '\n' };
-            r = client_send(context, end, sizeof(end));
-        }
+        r = client_send_buffered(context, (const byte*) "\r\n", 2);
     }
     
-    return r;
+    if (r == 0 && size == 0) {
+        // Last chunk ends response
+        r = client_send_buffered_flush(context);
+    }
     
-    /*
-    size_t payload_size = size + 8;
-    byte *payload = malloc(payload_size);
+    return r;
+}
 
-    int offset = snprintf((char *)payload, payload_size, "%x\r\n", size);
-    memcpy(payload + offset, data, size);
-    payload[offset + size] = '\r';
-    payload[offset + size + 1] = '\n';
+static int send_json_headers(client_context_t *context, const char *length_header) {
+    char headers[96];
+    const int headers_size = snprintf(headers, sizeof(headers),
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: application/hap+json\r\n"
+        "%s\r\n\r\n", homekit_server->json_status, length_header);
+    homekit_server->json_status = NULL;
+    
+    return client_send_buffered(context, (const byte*) headers, headers_size);
+}
 
-    client_send(context, payload, offset + size + 2);
+// Starts JSON response written to homekit_server->json. Headers are sent with body:
+// with Content-Length if whole body fits in buffer, or chunked when buffer is flushed
+void json_response_start(client_context_t *context, const char *status) {
+    json_init(&homekit_server->json, context);
+    homekit_server->json_status = status;
+}
 
-    free(payload);
-     */
+// Flushes body of JSON response exceeding buffer
+int client_send_json(byte *data, size_t size, void *arg) {
+    client_context_t* context = arg;
+    
+    if (homekit_server->json_status) {
+        int r = send_json_headers(context, "Transfer-Encoding: chunked");
+        if (r < 0) {
+            return r;
+        }
+    }
+    
+    return client_send_chunk(data, size, arg);
 }
 
-int send_200_response(client_context_t* context) {
-    byte response[] =
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: application/hap+json\r\n"
-        "Transfer-Encoding: chunked\r\n\r\n";
-    return client_send(context, response, sizeof(response) - 1);
+int json_response_end(client_context_t *context) {
+    json_stream *json = &homekit_server->json;
+    if (json->error) {
+        homekit_server->json_status = NULL;
+        return -1;
+    }
+    
+    if (!homekit_server->json_status) {
+        json_flush(json);
+        if (json->error) {
+            return -1;
+        }
+        
+        return client_send_chunk(NULL, 0, context);
+    }
+    
+    char length_header[24];
+    snprintf(length_header, sizeof(length_header), "Content-Length: %u", json->pos);
+    
+    int r = send_json_headers(context, length_header);
+    if (r == 0) {
+        r = client_send_buffered(context, json->buffer, json->pos);
+    }
+    if (r == 0) {
+        r = client_send_buffered_flush(context);
+    }
+    
+    json->pos = 0;
+    
+    return r;
 }
 
 void send_204_response(client_context_t* context) {
@@ -872,14 +1549,6 @@ void send_204_response(client_context_t* context) {
     client_send(context, response, sizeof(response) - 1);
 }
 
-int send_207_response(client_context_t* context) {
-    byte response[] =
-        "HTTP/1.1 207 Multi-Status\r\n"
-        "Content-Type: application/hap+json\r\n"
-        "Transfer-Encoding: chunked\r\n\r\n";
-    return client_send(context, response, sizeof(response) - 1);
-}
-
 void send_404_response(client_context_t* context) {
     CLIENT_ERROR(context, "Not Found");
     byte response[] = "HTTP/1.1 404 Not Found\r\n\r\n";
@@ -1049,6 +1718,56 @@ void homekit_server_on_identify(client_context_t *context) {
     }
 }
 
+// Runs function in server task. Crypto worker waits while server loop runs it, so
+// accessory callbacks, mDNS and storage writes never run concurrently with server loop
+static void homekit_server_call(client_context_t *context, void (*function)(void *arg), void *arg) {
+#if HOMEKIT_CRYPTO_WORKER
+    if (context == homekit_server->job_client) {
+        homekit_server->job_call_arg = arg;
+        homekit_server->job_call = function;
+        homekit_server_wakeup();
+        
+        xSemaphoreTake(homekit_server->job_call_done, portMAX_DELAY);
+        return;
+    }
+#endif
+    
+    function(arg);
+}
+
+#ifdef HOMEKIT_NOTIFY_EVENT_ENABLE
+static void homekit_notify_event_call(void *event) {
+    HOMEKIT_NOTIFY_EVENT(homekit_server, (homekit_event_t) (uintptr_t) event);
+}
+
+#define CLIENT_NOTIFY_EVENT(context, event) \
+    homekit_server_call((context), homekit_notify_event_call, (void*) (uintptr_t) (event))
+#else
+#define CLIENT_NOTIFY_EVENT(context, event)
+#endif
+
+#ifdef ESP_OPEN_RTOS
+static void homekit_mdns_buffer_call(void *size) {
+    homekit_mdns_buffer_set((uintptr_t) size);
+}
+#endif
+
+typedef struct {
+    const char *device_id;
+    const ed25519_key *device_key;
+    int result;
+} pairing_add_call_t;
+
+static void homekit_pairing_add_call(void *arg) {
+    pairing_add_call_t *call = arg;
+    call->result = homekit_storage_add_pairing(call->device_id, call->device_key, pairing_permissions_admin);
+}
+
+static void homekit_paired_call(void *arg) {
+    homekit_mdns_buffer_set(0);
+    homekit_setup_mdns();
+}
+
 void homekit_server_on_pair_setup(client_context_t *context, const byte *data, size_t size) {
     homekit_server->is_pairing = true;
     
@@ -1087,6 +1806,11 @@ void homekit_server_on_pair_setup(client_context_t *context, const byte *data, s
                     break;
                 }
             } else {
+                if (!homekit_budget_reserve(HOMEKIT_BUDGET_PAIR_SETUP)) {
+                    send_tlv_error_response(context, 2, TLVError_Busy);
+                    break;
+                }
+                
                 homekit_server->pairing_context = pairing_context_new();
                 homekit_server->pairing_context->client = context;
             }
@@ -1168,7 +1892,7 @@ void homekit_server_on_pair_setup(client_context_t *context, const byte *data, s
 #ifdef ESP_OPEN_RTOS
             int low_mdns_buffer = false;
             if (xPortGetFreeHeapSize() < 25000) {
-                homekit_mdns_buffer_set(500);
+                homekit_server_call(context, homekit_mdns_buffer_call, (void*) 500);
                 low_mdns_buffer = true;
             }
 #endif //ESP_OPEN_RTOS
@@ -1184,7 +1908,7 @@ void homekit_server_on_pair_setup(client_context_t *context, const byte *data, s
             
 #ifdef ESP_OPEN_RTOS
             if (low_mdns_buffer) {
-                homekit_mdns_buffer_set(0);
+                homekit_server_call(context, homekit_mdns_buffer_call, (void*) 0);
             }
 #endif //ESP_OPEN_RTOS
             
@@ -1399,7 +2123,9 @@ void homekit_server_on_pair_setup(client_context_t *context, const byte *data, s
             
             char *device_id = strndup((const char *)tlv_device_id->value, tlv_device_id->size);
             
-            r = homekit_storage_add_pairing(device_id, device_key, pairing_permissions_admin);
+            pairing_add_call_t pairing_add = { device_id, device_key, 0 };
+            homekit_server_call(context, homekit_pairing_add_call, &pairing_add);
+            r = pairing_add.result;
             if (r) {
                 CLIENT_ERROR(context, "Store pairing (%d)", r);
                 
@@ -1412,7 +2138,7 @@ void homekit_server_on_pair_setup(client_context_t *context, const byte *data, s
             
             HOMEKIT_INFO("Added pairing %s", device_id);
             
-            HOMEKIT_NOTIFY_EVENT(homekit_server, HOMEKIT_EVENT_PAIRING_ADDED);
+            CLIENT_NOTIFY_EVENT(context, HOMEKIT_EVENT_PAIRING_ADDED);
             
             free(device_id);
 
@@ -1561,8 +2287,7 @@ void homekit_server_on_pair_setup(client_context_t *context, const byte *data, s
             
             homekit_server->paired = true;
             
-            homekit_mdns_buffer_set(0);
-            homekit_setup_mdns();
+            homekit_server_call(context, homekit_paired_call, NULL);
 
             CLIENT_INFO(context, "Done 3/3");
             
@@ -1585,6 +2310,202 @@ void homekit_server_on_pair_setup(client_context_t *context, const byte *data, s
     tlv_free(message);
 }
 
+#if HOMEKIT_CURVE25519_POOL_SIZE > 0
+static void curve25519_pool_task(void *args) {
+    for (;;) {
+        taskENTER_CRITICAL();
+        const bool full = homekit_server->curve25519_pool_count >= HOMEKIT_CURVE25519_POOL_SIZE;
+        taskEXIT_CRITICAL();
+        
+        if (full || xPortGetFreeHeapSize() < HOMEKIT_NETWORK_FIRST_MIN_FREEHEAP) {
+            break;
+        }
+        
+        curve25519_key *key = crypto_curve25519_generate();
+        if (!key) {
+            break;
+        }
+        
+        taskENTER_CRITICAL();
+        if (homekit_server->curve25519_pool_count < HOMEKIT_CURVE25519_POOL_SIZE) {
+            homekit_server->curve25519_pool[homekit_server->curve25519_pool_count++] = key;
+            key = NULL;
+        }
+        taskEXIT_CRITICAL();
+        
+        crypto_curve25519_free(key);
+    }
+    
+    taskENTER_CRITICAL();
+    homekit_server->curve25519_pool_task_running = false;
+    taskEXIT_CRITICAL();
+    
+    vTaskDelete(NULL);
+}
+
+// Starts low priority task filling Curve25519 key pool, if needed. Called by server task only
+static void curve25519_pool_fill() {
+    if (homekit_server->curve25519_pool_task_running ||
+        homekit_server->curve25519_pool_count >= HOMEKIT_CURVE25519_POOL_SIZE) {
+        return;
+    }
+    
+    homekit_server->curve25519_pool_task_running = true;
+    if (xTaskCreate(curve25519_pool_task, "HKK", CURVE25519_POOL_TASK_STACK, NULL, CURVE25519_POOL_TASK_PRIORITY, NULL) != pdPASS) {
+        homekit_server->curve25519_pool_task_running = false;
+        HOMEKIT_ERROR("New HKK");
+    }
+}
+#endif // HOMEKIT_CURVE25519_POOL_SIZE
+
+// Takes a pre-generated Curve25519 key pair, or generates it if pool is empty.
+// Pool of crypto worker is refilled by crypto_jobs_run() when job is done
+static curve25519_key *curve25519_pool_take(client_context_t *context) {
+#if HOMEKIT_CURVE25519_POOL_SIZE > 0
+    curve25519_key *key = NULL;
+    
+    taskENTER_CRITICAL();
+    if (homekit_server->curve25519_pool_count > 0) {
+        key = homekit_server->curve25519_pool[--homekit_server->curve25519_pool_count];
+        homekit_server->curve25519_pool[homekit_server->curve25519_pool_count] = NULL;
+    }
+    taskEXIT_CRITICAL();
+    
+    if (context != homekit_server->job_client) {
+        curve25519_pool_fill();
+    }
+    
+    if (key) {
+        return key;
+    }
+#endif // HOMEKIT_CURVE25519_POOL_SIZE
+    
+    return crypto_curve25519_generate();
+}
+
+#if HOMEKIT_RESUME_SESSIONS > 0
+// Pair Resume M1, answered with M2 without asymmetric crypto.
+// Returns false if session can not be resumed, to continue as Pair Verify M1
+bool homekit_server_on_pair_resume(client_context_t *context, const tlv_values_t *message) {
+    tlv_t *tlv_session_id = tlv_get_value(message, TLVType_SessionID);
+    tlv_t *tlv_device_public_key = tlv_get_value(message, TLVType_PublicKey);
+    tlv_t *tlv_auth_tag = tlv_get_value(message, TLVType_EncryptedData);
+    if (!tlv_session_id || tlv_session_id->size != RESUME_SESSION_ID_SIZE ||
+        !tlv_device_public_key || !tlv_auth_tag || tlv_auth_tag->size != 16) {
+        CLIENT_ERROR(context, "Resume data");
+        return false;
+    }
+
+    resume_session_t *session = resume_session_find(tlv_session_id->value);
+    if (!session) {
+        CLIENT_INFO(context, "Resume unknown");
+        return false;
+    }
+
+    CLIENT_INFO(context, "Resume 1/1");
+
+    // Salt is device Curve25519 public key followed by session ID
+    const size_t salt_size = tlv_device_public_key->size + RESUME_SESSION_ID_SIZE;
+    byte *salt = malloc(salt_size);
+    if (!salt) {
+        CLIENT_ERROR(context, "DRAM");
+        return false;
+    }
+    memcpy(salt, tlv_device_public_key->value, tlv_device_public_key->size);
+    memcpy(salt + tlv_device_public_key->size, tlv_session_id->value, RESUME_SESSION_ID_SIZE);
+
+    byte key[32];
+    size_t key_size = sizeof(key);
+    byte auth_tag[16];
+
+    const byte request_info[] = "Pair-Resume-Request-Info";
+    int r = crypto_hkdf(
+        session->secret, RESUME_SECRET_SIZE,
+        salt, salt_size,
+        request_info, sizeof(request_info)-1,
+        key, &key_size
+    );
+    if (!r) {
+        r = crypto_chacha20poly1305_empty_tag(key, (byte *)"\x0\x0\x0\x0PR-Msg01", auth_tag);
+    }
+
+    byte diff = 0;
+    for (int i = 0; i < sizeof(auth_tag); i++) {
+        diff |= auth_tag[i] ^ tlv_auth_tag->value[i];
+    }
+
+    if (r || diff) {
+        CLIENT_ERROR(context, "Resume auth (%d)", r);
+        free(salt);
+        session->last_used = 0;
+        return false;
+    }
+
+    // New session ID replaces the one in salt
+    byte *session_id = salt + tlv_device_public_key->size;
+    homekit_random_fill(session_id, RESUME_SESSION_ID_SIZE);
+
+    byte secret[RESUME_SECRET_SIZE];
+    size_t secret_size = sizeof(secret);
+    const byte secret_info[] = "Pair-Resume-Shared-Secret-Info";
+    r = crypto_hkdf(
+        session->secret, RESUME_SECRET_SIZE,
+        salt, salt_size,
+        secret_info, sizeof(secret_info)-1,
+        secret, &secret_size
+    );
+
+    if (!r) {
+        key_size = sizeof(key);
+        const byte response_info[] = "Pair-Resume-Response-Info";
+        r = crypto_hkdf(
+            session->secret, RESUME_SECRET_SIZE,
+            salt, salt_size,
+            response_info, sizeof(response_info)-1,
+            key, &key_size
+        );
+    }
+    if (!r) {
+        r = crypto_chacha20poly1305_empty_tag(key, (byte *)"\x0\x0\x0\x0PR-Msg02", auth_tag);
+    }
+    if (!r) {
+        r = client_derive_control_keys(context, secret, secret_size);
+    }
+
+    if (r) {
+        CLIENT_ERROR(context, "Resume keys (%d)", r);
+        free(salt);
+        return false;
+    }
+
+    const int pairing_id = session->pairing_id;
+    const byte permissions = session->permissions;
+
+    // Old session ID is not valid anymore
+    resume_session_save(session, session_id, secret, pairing_id, permissions);
+
+    tlv_values_t *response = tlv_new();
+    tlv_add_integer_value(response, TLVType_State, 1, 2);
+    tlv_add_integer_value(response, TLVType_Method, 1, TLVMethod_PairResume);
+    tlv_add_value(response, TLVType_SessionID, session_id, RESUME_SESSION_ID_SIZE);
+    tlv_add_value(response, TLVType_EncryptedData, auth_tag, sizeof(auth_tag));
+
+    free(salt);
+
+    send_tlv_response(context, response);
+
+    context->pairing_id = pairing_id;
+    context->permissions = permissions;
+    context->encrypted = true;
+
+    CLIENT_NOTIFY_EVENT(context, HOMEKIT_EVENT_CLIENT_VERIFIED);
+
+    CLIENT_INFO(context, "Resume OK");
+
+    return true;
+}
+#endif // HOMEKIT_RESUME_SESSIONS
+
 void homekit_server_on_pair_verify(client_context_t *context, const byte *data, size_t size) {
     HOMEKIT_DEBUG_LOG("Pair Verify");
     DEBUG_HEAP();
@@ -1607,7 +2528,21 @@ void homekit_server_on_pair_verify(client_context_t *context, const byte *data,
 
     switch(tlv_get_integer_value(message, TLVType_State, -1)) {
         case 1: {
+#if HOMEKIT_RESUME_SESSIONS > 0
+            if (tlv_get_integer_value(message, TLVType_Method, -1) == TLVMethod_PairResume &&
+                homekit_server_on_pair_resume(context, message)) {
+                break;
+            }
+#endif // HOMEKIT_RESUME_SESSIONS
+
             CLIENT_INFO(context, "Verify 1/2");
+            
+            // Key exchange heap of a crypto worker job is charged by crypto_jobs_run()
+            const size_t transient_size = (context == homekit_server->job_client) ? 0 : HOMEKIT_BUDGET_PAIR_VERIFY;
+            if (!context->verify_context && !homekit_budget_admit(transient_size + BUDGET_VERIFY_CONTEXT)) {
+                send_tlv_error_response(context, 2, TLVError_Busy);
+                break;
+            }
 
             CLIENT_DEBUG(context, "Importing device Curve25519 public key");
             tlv_t *tlv_device_public_key = tlv_get_value(message, TLVType_PublicKey);
@@ -1629,7 +2564,7 @@ void homekit_server_on_pair_verify(client_context_t *context, const byte *data,
             }
 
             CLIENT_DEBUG(context, "Generating accessory Curve25519 key");
-            curve25519_key *my_key = crypto_curve25519_generate();
+            curve25519_key *my_key = curve25519_pool_take(context);
             if (!my_key) {
                 CLIENT_ERROR(context, "Generate accessory Curve25519 key");
                 crypto_curve25519_free(device_key);
@@ -1946,19 +2881,9 @@ void homekit_server_on_pair_verify(client_context_t *context, const byte *data,
                 break;
             }
 
-            const byte salt[] = "Control-Salt";
-
-            size_t read_key_size = 32;
-            const byte read_info[] = "Control-Read-Encryption-Key";
-            r = crypto_hkdf(
-                context->verify_context->secret, context->verify_context->secret_size,
-                salt, sizeof(salt)-1,
-                read_info, sizeof(read_info)-1,
-                context->read_key, &read_key_size
-            );
-
+            r = client_derive_control_keys(context, context->verify_context->secret, context->verify_context->secret_size);
             if (r) {
-                CLIENT_ERROR(context, "Derive read enc key (%d)", r);
+                CLIENT_ERROR(context, "Derive enc keys (%d)", r);
 
                 pair_verify_context_free(&context->verify_context);
 
@@ -1966,24 +2891,26 @@ void homekit_server_on_pair_verify(client_context_t *context, const byte *data,
                 break;
             }
 
-            size_t write_key_size = 32;
-            const byte write_info[] = "Control-Write-Encryption-Key";
-            r = crypto_hkdf(
-                context->verify_context->secret, context->verify_context->secret_size,
-                salt, sizeof(salt)-1,
-                write_info, sizeof(write_info)-1,
-                context->write_key, &write_key_size
-            );
+#if HOMEKIT_RESUME_SESSIONS > 0
+            if (context->verify_context->secret_size == RESUME_SECRET_SIZE) {
+                // Controller derives the same session ID
+                byte session_id[32];
+                size_t session_id_size = sizeof(session_id);
+                const byte session_id_salt[] = "Pair-Verify-ResumeSessionID-Salt";
+                const byte session_id_info[] = "Pair-Verify-ResumeSessionID-Info";
+                if (!crypto_hkdf(
+                    context->verify_context->secret, context->verify_context->secret_size,
+                    session_id_salt, sizeof(session_id_salt)-1,
+                    session_id_info, sizeof(session_id_info)-1,
+                    session_id, &session_id_size
+                )) {
+                    resume_session_save(NULL, session_id, context->verify_context->secret, pairing_id, permissions);
+                }
+            }
+#endif // HOMEKIT_RESUME_SESSIONS
 
             pair_verify_context_free(&context->verify_context);
 
-            if (r) {
-                CLIENT_ERROR(context, "Derive write enc key (%d)", r);
-
-                send_tlv_error_response(context, 4, TLVError_Unknown);
-                break;
-            }
-
             tlv_values_t *response = tlv_new();
             tlv_add_integer_value(response, TLVType_State, 1, 4);
             
@@ -1993,7 +2920,7 @@ void homekit_server_on_pair_verify(client_context_t *context, const byte *data,
             context->permissions = permissions;
             context->encrypted = true;
 
-            HOMEKIT_NOTIFY_EVENT(homekit_server, HOMEKIT_EVENT_CLIENT_VERIFIED);
+            CLIENT_NOTIFY_EVENT(context, HOMEKIT_EVENT_CLIENT_VERIFIED);
 
             CLIENT_INFO(context, "Verify OK");
 
@@ -2014,17 +2941,9 @@ void homekit_server_on_pair_verify(client_context_t *context, const byte *data,
 }
 
 
-void homekit_server_on_get_accessories(client_context_t *context) {
-    CLIENT_INFO(context, "Get ACC");
-    DEBUG_HEAP();
-    
-    json_stream* json = &homekit_server->json;
-    json_init(json, context);
-    
-    if (send_200_response(context) < 0) {
-        json->error = true;
-    }
-    
+typedef void (*characteristic_json_callback)(json_stream *json, homekit_characteristic_t *ch, void *arg);
+
+void write_accessories_json(json_stream *json, client_context_t *context, characteristic_format_t format, characteristic_json_callback on_characteristic, void *arg) {
     json_object_start(json);
     json_string(json, "accessories"); json_array_start(json);
 
@@ -2063,14 +2982,10 @@ void homekit_server_on_get_accessories(client_context_t *context) {
                 homekit_characteristic_t *ch = *ch_it;
 
                 json_object_start(json);
-                write_characteristic_json(
-                    json, context, ch,
-                      characteristic_format_type
-                    | characteristic_format_meta
-                    | characteristic_format_perms
-                    | characteristic_format_events,
-                    NULL
-                );
+                write_characteristic_json(json, context, ch, format, NULL);
+                if (on_characteristic) {
+                    on_characteristic(json, ch, arg);
+                }
                 json_object_end(json);
                 
                 if (json->error) {
@@ -2098,32 +3013,180 @@ void homekit_server_on_get_accessories(client_context_t *context) {
     json_object_end(json); // response
     
     json_flush(json);
-    //json_buffer_free(json);
-    //free(json);
-    
-    if (json->error) {
-        CLIENT_ERROR(context, "JSON");
-        homekit_disconnect_client(context);
-    } else {
-        client_send_chunk(NULL, 0, context);
+}
+
+static size_t accessories_cache_alloc_size(const uint16_t slot_count, const size_t json_size) {
+    return sizeof(accessories_cache_t) + slot_count * sizeof(accessories_cache_slot_t) + json_size;
+}
+
+void accessories_cache_free() {
+    if (homekit_server->accessories_cache) {
+        accessories_cache_t *cache = homekit_server->accessories_cache;
+        homekit_budget_release(accessories_cache_alloc_size(cache->slot_count, cache->size));
+        free(homekit_server->accessories_cache);
+        homekit_server->accessories_cache = NULL;
     }
 }
 
-void homekit_server_on_get_characteristics(client_context_t *context) {
-    CLIENT_INFO(context, "Get CH");
-    DEBUG_HEAP();
+typedef struct {
+    accessories_cache_t *cache;
+    size_t size;
+    uint16_t slot_count;
+} accessories_cache_builder_t;
+
+static int accessories_cache_on_flush(uint8_t *buffer, size_t size, void *context) {
+    accessories_cache_builder_t *builder = context;
     
-    query_param_t *qp = context->endpoint_params;
-    while (qp) {
-        CLIENT_DEBUG(context, "Query paramter %s = %s", qp->name, qp->value);
-        qp = qp->next;
+    if (builder->size + size > HOMEKIT_ACCESSORIES_CACHE_MAX_SIZE) {
+        homekit_server->accessories_cache_too_large = true;
+        return -1;
     }
-
-    query_param_t *id_param = query_params_find(context->endpoint_params, "id");
-    if (!id_param) {
-        CLIENT_ERROR(context, "No ID param");
-        send_json_error_response(context, 400, HAPStatus_InvalidValue);
-        return;
+    
+    if (builder->cache) {
+        if (builder->size + size > builder->cache->size) {
+            return -1;
+        }
+        
+        memcpy(builder->cache->json + builder->size, buffer, size);
+    }
+    
+    builder->size += size;
+    
+    return 0;
+}
+
+static void accessories_cache_on_characteristic(json_stream *json, homekit_characteristic_t *ch, void *arg) {
+    accessories_cache_builder_t *builder = arg;
+    
+    if (builder->cache) {
+        builder->cache->slots[builder->slot_count].ch = ch;
+        builder->cache->slots[builder->slot_count].offset = builder->size + json->pos;
+    }
+    
+    builder->slot_count++;
+}
+
+// Renders static JSON of GET /accessories, without values and events, in two passes:
+// first one gets sizes, second one fills the cache
+static accessories_cache_t *accessories_cache_build() {
+    const characteristic_format_t format =
+          characteristic_format_type
+        | characteristic_format_meta
+        | characteristic_format_perms
+        | characteristic_format_no_value;
+    
+    accessories_cache_builder_t builder;
+    memset(&builder, 0, sizeof(builder));
+    
+    json_stream json;
+    json.buffer = homekit_server->data;
+    json.size = BUFFER_DATA_SIZE;
+    json.on_flush = accessories_cache_on_flush;
+    
+    json_init(&json, &builder);
+    write_accessories_json(&json, NULL, format, accessories_cache_on_characteristic, &builder);
+    if (json.error) {
+        return NULL;
+    }
+    
+    const size_t slots_size = builder.slot_count * sizeof(accessories_cache_slot_t);
+    const size_t cache_size = accessories_cache_alloc_size(builder.slot_count, builder.size);
+    if (!homekit_budget_admit(cache_size)) {
+        return NULL;
+    }
+    
+    accessories_cache_t *cache = malloc(cache_size);
+    if (!cache) {
+        return NULL;
+    }
+    
+    cache->config_number = homekit_server->config->config_number;
+    cache->slot_count = builder.slot_count;
+    cache->size = builder.size;
+    cache->slots = (accessories_cache_slot_t*) (cache + 1);
+    cache->json = ((byte*) cache->slots) + slots_size;
+    
+    memset(&builder, 0, sizeof(builder));
+    builder.cache = cache;
+    
+    json_init(&json, &builder);
+    write_accessories_json(&json, NULL, format, accessories_cache_on_characteristic, &builder);
+    if (json.error || builder.size != cache->size || builder.slot_count != cache->slot_count) {
+        free(cache);
+        return NULL;
+    }
+    
+    homekit_budget_charge(cache_size);
+    
+    return cache;
+}
+
+void homekit_server_on_get_accessories(client_context_t *context) {
+    CLIENT_INFO(context, "Get ACC");
+    DEBUG_HEAP();
+    
+    accessories_cache_t *cache = homekit_server->accessories_cache;
+    if (cache && cache->config_number != homekit_server->config->config_number) {
+        accessories_cache_free();
+        cache = NULL;
+    }
+    
+    if (!cache && HOMEKIT_ACCESSORIES_CACHE_MAX_SIZE > 0 && !homekit_server->accessories_cache_too_large) {
+        cache = accessories_cache_build();
+        homekit_server->accessories_cache = cache;
+    }
+    
+    json_stream* json = &homekit_server->json;
+    json_response_start(context, "200 OK");
+    
+    if (cache) {
+        // Static JSON is copied from cache, and only values and events are rendered
+        uint16_t pos = 0;
+        for (uint16_t i = 0; i < cache->slot_count && !json->error; i++) {
+            accessories_cache_slot_t *slot = &cache->slots[i];
+            
+            json_raw(json, cache->json + pos, slot->offset - pos);
+            pos = slot->offset;
+            
+            // Cached JSON always ends inside characteristic object, after a value
+            json->state = JSON_STATE_OBJECT_VALUE;
+            write_characteristic_json(json, context, slot->ch, characteristic_format_events | characteristic_format_no_id, NULL);
+        }
+        
+        json_raw(json, cache->json + pos, cache->size - pos);
+        
+    } else {
+        write_accessories_json(
+            json, context,
+              characteristic_format_type
+            | characteristic_format_meta
+            | characteristic_format_perms
+            | characteristic_format_events,
+            NULL, NULL
+        );
+    }
+    
+    if (json_response_end(context) < 0) {
+        CLIENT_ERROR(context, "JSON");
+        homekit_disconnect_client(context);
+    }
+}
+
+void homekit_server_on_get_characteristics(client_context_t *context) {
+    CLIENT_INFO(context, "Get CH");
+    DEBUG_HEAP();
+    
+    query_param_t *qp = context->endpoint_params;
+    while (qp) {
+        CLIENT_DEBUG(context, "Query paramter %s = %s", qp->name, qp->value);
+        qp = qp->next;
+    }
+
+    query_param_t *id_param = query_params_find(context->endpoint_params, "id");
+    if (!id_param) {
+        CLIENT_ERROR(context, "No ID param");
+        send_json_error_response(context, 400, HAPStatus_InvalidValue);
+        return;
     }
 
     int bool_endpoint_param(const char *name) {
@@ -2178,19 +3241,7 @@ void homekit_server_on_get_characteristics(client_context_t *context) {
     id = strdup(id_param->value);
 
     json_stream* json = &homekit_server->json;
-    json_init(json, context);
-    
-    int resul = -1;
-    
-    if (success) {
-        resul = send_200_response(context);
-    } else {
-        resul = send_207_response(context);
-    }
-    
-    if (resul < 0) {
-        json->error = true;
-    }
+    json_response_start(context, success ? "200 OK" : "207 Multi-Status");
     
     json_object_start(json);
     json_string(json, "characteristics"); json_array_start(json);
@@ -2237,64 +3288,46 @@ void homekit_server_on_get_characteristics(client_context_t *context) {
     json_array_end(json);
     json_object_end(json); // response
 
-    json_flush(json);
-    //json_buffer_free(json);
-    //free(json);
-
-    if (json->error) {
+    if (json_response_end(context) < 0) {
         CLIENT_ERROR(context, "JSON");
         homekit_disconnect_client(context);
-    } else {
-        client_send_chunk(NULL, 0, context);
     }
     
     free(id);
 }
 
-void homekit_server_on_update_characteristics(client_context_t *context, const byte *data, size_t size) {
+void homekit_server_on_update_characteristics(client_context_t *context, byte *data, size_t size) {
     CLIENT_INFO(context, "Upd CH");
     DEBUG_HEAP();
     
-    cJSON *json = cJSON_Parse((char*) data);
-
-    if (!json) {
-        CLIENT_ERROR(context, "Parse JSON");
-        send_json_error_response(context, 400, HAPStatus_InvalidValue);
-        return;
-    }
-
-    cJSON *characteristics = cJSON_GetObjectItem(json, "characteristics");
-    if (!characteristics) {
-        CLIENT_ERROR(context, "No \"characteristics\"");
-        cJSON_Delete(json);
-        send_json_error_response(context, 400, HAPStatus_InvalidValue);
-        return;
-    }
+    typedef struct {
+        uint16_t aid;
+        uint16_t iid;
+        HAPStatus status;
+        homekit_characteristic_t *ch;   // Set if value must be written
+        homekit_value_t value;
+        homekit_characteristic_t *ev_ch;    // Set if subscription must be changed
+        bool ev;
+    } update_result_t;
     
-    if (characteristics->type != cJSON_Array) {
-        CLIENT_ERROR(context, "\"characteristics\" no list");
-        cJSON_Delete(json);
-        send_json_error_response(context, 400, HAPStatus_InvalidValue);
-        return;
-    }
-
-    HAPStatus process_characteristics_update(const cJSON *j_ch) {
-        cJSON *j_aid = cJSON_GetObjectItem(j_ch, "aid");
-        if (!j_aid) {
+    // Validates a write, which is applied after whole request is parsed
+    HAPStatus process_characteristics_update(const json_parser_value_t *j_aid, const json_parser_value_t *j_iid,
+                                             const json_parser_value_t *j_value, const json_parser_value_t *j_events,
+                                             update_result_t *result) {
+        if (j_aid->type == JSON_PARSER_TYPE_NONE) {
             CLIENT_ERROR(context, "No \"aid\"");
             return HAPStatus_NoResource;
         }
-        if (j_aid->type != cJSON_Number) {
+        if (j_aid->type != JSON_PARSER_TYPE_NUMBER) {
             CLIENT_ERROR(context, "\"aid\" no number");
             return HAPStatus_NoResource;
         }
         
-        cJSON *j_iid = cJSON_GetObjectItem(j_ch, "iid");
-        if (!j_iid) {
+        if (j_iid->type == JSON_PARSER_TYPE_NONE) {
             CLIENT_ERROR(context, "No \"iid\"");
             return HAPStatus_NoResource;
         }
-        if (j_iid->type != cJSON_Number) {
+        if (j_iid->type != JSON_PARSER_TYPE_NUMBER) {
             CLIENT_ERROR(context, "\"iid\" no number");
             return HAPStatus_NoResource;
         }
@@ -2310,8 +3343,7 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
             return HAPStatus_NoResource;
         }
         
-        cJSON *j_value = cJSON_GetObjectItem(j_ch, "value");
-        if (j_value) {
+        if (j_value->type != JSON_PARSER_TYPE_NONE) {
             homekit_value_t h_value = HOMEKIT_NULL();
 
             if (!(ch->permissions & HOMEKIT_PERMISSIONS_PAIRED_WRITE)) {
@@ -2322,11 +3354,11 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
             switch (ch->format) {
                 case HOMEKIT_FORMAT_BOOL: {
                     int value = false;
-                    if (j_value->type == cJSON_True) {
+                    if (j_value->type == JSON_PARSER_TYPE_TRUE) {
                         value = true;
-                    } else if (j_value->type == cJSON_False) {
+                    } else if (j_value->type == JSON_PARSER_TYPE_FALSE) {
                         value = false;
-                    } else if (j_value->type == cJSON_Number &&
+                    } else if (j_value->type == JSON_PARSER_TYPE_NUMBER &&
                             (j_value->valueint == 0 || j_value->valueint == 1)) {
                         value = j_value->valueint == 1;
                     } else {
@@ -2337,11 +3369,6 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
                     CLIENT_DEBUG(context, "for %d.%d=%i", aid, iid, value);
                     
                     h_value = HOMEKIT_BOOL(value);
-                    if (ch->setter_ex) {
-                        ch->setter_ex(ch, h_value);
-                    } else {
-                        ch->value = h_value;
-                    }
                     break;
                 }
                 case HOMEKIT_FORMAT_UINT8:
@@ -2350,7 +3377,7 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
                 case HOMEKIT_FORMAT_UINT64:
                 case HOMEKIT_FORMAT_INT: {
                     // We accept boolean values here in order to fix a bug in HomeKit. HomeKit sometimes sends a boolean instead of an integer of value 0 or 1.
-                    if (j_value->type != cJSON_Number && j_value->type != cJSON_False && j_value->type != cJSON_True) {
+                    if (j_value->type != JSON_PARSER_TYPE_NUMBER && j_value->type != JSON_PARSER_TYPE_FALSE && j_value->type != JSON_PARSER_TYPE_TRUE) {
                         CLIENT_ERROR(context, "for %d.%d: no number", aid, iid);
                         return HAPStatus_InvalidValue;
                     }
@@ -2420,9 +3447,9 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
                     double value = j_value->valuedouble;
                     */
                     
-                    if (j_value->type == cJSON_True) {
+                    if (j_value->type == JSON_PARSER_TYPE_TRUE) {
                         value = 1;
-                    } else if (j_value->type == cJSON_False) {
+                    } else if (j_value->type == JSON_PARSER_TYPE_FALSE) {
                         value = 0;
                     }
                     
@@ -2504,15 +3531,10 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
                     }
                     */
                     
-                    if (ch->setter_ex) {
-                        ch->setter_ex(ch, h_value);
-                    } else {
-                        ch->value = h_value;
-                    }
                     break;
                 }
                 case HOMEKIT_FORMAT_FLOAT: {
-                    if (j_value->type != cJSON_Number) {
+                    if (j_value->type != JSON_PARSER_TYPE_NUMBER) {
                         CLIENT_ERROR(context, "for %d.%d: no number", aid, iid);
                         return HAPStatus_InvalidValue;
                     }
@@ -2527,15 +3549,10 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
                     CLIENT_DEBUG(context, "for %d.%d=%g", aid, iid, value);
 
                     h_value = HOMEKIT_FLOAT(value);
-                    if (ch->setter_ex) {
-                        ch->setter_ex(ch, h_value);
-                    } else {
-                        ch->value = h_value;
-                    }
                     break;
                 }
                 case HOMEKIT_FORMAT_STRING: {
-                    if (j_value->type != cJSON_String) {
+                    if (j_value->type != JSON_PARSER_TYPE_STRING) {
                         CLIENT_ERROR(context, "for %d.%d: no string", aid, iid);
                         return HAPStatus_InvalidValue;
                     }
@@ -2556,16 +3573,10 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
                     CLIENT_DEBUG(context, "for %d.%d=\"%s\"", aid, iid, value);
 
                     h_value = HOMEKIT_STRING(value);
-                    if (ch->setter_ex) {
-                        ch->setter_ex(ch, h_value);
-                    } else {
-                        homekit_value_destruct(&ch->value);
-                        homekit_value_copy(&ch->value, &h_value);
-                    }
                     break;
                 }
                 case HOMEKIT_FORMAT_TLV: {
-                    if (j_value->type != cJSON_String) {
+                    if (j_value->type != JSON_PARSER_TYPE_STRING) {
                         CLIENT_ERROR(context, "for %d.%d: no string", aid, iid);
                         return HAPStatus_InvalidValue;
                     }
@@ -2609,18 +3620,10 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
                     }
                     
                     h_value = HOMEKIT_TLV(tlv_values);
-                    if (ch->setter_ex) {
-                        ch->setter_ex(ch, h_value);
-                    } else {
-                        homekit_value_destruct(&ch->value);
-                        homekit_value_copy(&ch->value, &h_value);
-                    }
-                    
-                    tlv_free(tlv_values);
                     break;
                 }
                 case HOMEKIT_FORMAT_DATA: {
-                    if (j_value->type != cJSON_String) {
+                    if (j_value->type != JSON_PARSER_TYPE_STRING) {
                         CLIENT_ERROR(context, "for %d.%d: no string", aid, iid);
                         return HAPStatus_InvalidValue;
                     }
@@ -2664,47 +3667,200 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
                     return HAPStatus_InvalidValue;
                 }
             }
+            
+            result->ch = ch;
+            result->value = h_value;
         }
 
-        cJSON *j_events = cJSON_GetObjectItem(j_ch, "ev");
-        if (j_events) {
+        if (j_events->type != JSON_PARSER_TYPE_NONE) {
             if (!(ch->permissions & HOMEKIT_PERMISSIONS_NOTIFY)) {
                 CLIENT_ERROR(context, "Notification for %d.%d: no supported", aid, iid);
                 return HAPStatus_NotificationsUnsupported;
             }
 
-            if ((j_events->type != cJSON_True) && (j_events->type != cJSON_False)) {
+            if ((j_events->type != JSON_PARSER_TYPE_TRUE) && (j_events->type != JSON_PARSER_TYPE_FALSE)) {
                 CLIENT_ERROR(context, "Notification for %d.%d: invalid state", aid, iid);
             }
 
-            if (j_events->type == cJSON_True) {
-                homekit_characteristic_add_notify_subscription(ch, context);
-            } else {
-                homekit_characteristic_remove_notify_subscription(ch, context);
-            }
+            result->ev_ch = ch;
+            result->ev = (j_events->type == JSON_PARSER_TYPE_TRUE);
         }
 
         return HAPStatus_Success;
     }
 
-    HAPStatus *statuses = malloc(sizeof(HAPStatus) * cJSON_GetArraySize(characteristics));
-    int has_errors = false;
-    for (int i = 0; i < cJSON_GetArraySize(characteristics); i++) {
-        cJSON *j_ch = cJSON_GetArrayItem(characteristics, i);
-
-#ifdef HOMEKIT_DEBUG
-        char *s = cJSON_Print(j_ch);
-        CLIENT_INFO(context, "Processing Ch: %s", s);
-        free(s);
-#endif
+    // Writes are buffered while request is parsed, and then applied in one pass
+    update_result_t *results = NULL;
+    unsigned int results_count = 0;
+    unsigned int results_size = 0;
+    bool has_characteristics = false;
+    bool has_errors = false;
+    bool out_of_memory = false;
+    
+    bool timed_write = false;
+    bool pid_valid = false;
+    uint64_t pid = 0;
+    
+    json_parser_t parser;
+    json_parser_init(&parser, data ? (char*) data : "");
+    
+    char *key;
+    json_parser_object_start(&parser);
+    while (json_parser_object_next_key(&parser, &key)) {
+        json_parser_value_t j_ignored;
         
-        statuses[i] = process_characteristics_update(j_ch);
-
-        if (statuses[i] != HAPStatus_Success)
+        if (!strcmp(key, "pid")) {
+            timed_write = true;
+            pid_valid = json_parser_uint64(&parser, &pid);
+            continue;
+        }
+        
+        if (strcmp(key, "characteristics")) {
+            json_parser_value(&parser, &j_ignored);
+            continue;
+        }
+        
+        if (!json_parser_array_start(&parser)) {
+            CLIENT_ERROR(context, "\"characteristics\" no list");
+            break;
+        }
+        
+        has_characteristics = true;
+        
+        while (json_parser_array_next(&parser)) {
+            json_parser_value_t j_aid, j_iid, j_value, j_events;
+            memset(&j_aid, 0, sizeof(j_aid));
+            memset(&j_iid, 0, sizeof(j_iid));
+            memset(&j_value, 0, sizeof(j_value));
+            memset(&j_events, 0, sizeof(j_events));
+            
+            if (!json_parser_object_start(&parser)) {
+                break;
+            }
+            
+            // authData, remote and r are not used
+            char *ch_key;
+            while (json_parser_object_next_key(&parser, &ch_key)) {
+                json_parser_value_t *target = &j_ignored;
+                if (!strcmp(ch_key, "aid")) {
+                    target = &j_aid;
+                } else if (!strcmp(ch_key, "iid")) {
+                    target = &j_iid;
+                } else if (!strcmp(ch_key, "value")) {
+                    target = &j_value;
+                } else if (!strcmp(ch_key, "ev")) {
+                    target = &j_events;
+                }
+                
+                json_parser_value(&parser, target);
+            }
+            
+            if (parser.error) {
+                break;
+            }
+            
+            if (results_count == results_size) {
+                results_size += 8;
+                update_result_t *new_results = realloc(results, results_size * sizeof(update_result_t));
+                if (!new_results) {
+                    out_of_memory = true;
+                    results_size -= 8;
+                    continue;
+                }
+                results = new_results;
+            }
+            
+            update_result_t *result = &results[results_count++];
+            memset(result, 0, sizeof(*result));
+            result->aid = j_aid.valueint;
+            result->iid = j_iid.valueint;
+            result->status = process_characteristics_update(&j_aid, &j_iid, &j_value, &j_events, result);
+            if (result->status != HAPStatus_Success) {
+                has_errors = true;
+            }
+        }
+    }
+    
+    // Nothing is applied from an incomplete or malformed request
+    const bool parsed = json_parser_end(&parser) && has_characteristics;
+    
+    // Timed write: pid must be the one prepared by client, before TTL expires
+    bool timed_write_valid = false;
+    if (timed_write) {
+        timed_write_valid = context->prepared && pid_valid &&
+                            context->prepare_pid == pid &&
+                            (int32_t) (xTaskGetTickCount() - context->prepare_expiry) < 0;
+        context->prepared = false;
+        
+        if (!timed_write_valid) {
+            CLIENT_ERROR(context, "Timed write");
+        }
+    }
+    
+    for (unsigned int i = 0; i < results_count; i++) {
+        update_result_t *result = &results[i];
+        if (result->ch && (timed_write ? !timed_write_valid :
+                           (result->ch->permissions & HOMEKIT_PERMISSIONS_TIMED_WRITE))) {
+            result->status = HAPStatus_InvalidValue;
+            result->ch = NULL;
             has_errors = true;
+        }
     }
-
-    if (!has_errors) {
+    
+    // Timed write is applied as a whole or not at all, subscriptions included
+    const bool apply = parsed && !out_of_memory && !(timed_write && has_errors);
+    
+    for (unsigned int i = 0; i < results_count; i++) {
+        update_result_t *result = &results[i];
+        homekit_characteristic_t *ch = result->ch;
+        
+        if (result->ev_ch && apply) {
+            const bool subscribed = homekit_characteristic_has_notify_subscription(result->ev_ch, context->slot);
+            if (result->ev) {
+                homekit_characteristic_add_notify_subscription(result->ev_ch, context->slot);
+                if (!subscribed) {
+                    context->subscriptions++;
+                }
+            } else {
+                homekit_characteristic_remove_notify_subscription(result->ev_ch, context->slot);
+                if (subscribed) {
+                    context->subscriptions--;
+                }
+            }
+        } else if (result->ev_ch && result->status == HAPStatus_Success) {
+            result->status = HAPStatus_InvalidValue;
+        }
+        
+        if (ch && apply) {
+            if (ch->setter_ex) {
+                ch->setter_ex(ch, result->value);
+            } else if (ch->format == HOMEKIT_FORMAT_STRING || ch->format == HOMEKIT_FORMAT_TLV || ch->format == HOMEKIT_FORMAT_DATA) {
+                homekit_value_destruct(&ch->value);
+                homekit_value_copy(&ch->value, &result->value);
+            } else {
+                ch->value = result->value;
+            }
+        } else if (ch && result->status == HAPStatus_Success) {
+            result->status = HAPStatus_InvalidValue;
+        }
+        
+        // Strings point to request body, other buffers were allocated while parsing
+        if (result->value.format == HOMEKIT_FORMAT_TLV) {
+            tlv_free(result->value.tlv_values);
+        } else if (result->value.format == HOMEKIT_FORMAT_DATA) {
+            free(result->value.data_value);
+        }
+    }
+    
+    if (!parsed) {
+        CLIENT_ERROR(context, "Parse JSON");
+        send_json_error_response(context, 400, HAPStatus_InvalidValue);
+        
+    } else if (out_of_memory) {
+        CLIENT_ERROR(context, "DRAM");
+        send_json_error_response(context, 500, HAPStatus_OutOfResources);
+        
+    } else if (!has_errors) {
         CLIENT_DEBUG(context, "There were no processing errors, sending No Content response");
         
         send_204_response(context);
@@ -2712,22 +3868,16 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
         CLIENT_DEBUG(context, "There were processing errors, sending Multi-Status response");
         
         json_stream* json1 = &homekit_server->json;
-        json_init(json1, context);
-        
-        if (send_207_response(context) < 0) {
-            json1->error = true;
-        }
+        json_response_start(context, "207 Multi-Status");
         
         json_object_start(json1);
         json_string(json1, "characteristics"); json_array_start(json1);
 
-        for (int i = 0; i < cJSON_GetArraySize(characteristics); i++) {
-            cJSON *j_ch = cJSON_GetArrayItem(characteristics, i);
-
+        for (unsigned int i = 0; i < results_count; i++) {
             json_object_start(json1);
-            json_string(json1, "aid"); json_integer(json1, cJSON_GetObjectItem(j_ch, "aid")->valueint);
-            json_string(json1, "iid"); json_integer(json1, cJSON_GetObjectItem(j_ch, "iid")->valueint);
-            json_string(json1, "status"); json_integer(json1, statuses[i]);
+            json_string(json1, "aid"); json_integer(json1, results[i].aid);
+            json_string(json1, "iid"); json_integer(json1, results[i].iid);
+            json_string(json1, "status"); json_integer(json1, results[i].status);
             json_object_end(json1);
             
             if (json1->error) {
@@ -2738,20 +3888,15 @@ void homekit_server_on_update_characteristics(client_context_t *context, const b
         json_array_end(json1);
         json_object_end(json1); // response
 
-        json_flush(json1);
-        //json_buffer_free(json1);
-        //free(json1);
-
-        if (json1->error) {
+        if (json_response_end(context) < 0) {
             CLIENT_ERROR(context, "JSON");
             homekit_disconnect_client(context);
-        } else {
-            client_send_chunk(NULL, 0, context);
         }
     }
 
-    free(statuses);
-    cJSON_Delete(json);
+    if (results) {
+        free(results);
+    }
 }
 
 void homekit_server_on_pairings(client_context_t *context, const byte *data, size_t size) {
@@ -2823,6 +3968,8 @@ void homekit_server_on_pairings(client_context_t *context, const byte *data, siz
 
             pairing_t *pairing = homekit_storage_find_pairing(device_identifier);
             if (pairing) {
+                const int pairing_id = pairing->id;
+                
                 size_t pairing_public_key_size = 0;
                 crypto_ed25519_export_public_key(pairing->device_key, NULL, &pairing_public_key_size);
 
@@ -2835,6 +3982,7 @@ void homekit_server_on_pairings(client_context_t *context, const byte *data, siz
                     free(device_identifier);
                     crypto_ed25519_free(device_key);
                     send_tlv_error_response(context, 2, TLVError_Unknown);
+                    break;
                 }
 
                 pairing_free(pairing);
@@ -2846,6 +3994,7 @@ void homekit_server_on_pairings(client_context_t *context, const byte *data, siz
                     free(device_identifier);
                     crypto_ed25519_free(device_key);
                     send_tlv_error_response(context, 2, TLVError_Unknown);
+                    break;
                 }
 
                 free(pairing_public_key);
@@ -2858,6 +4007,9 @@ void homekit_server_on_pairings(client_context_t *context, const byte *data, siz
                     send_tlv_error_response(context, 2, TLVError_Unknown);
                     break;
                 }
+                
+                // Resumed sessions must not keep previous permissions
+                resume_sessions_remove(pairing_id);
 
                 HOMEKIT_INFO("Updated pairing with %s", device_identifier);
             } else {
@@ -2920,6 +4072,7 @@ void homekit_server_on_pairings(client_context_t *context, const byte *data, siz
 
             if (pairing) {
                 int is_admin = pairing->permissions & pairing_permissions_admin;
+                const int pairing_id = pairing->id;
                 pairing_free(pairing);
 
                 r = homekit_storage_remove_pairing(device_identifier);
@@ -2934,9 +4087,11 @@ void homekit_server_on_pairings(client_context_t *context, const byte *data, siz
                 
                 HOMEKIT_NOTIFY_EVENT(homekit_server, HOMEKIT_EVENT_PAIRING_REMOVED);
 
+                resume_sessions_remove(pairing_id);
+
                 client_context_t *c = homekit_server->clients;
                 while (c) {
-                    if (c->pairing_id == pairing->id) {
+                    if (c->pairing_id == pairing_id) {
                         homekit_disconnect_client(c);
                     }
                     c = c->next;
@@ -3049,10 +4204,44 @@ void homekit_server_on_resource(client_context_t *context) {
 }
 #endif
 
-void homekit_server_on_prepare(client_context_t *context) {
+void homekit_server_on_prepare(client_context_t *context, byte *data, size_t size) {
     CLIENT_INFO(context, "Prepare");
     DEBUG_HEAP();
-
+    
+    context->prepared = false;
+    
+    json_parser_value_t j_ttl;
+    memset(&j_ttl, 0, sizeof(j_ttl));
+    bool pid_valid = false;
+    uint64_t pid = 0;
+    
+    json_parser_t parser;
+    json_parser_init(&parser, data ? (char*) data : "");
+    
+    char *key;
+    json_parser_object_start(&parser);
+    while (json_parser_object_next_key(&parser, &key)) {
+        if (!strcmp(key, "pid")) {
+            pid_valid = json_parser_uint64(&parser, &pid);
+            continue;
+        }
+        
+        json_parser_value_t j_ignored;
+        json_parser_value(&parser, strcmp(key, "ttl") ? &j_ignored : &j_ttl);
+    }
+    
+    if (!json_parser_end(&parser) ||
+        j_ttl.type != JSON_PARSER_TYPE_NUMBER || j_ttl.valueint <= 0 || !pid_valid) {
+        CLIENT_ERROR(context, "Prepare JSON");
+        send_json_error_response(context, 400, HAPStatus_InvalidValue);
+        return;
+    }
+    
+    // TTL is in ms
+    context->prepare_pid = pid;
+    context->prepare_expiry = xTaskGetTickCount() + (j_ttl.valueint + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+    context->prepared = true;
+    
     send_json_error_response(context, 200, HAPStatus_Success);
 }
 
@@ -3120,9 +4309,10 @@ int homekit_server_on_body(http_parser *parser, const char *data, size_t length)
     return 0;
 }
 
-int homekit_server_on_message_complete(http_parser *parser) {
-    client_context_t *context = parser->data;
-    
+// Answers request parsed by client_parse()
+static void homekit_server_dispatch(client_context_t *context) {
+    HOMEKIT_STATS_START(stats_start);
+
     switch(context->endpoint) {
         case HOMEKIT_ENDPOINT_PAIR_SETUP: {
             homekit_server_on_pair_setup(context, (const byte *)context->body, context->body_length);
@@ -3152,7 +4342,7 @@ int homekit_server_on_message_complete(http_parser *parser) {
         }
         case HOMEKIT_ENDPOINT_UPDATE_CHARACTERISTICS: {
             if (context->encrypted || homekit_server->config->insecure) {
-                homekit_server_on_update_characteristics(context, (const byte *)context->body, context->body_length);
+                homekit_server_on_update_characteristics(context, (byte *)context->body, context->body_length);
             }
             break;
         }
@@ -3172,7 +4362,7 @@ int homekit_server_on_message_complete(http_parser *parser) {
 #endif
         case HOMEKIT_ENDPOINT_PREPARE: {
             if (context->encrypted || homekit_server->config->insecure) {
-                homekit_server_on_prepare(context);
+                homekit_server_on_prepare(context, (byte *)context->body, context->body_length);
             }
             break;
         }
@@ -3182,6 +4372,8 @@ int homekit_server_on_message_complete(http_parser *parser) {
             break;
         }
     }
+    
+    HOMEKIT_STATS_END(context->endpoint, stats_start);
 
     if (context->endpoint_params) {
         query_params_free(context->endpoint_params);
@@ -3193,7 +4385,15 @@ int homekit_server_on_message_complete(http_parser *parser) {
         context->body = NULL;
         context->body_length = 0;
     }
+}
 
+// Parser stops after each request, which is dispatched by client_parse()
+int homekit_server_on_message_complete(http_parser *parser) {
+    client_context_t *context = parser->data;
+    
+    context->request_complete = true;
+    http_parser_pause(parser, 1);
+    
     return 0;
 }
 
@@ -3204,84 +4404,356 @@ static http_parser_settings homekit_http_parser_settings = {
     .on_message_complete = homekit_server_on_message_complete,
 };
 
-static inline void IRAM homekit_client_process(client_context_t *context) {
-    int data_len = read(context->socket,
-                        homekit_server->data + homekit_server->data_available,
-                        RECEIVED_DATA_SIZE - homekit_server->data_available
-                        );
+#if HOMEKIT_CRYPTO_WORKER
+// Pair Setup and Pair Verify are answered by crypto worker. Pairings changes wait for it too
+static bool client_request_waits(client_context_t *context) {
+    switch (context->endpoint) {
+        case HOMEKIT_ENDPOINT_PAIR_SETUP:
+        case HOMEKIT_ENDPOINT_PAIR_VERIFY:
+            return true;
+            
+        case HOMEKIT_ENDPOINT_PAIRINGS:
+            return homekit_server->job_client != NULL;
+            
+        default:
+            return false;
+    }
+}
+#endif // HOMEKIT_CRYPTO_WORKER
+
+// Dispatches every complete request in data, in order. As responses overwrite
+// homekit_server->data, requests following the one being answered are moved out first
+static void IRAM client_parse(client_context_t *context, byte *data, size_t size) {
+    const bool encrypted = context->encrypted;
     
-    if (data_len > 0) {
-        CLIENT_DEBUG(context, "Got %d incomming data", data_len);
-        byte *payload = (byte*) homekit_server->data;
-        size_t payload_size = (size_t) data_len;
-        CLIENT_DEBUG(context, "Received Payload:\n%s", (char*) payload);
+    while (size > 0 && !context->disconnect) {
+        const size_t parsed = http_parser_execute(context->parser, &homekit_http_parser_settings, (char*) data, size);
         
-        size_t decrypted_size = BUFFER_DATA_SIZE - 2;
+        if (!context->request_complete) {
+            if (HTTP_PARSER_ERRNO(context->parser) != HPE_OK) {
+                CLIENT_ERROR(context, "HTTP %s. Closing", http_errno_name(HTTP_PARSER_ERRNO(context->parser)));
+                homekit_disconnect_client(context);
+            }
+            
+            // Unfinished request is kept by parser
+            return;
+        }
+        
+        context->request_complete = false;
+        http_parser_pause(context->parser, 0);
         
-        if (context->encrypted) {
-            CLIENT_DEBUG(context, "Decrypting data");
+        data += parsed;
+        size -= parsed;
+        
+#if HOMEKIT_CRYPTO_WORKER
+        if (client_request_waits(context)) {
+            // Dispatched by crypto_jobs_run(). Following data are parsed when done
+            context->job = true;
+            context->job_encrypted = encrypted;
             
-            int r = client_decrypt(context, homekit_server->data, data_len, homekit_server->data + 2, &decrypted_size);
-            if (r < 0) {
-                CLIENT_ERROR(context, "Client data");
-                return;
-            }
-            homekit_server->data_available = data_len - r;
-            if (r && homekit_server->data_available) {
-                memmove(homekit_server->data, &homekit_server->data[r], homekit_server->data_available);
+            if (size > 0) {
+                context->job_following = malloc(size);
+                if (!context->job_following) {
+                    CLIENT_ERROR(context, "DRAM");
+                    homekit_disconnect_client(context);
+                    return;
+                }
+                
+                memcpy(context->job_following, data, size);
+                context->job_following_size = size;
             }
-            CLIENT_DEBUG(context, "Decrypted %d bytes, available %d", decrypted_size, homekit_server->data_available);
-
-            payload = homekit_server->data + 2;
-            payload_size = decrypted_size;
-            if (payload_size) {
-                print_binary("Decrypted data", payload, payload_size);
+            
+            return;
+        }
+#endif // HOMEKIT_CRYPTO_WORKER
+        
+        byte *following = NULL;
+        if (size > 0) {
+            following = malloc(size);
+            if (!following) {
+                CLIENT_ERROR(context, "DRAM");
+                homekit_disconnect_client(context);
+                return;
             }
-        } else {
-            homekit_server->data_available = 0;
+            
+            memcpy(following, data, size);
         }
         
-        //current_client_context = context;
+        homekit_server_dispatch(context);
         
-        http_parser_execute(context->parser, &homekit_http_parser_settings,
-                            (char*) payload, payload_size
-                            );
+        if (!following) {
+            return;
+        }
+        
+        if (context->encrypted != encrypted) {
+            // Following data are frames of new encrypted session
+            context->pending = following;
+            context->pending_size = size;
+            return;
+        }
+        
+        data = homekit_server->data;
+        memcpy(data, following, size);
+        free(following);
+    }
+}
 
-        //current_client_context = NULL;
+// Frames are decrypted in place, and their plaintexts joined at start of buffer
+static void IRAM client_process_frames(client_context_t *context, byte *data, size_t data_size) {
+    size_t offset = 0;
+    size_t plaintext_size = 0;
+    while (data_size - offset >= 2) {
+        const size_t frame_size = data[offset] + data[offset + 1] * 256;
+        if (frame_size > ENCRYPTED_DATA_SIZE) {
+            CLIENT_ERROR(context, "Frame size %d. Closing", (int) frame_size);
+            homekit_disconnect_client(context);
+            return;
+        }
         
-    } else if (data_len == 0) {
-        CLIENT_INFO(context, "Closing");
-        homekit_disconnect_client(context);
+        if (frame_size + 18 > data_size - offset) {
+            // Unfinished frame
+            break;
+        }
         
-    } else {    // if (data_len < 0)
-        if (errno != EAGAIN) {
-            CLIENT_ERROR(context, "Socket (%d). Closing", errno);
+        const int payload_size = client_decrypt_frame(context, data + offset, frame_size);
+        if (payload_size < 0) {
+            CLIENT_ERROR(context, "Client data. Closing");
             homekit_disconnect_client(context);
+            return;
         }
+        
+        memmove(data + plaintext_size, data + offset + 2, payload_size);
+        plaintext_size += payload_size;
+        offset += frame_size + 18;
     }
-}
-
-
-void IRAM homekit_server_close_client(client_context_t *context) {
-    FD_CLR(context->socket, &homekit_server->fds);
+    
+    // Unfinished frame is kept before responses overwrite buffer
+    data_size -= offset;
+    if (data_size > 0) {
+        context->pending = malloc(data_size);
+        if (!context->pending) {
+            CLIENT_ERROR(context, "DRAM");
+            homekit_disconnect_client(context);
+            return;
+        }
+        
+        memcpy(context->pending, data + offset, data_size);
+        context->pending_size = data_size;
+        CLIENT_DEBUG(context, "Unfinished frame, %d bytes pending", (int) data_size);
+    }
+    
+    print_binary("Decrypted data", data, plaintext_size);
+    
+    client_parse(context, data, plaintext_size);
+}
+
+static inline void IRAM homekit_client_process(client_context_t *context) {
+    byte *data = homekit_server->data;
+    size_t data_size = context->pending_size;
+    
+    int data_len = read(context->socket, data + data_size, RECEIVED_DATA_SIZE - data_size);
+    
+    if (data_len == 0) {
+        CLIENT_INFO(context, "Closing");
+        homekit_disconnect_client(context);
+        return;
+        
+    } else if (data_len < 0) {
+        if (errno != EAGAIN) {
+            CLIENT_ERROR(context, "Socket (%d). Closing", errno);
+            homekit_disconnect_client(context);
+        }
+        return;
+    }
+    
+    CLIENT_DEBUG(context, "Got %d incomming data", data_len);
+    data_size += data_len;
+    context->last_activity = xTaskGetTickCount();
+    
+    if (context->pending) {
+        memcpy(data, context->pending, context->pending_size);
+        free(context->pending);
+        context->pending = NULL;
+        context->pending_size = 0;
+    }
+    
+    if (!context->encrypted) {
+        client_parse(context, data, data_size);
+        
+        if (!context->encrypted || !context->pending) {
+            return;
+        }
+        
+        // Frames received together with request that started encrypted session
+        data_size = context->pending_size;
+        memcpy(data, context->pending, data_size);
+        free(context->pending);
+        context->pending = NULL;
+        context->pending_size = 0;
+    }
+    
+    client_process_frames(context, data, data_size);
+}
+
+#if HOMEKIT_CRYPTO_WORKER
+// Sends response of request dispatched by crypto worker, and parses data received after it
+static void client_job_resume(client_context_t *context) {
+    context->job = false;
+    
+    if (context->job_response) {
+        if (!context->disconnect && client_write(context, context->job_response, context->job_response_size) < 0) {
+            CLIENT_ERROR(context, "Payload");
+            homekit_disconnect_client(context);
+        }
+        
+        free(context->job_response);
+        context->job_response = NULL;
+        context->job_response_size = 0;
+    }
+    
+    if (context->job_following) {
+        byte *data = homekit_server->data;
+        const size_t data_size = context->job_following_size;
+        memcpy(data, context->job_following, data_size);
+        free(context->job_following);
+        context->job_following = NULL;
+        context->job_following_size = 0;
+        
+        if (context->disconnect) {
+            return;
+        }
+        
+        if (context->encrypted && !context->job_encrypted) {
+            // Frames of new encrypted session
+            client_process_frames(context, data, data_size);
+        } else {
+            client_parse(context, data, data_size);
+        }
+    }
+}
+
+static void crypto_worker_task(void *args) {
+    homekit_server_dispatch(homekit_server->job_client);
+    
+    homekit_budget_release(homekit_server->job_budget);
+    
+    homekit_server->job_done = true;
+    homekit_server_wakeup();
+    
+    vTaskDelete(NULL);
+}
+
+// Worker task stack, charged to budget while it exists
+#define BUDGET_CRYPTO_TASK      (CRYPTO_TASK_STACK * sizeof(StackType_t))
+
+// Runs function asked by crypto worker, resumes client whose job is done,
+// and starts crypto worker for oldest waiting client
+static void crypto_jobs_run() {
+    if (homekit_server->job_call) {
+        homekit_server->job_call(homekit_server->job_call_arg);
+        homekit_server->job_call = NULL;
+        xSemaphoreGive(homekit_server->job_call_done);
+    }
+    
+    if (homekit_server->job_done) {
+        client_context_t *context = homekit_server->job_client;
+        homekit_server->job_client = NULL;
+        homekit_server->job_done = false;
+        
+        client_job_resume(context);
+        
+#if HOMEKIT_CURVE25519_POOL_SIZE > 0
+        if (homekit_server->paired) {
+            curve25519_pool_fill();
+        }
+#endif
+    }
+    
+    while (!homekit_server->job_client) {
+        client_context_t *waiting = NULL;
+        client_context_t *context = homekit_server->clients;
+        while (context) {
+            if (context->job && !context->disconnect) {
+                waiting = context;
+            }
+            
+            context = context->next;
+        }
+        
+        if (!waiting) {
+            return;
+        }
+        
+        // Worker stack and transient heap of job exist concurrently with server loop, so they are
+        // charged. Job not fitting in budget is dispatched by server loop, where it is only admitted
+        homekit_server->job_budget = BUDGET_CRYPTO_TASK;
+        if (waiting->endpoint == HOMEKIT_ENDPOINT_PAIR_VERIFY) {
+            homekit_server->job_budget += HOMEKIT_BUDGET_PAIR_VERIFY;
+        }
+        
+        if (waiting->endpoint != HOMEKIT_ENDPOINT_PAIRINGS && homekit_server->job_call_done &&
+            homekit_budget_reserve(homekit_server->job_budget)) {
+            homekit_server->job_client = waiting;
+            if (xTaskCreate(crypto_worker_task, "HKC", CRYPTO_TASK_STACK, NULL, CRYPTO_TASK_PRIORITY, NULL) == pdPASS) {
+                return;
+            }
+            
+            homekit_server->job_client = NULL;
+            homekit_budget_release(homekit_server->job_budget);
+            HOMEKIT_ERROR("New HKC");
+        }
+        
+        homekit_server_dispatch(waiting);
+        client_job_resume(waiting);
+    }
+}
+#endif // HOMEKIT_CRYPTO_WORKER
+
+// Heap freed since free_heap was read. Heap used meanwhile by other tasks can exceed it
+static inline uint32_t heap_freed_since(const uint32_t free_heap) {
+    const uint32_t now = xPortGetFreeHeapSize();
+    return now > free_heap ? now - free_heap : 0;
+}
+
+void IRAM homekit_server_close_client(client_context_t *context) {
+    FD_CLR(context->socket, &homekit_server->fds);
     if (homekit_server->client_count > 0) {
         homekit_server->client_count--;
     }
     
+    // Heap freed by socket and context, without pairing context, is cost of a client
+    uint32_t free_heap = xPortGetFreeHeapSize();
     close(context->socket);
+    uint32_t freed = heap_freed_since(free_heap);
     
-    CLIENT_INFO(context, "Closed %i/%i", homekit_server->client_count, homekit_server->config->max_clients);
+    CLIENT_INFO(context, "Closed %i/%i", homekit_server->client_count, homekit_server->max_clients);
     
     if (homekit_server->pairing_context && homekit_server->pairing_context->client == context) {
         pairing_context_free(homekit_server->pairing_context);
         homekit_server->pairing_context = NULL;
     }
     
-    homekit_accessories_clear_notify_subscriptions(homekit_server->config->accessories, context);
+    if (homekit_server->send_context == context) {
+        homekit_server->send_pos = 0;
+        homekit_server->send_context = NULL;
+    }
+    
+    homekit_accessories_clear_notify_subscriptions(homekit_server->config->accessories, context->slot);
+    homekit_server->client_slots &= ~(1UL << context->slot);
     
     HOMEKIT_NOTIFY_EVENT(homekit_server, HOMEKIT_EVENT_CLIENT_DISCONNECTED);
 
+    free_heap = xPortGetFreeHeapSize();
     client_context_free(context);
+    freed += heap_freed_since(free_heap);
+    
+    // Heap used or freed by other tasks meanwhile is noise, smoothed by average
+    if (freed > sizeof(client_context_t) && freed < BUDGET_CLIENT * 4) {
+        homekit_server->client_heap_cost = (homekit_server->client_heap_cost * 3 + freed) / 4;
+    }
+    homekit_update_max_clients(xPortGetFreeHeapSize());
+    
+    homekit_budget_log();
 }
 
 
@@ -3304,22 +4776,53 @@ static inline void IRAM homekit_server_accept_client() {
         return;
     }
     
-    client_context_t* new_context = client_context_new();
-    
     const uint32_t free_heap = xPortGetFreeHeapSize();
+    homekit_update_max_clients(free_heap);
     
-    if (homekit_server->client_count >= homekit_server->config->max_clients || !new_context) {
-        homekit_remove_oldest_client();
+    // Rejected before allocating anything. Evicted client makes room for next attempt
+    if (!homekit_budget_admit(BUDGET_CLIENT)) {
+        homekit_evict_client();
+        close(s);
+        HOMEKIT_ERROR("[%d] Budget %s:%d %i/%i", s, address_buffer, addr.sin_port, homekit_server->client_count, homekit_server->max_clients);
+        return;
+    }
+    
+    client_context_t* new_context = client_context_new();
+    
+    if (homekit_server->client_count >= homekit_server->max_clients || !new_context) {
+        homekit_evict_client();
     }
     
     if (new_context) {
+        uint8_t slot = 0;
+        while (slot < HOMEKIT_SUBSCRIPTION_SLOTS && (homekit_server->client_slots & (1UL << slot))) {
+            slot++;
+        }
+        
+        if (slot == HOMEKIT_SUBSCRIPTION_SLOTS) {
+            client_context_free(new_context);
+            close(s);
+            HOMEKIT_ERROR("[%d] No slot %s:%d %i/%i", s, address_buffer, addr.sin_port, homekit_server->client_count, homekit_server->max_clients);
+            return;
+        }
+        
+        new_context->slot = slot;
+        homekit_server->client_slots |= (1UL << slot);
+        
         /*
         const int nodelay = 1;
         setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
         */
         
-        const struct timeval sndtimeout = { 3, 0 };
-        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &sndtimeout, sizeof(sndtimeout));
+        // Writes never block server loop. See client_write()
+        int opt = lwip_fcntl(s, F_GETFL, 0);
+        if (opt < 0 || lwip_fcntl(s, F_SETFL, opt | O_NONBLOCK) < 0) {
+            client_context_free(new_context);
+            homekit_server->client_slots &= ~(1UL << slot);
+            close(s);
+            HOMEKIT_ERROR("[%d] NonBlock Socket", s);
+            return;
+        }
         
         const struct timeval rcvtimeout = { 13, 0 };
         setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &rcvtimeout, sizeof(rcvtimeout));
@@ -3327,7 +4830,14 @@ static inline void IRAM homekit_server_accept_client() {
         const int keepalive = 0;
         setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
 
+#ifdef HOMEKIT_POSIX
+        // Send buffer of a few segments like lwIP, so slow clients fill send queue on host too
+        const int send_buffer = 4 * 1460;
+        setsockopt(s, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer));
+#endif
+
         new_context->socket = s;
+        new_context->last_activity = xTaskGetTickCount();
         new_context->next = homekit_server->clients;
 
         homekit_server->clients = new_context;
@@ -3338,112 +4848,266 @@ static inline void IRAM homekit_server_accept_client() {
             homekit_server->max_fd = s;
         }
         
-        HOMEKIT_INFO("[%d] New %s:%d %i/%i Free HEAP %d", s, address_buffer, addr.sin_port, homekit_server->client_count, homekit_server->config->max_clients, free_heap);
+        HOMEKIT_INFO("[%d] New %s:%d %i/%i Free HEAP %d", s, address_buffer, addr.sin_port, homekit_server->client_count, homekit_server->max_clients, free_heap);
+        homekit_budget_log();
 
         HOMEKIT_NOTIFY_EVENT(homekit_server, HOMEKIT_EVENT_CLIENT_CONNECTED);
         
     } else {
         close(s);
-        HOMEKIT_ERROR("[%d] DRAM %s:%d %i/%i Free HEAP %d", s, address_buffer, addr.sin_port, homekit_server->client_count, homekit_server->config->max_clients, free_heap);
+        HOMEKIT_ERROR("[%d] DRAM %s:%d %i/%i Free HEAP %d", s, address_buffer, addr.sin_port, homekit_server->client_count, homekit_server->max_clients, free_heap);
     }
 }
 
 void homekit_characteristic_notify(homekit_characteristic_t *ch) {
     if (homekit_server) {
-        notification_t* notification = homekit_server->notifications;
-        if (notification) {
-            for (;;) {
-                if (notification->ch == ch) {
-                    return;
-                }
-                
-                if (notification->next) {
-                    notification = notification->next;
-                } else {
-                    break;
-                }
+        bool wakeup = false;
+        
+        taskENTER_CRITICAL();
+        
+        if (!ch->notify_pending) {
+            notifications_queue_t *queue = &homekit_server->notifications;
+            if (ch->telemetry) {
+                queue = &homekit_server->telemetry;
+                // Server loop is woken up by full batch, or by select() timeout
+                wakeup = (queue->count == HOMEKIT_TELEMETRY_BATCH - 1);
+            } else {
+                wakeup = (queue->count == 0);
             }
+            
+            if (queue->count == HOMEKIT_NOTIFICATIONS_QUEUE_SIZE) {
+                // Queue is full: oldest notification is dropped, newest wins
+                queue->chs[queue->head]->notify_pending = false;
+                queue->head = (queue->head + 1) % HOMEKIT_NOTIFICATIONS_QUEUE_SIZE;
+                queue->count--;
+                homekit_server->notifications_overflow++;
+            }
+            
+            const uint16_t tail = (queue->head + queue->count) % HOMEKIT_NOTIFICATIONS_QUEUE_SIZE;
+            queue->chs[tail] = ch;
+            queue->count++;
+            ch->notify_pending = true;
         }
         
-        notification_t* notification_new = malloc(sizeof(notification_t));
-        memset(notification_new, 0, sizeof(*notification_new));
+        taskEXIT_CRITICAL();
         
-        notification_new->ch = ch;
-        
-        if (notification) {
-            notification->next = notification_new;
-        } else {
-            homekit_server->notifications = notification_new;
+        if (wakeup) {
+            homekit_server_wakeup();
         }
     }
 }
 
-static inline void IRAM homekit_server_process_notifications() {
-    notification_t *notifications = homekit_server->notifications;
-    homekit_server->notifications = NULL;
+static int homekit_event_json_overflow(uint8_t *buffer, size_t size, void *context) {
+    // Shared event buffer is full; remaining notifications go in next batch
+    return -1;
+}
+
+static int homekit_server_send_event(client_context_t *context, notification_t *batch, notification_t *batch_end, size_t body_size) {
+    static const byte body_start[] = "{\"characteristics\":[";
+    static const byte body_end[] = "]}";
     
-    client_context_t *context = homekit_server->clients;
-    while (context) {
-        notification_t *notification = notifications;
-        while (notification) {
-            if (homekit_characteristic_has_notify_subscription(notification->ch, context)) {
-                CLIENT_INFO(context, "Send Ev");
-                DEBUG_HEAP();
-                
-                json_stream* json = &homekit_server->json;
-                json_init(json, context);
-                
-                byte http_headers[] =
-                    "EVENT/1.0 200 OK\r\n"
-                    "Content-Type: application/hap+json\r\n"
-                    "Transfer-Encoding: chunked\r\n\r\n";
-                
-                if (client_send(context, http_headers, sizeof(http_headers) - 1) < 0) {
-                    json->error = true;
-                }
-                
-                json_object_start(json);
-                json_string(json, "characteristics"); json_array_start(json);
-                
-                notification = notifications;
-                while (notification) {
-                    json_object_start(json);
-                    write_characteristic_json(json, context, notification->ch, 0, &notification->ch->value);
-                    json_object_end(json);
-                    
-                    if (json->error) {
+    // Separator of first fragment is replaced by body start and body end
+    body_size += (sizeof(body_start) - 1) + (sizeof(body_end) - 1) - 1;
+    
+    char http_headers[80];
+    const int http_headers_size = snprintf(http_headers, sizeof(http_headers),
+        "EVENT/1.0 200 OK\r\n"
+        "Content-Type: application/hap+json\r\n"
+        "Content-Length: %u\r\n\r\n", body_size);
+    
+    int r = client_send_buffered(context, (const byte*) http_headers, http_headers_size);
+    if (r == 0) {
+        r = client_send_buffered(context, body_start, sizeof(body_start) - 1);
+    }
+    
+    bool first = true;
+    for (notification_t *notification = batch; notification != batch_end && r == 0; notification++) {
+        if (notification->json_size && homekit_characteristic_has_notify_subscription(notification->ch, context->slot)) {
+            if (!first) {
+                r = client_send_buffered(context, (const byte*) ",", 1);
+            }
+            
+            if (r == 0) {
+                r = client_send_buffered(context, homekit_server->data + notification->json_offset, notification->json_size);
+            }
+            
+            first = false;
+        }
+    }
+    
+    if (r == 0) {
+        r = client_send_buffered(context, body_end, sizeof(body_end) - 1);
+    }
+    
+    if (r == 0) {
+        r = client_send_buffered_flush(context);
+    } else {
+        homekit_server->send_pos = 0;
+    }
+    
+    return r;
+}
+
+static void IRAM homekit_server_send_notifications(notification_t *notifications, notification_t *notifications_end, client_context_t *only);
+
+static inline void IRAM homekit_server_process_notifications(notifications_queue_t *queue) {
+    notification_t *notifications = homekit_server->notifications_sending;
+    
+    HOMEKIT_STATS_START(stats_start);
+    
+    // Take pending notifications; values notified from now on are queued again
+    taskENTER_CRITICAL();
+    
+    const uint16_t count = queue->count;
+    for (uint16_t i = 0; i < count; i++) {
+        homekit_characteristic_t *ch = queue->chs[(queue->head + i) % HOMEKIT_NOTIFICATIONS_QUEUE_SIZE];
+        ch->notify_pending = false;
+        notifications[i].ch = ch;
+    }
+    queue->head = 0;
+    queue->count = 0;
+    
+    const uint32_t overflow = homekit_server->notifications_overflow;
+    
+    taskEXIT_CRITICAL();
+    
+    if (overflow != homekit_server->notifications_overflow_logged) {
+        homekit_server->notifications_overflow_logged = overflow;
+        HOMEKIT_ERROR("Ev queue full, dropped %u", overflow);
+    }
+    
+    homekit_server_send_notifications(notifications, notifications + count, NULL);
+    
+    HOMEKIT_STATS_END(HOMEKIT_STATS_EVENTS, stats_start);
+}
+
+// Sends latest values of characteristics whose events were dropped while client was slow,
+// coalesced. Characteristics not fitting in one pass are sent when client catches up again
+static void IRAM homekit_server_send_pending_events(client_context_t *context) {
+    notification_t *notifications = homekit_server->notifications_sending;
+    const uint32_t slot_mask = 1UL << context->slot;
+    unsigned int count = 0;
+    
+    HOMEKIT_STATS_START(stats_start);
+    
+    context->events_pending = false;
+    
+    for (homekit_accessory_t **accessory_it = homekit_server->config->accessories; *accessory_it; accessory_it++) {
+        for (homekit_service_t **service_it = (*accessory_it)->services; *service_it; service_it++) {
+            for (homekit_characteristic_t **ch_it = (*service_it)->characteristics; *ch_it; ch_it++) {
+                homekit_characteristic_t *ch = *ch_it;
+                if (ch->events_pending & slot_mask) {
+                    if (count == HOMEKIT_NOTIFICATIONS_QUEUE_SIZE) {
+                        context->events_pending = true;
                         break;
                     }
                     
-                    notification = notification->next;
+                    ch->events_pending &= ~slot_mask;
+                    notifications[count++].ch = ch;
+                }
+            }
+        }
+    }
+    
+    CLIENT_INFO(context, "Send %u pending Ev", count);
+    homekit_server_send_notifications(notifications, notifications + count, context);
+    
+    HOMEKIT_STATS_END(HOMEKIT_STATS_EVENTS, stats_start);
+}
+
+// Marks subscribed characteristics of a batch to be sent when client catches up
+static void client_events_defer(client_context_t *context, notification_t *batch, notification_t *batch_end) {
+    for (notification_t *notification = batch; notification != batch_end; notification++) {
+        if (notification->json_size && homekit_characteristic_has_notify_subscription(notification->ch, context->slot)) {
+            notification->ch->events_pending |= (1UL << context->slot);
+        }
+    }
+    
+    context->events_pending = true;
+}
+
+// Renders each notified characteristic once per batch, and sends every client, or only
+// given one, the characteristics it is subscribed to
+static void IRAM homekit_server_send_notifications(notification_t *notifications, notification_t *notifications_end, client_context_t *only) {
+    json_stream json;
+    json.buffer = homekit_server->data;
+    json.size = BUFFER_DATA_SIZE;
+    json.on_flush = homekit_event_json_overflow;
+    
+    notification_t *batch = notifications;
+    while (batch != notifications_end) {
+        // Render each notified characteristic only once, into shared buffer
+        json_init(&json, NULL);
+        json_array_start(&json);
+        
+        notification_t *notification = batch;
+        while (notification != notifications_end) {
+            size_t json_offset = json.pos;
+            
+            json_object_start(&json);
+            write_characteristic_json(&json, NULL, notification->ch, 0, &notification->ch->value);
+            json_object_end(&json);
+            
+            if (json.error) {
+                break;
+            }
+            
+            if (notification != batch) {
+                // Skip array separator
+                json_offset++;
+            }
+            
+            notification->json_offset = json_offset;
+            notification->json_size = json.pos - json_offset;
+            
+            notification++;
+        }
+        
+        if (notification == batch) {
+            HOMEKIT_ERROR("Ev too large");
+            notification->json_size = 0;
+            notification++;
+        }
+        
+        notification_t *batch_end = notification;
+        
+        // Each client only gets subscribed characteristics
+        client_context_t *context = only ? only : homekit_server->clients;
+        while (context) {
+            size_t body_size = 0;
+            for (notification = batch; notification != batch_end; notification++) {
+                if (notification->json_size && homekit_characteristic_has_notify_subscription(notification->ch, context->slot)) {
+                    body_size += notification->json_size + 1;
                 }
+            }
+            
+            if (body_size > 0 && (context->job || context->send_queue_size > 0)) {
+                // Sends to a client waiting for crypto worker are captured as its response,
+                // and a slow client would queue every event. Latest values are sent later
+                CLIENT_DEBUG(context, "Slow, Ev deferred");
+                client_events_defer(context, batch, batch_end);
+                HOMEKIT_STATS_ADD(events_deferred, 1);
                 
-                json_array_end(json);
-                json_object_end(json);
+            } else if (body_size > 0) {
+                CLIENT_INFO(context, "Send Ev");
+                DEBUG_HEAP();
                 
-                json_flush(json);
+                homekit_server->sending_event = true;
+                const int r = homekit_server_send_event(context, batch, batch_end, body_size);
+                homekit_server->sending_event = false;
                 
-                if (json->error) {
-                    CLIENT_ERROR(context, "JSON");
+                if (r < 0) {
+                    CLIENT_ERROR(context, "Event");
                     homekit_disconnect_client(context);
                 } else {
-                    client_send_chunk(NULL, 0, context);
+                    HOMEKIT_STATS_ADD(events_sent, 1);
                 }
-                
-                break;
             }
-
-            notification = notification->next;
+            
+            context = only ? NULL : context->next;
         }
         
-        context = context->next;
-    }
-    
-    // Remove sent notifications
-    while (notifications) {
-        notification_t* notification_old = notifications;
-        notifications = notifications->next;
-        free(notification_old);
+        batch = batch_end;
     }
 }
 
@@ -3452,6 +5116,9 @@ static inline void IRAM homekit_server_close_clients() {
         homekit_server->pending_close = false;
         
         int max_fd = homekit_server->listen_fd;
+        if (homekit_server->wakeup_fd > max_fd) {
+            max_fd = homekit_server->wakeup_fd;
+        }
 
         client_context_t head;
         head.next = homekit_server->clients;
@@ -3460,10 +5127,15 @@ static inline void IRAM homekit_server_close_clients() {
         while (context->next) {
             client_context_t *tmp = context->next;
 
-            if (tmp->disconnect) {
+            if (tmp->disconnect && !client_in_job(tmp)) {
                 context->next = tmp->next;
                 homekit_server_close_client(tmp);
             } else {
+                if (tmp->disconnect) {
+                    // Closed after crypto worker is done
+                    homekit_server->pending_close = true;
+                }
+                
                 if (tmp->socket > max_fd)
                     max_fd = tmp->socket;
 
@@ -3476,11 +5148,59 @@ static inline void IRAM homekit_server_close_clients() {
     }
 }
 
+// Adds clients with queued data to write_fds, and disconnects stalled ones
+static inline bool IRAM homekit_server_send_queues_fds(fd_set *write_fds) {
+    bool sending = false;
+    const TickType_t now = xTaskGetTickCount();
+    
+    FD_ZERO(write_fds);
+    
+    client_context_t *context = homekit_server->clients;
+    while (context) {
+        if (context->send_queue_size > 0 && !context->disconnect) {
+            if (now - context->send_progress > HOMEKIT_CLIENT_SEND_TIMEOUT / portTICK_PERIOD_MS &&
+                !client_in_job(context)) {
+                CLIENT_ERROR(context, "Slow, %d bytes queued. Closing", context->send_queue_size);
+                homekit_disconnect_client(context);
+            } else {
+                FD_SET(context->socket, write_fds);
+                sending = true;
+            }
+        }
+        
+        context = context->next;
+    }
+    
+    return sending;
+}
+
 static void IRAM homekit_run_server() {
     HOMEKIT_DEBUG_LOG("Starting HTTP server");
     
+    homekit_server->budget = HOMEKIT_HEAP_BUDGET;
+    if (homekit_server->budget == 0) {
+        const uint32_t free_heap = xPortGetFreeHeapSize();
+        if (free_heap > HOMEKIT_NETWORK_MIN_FREEHEAP) {
+            homekit_server->budget = free_heap - HOMEKIT_NETWORK_MIN_FREEHEAP;
+        }
+    }
+    homekit_budget_log();
+    
+    homekit_server->client_heap_cost = BUDGET_CLIENT;
+    homekit_server->max_clients = homekit_server->config->max_clients;
+    
+#if HOMEKIT_CRYPTO_WORKER
+    // Without it, crypto jobs are dispatched by server loop
+    homekit_server->job_call_done = xSemaphoreCreateBinary();
+#endif
+    
     struct sockaddr_in serv_addr;
     homekit_server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+#ifdef HOMEKIT_POSIX
+    // Host programs run one after another on same port
+    const int reuse_addr = 1;
+    setsockopt(homekit_server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+#endif
     memset(&serv_addr, '0', sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -3502,15 +5222,89 @@ static void IRAM homekit_run_server() {
     FD_SET(homekit_server->listen_fd, &homekit_server->fds);
     homekit_server->max_fd = homekit_server->listen_fd;
     
-    struct timeval timeout = { 0, 80000 }; /* 0.08 seconds timeout (orig: 1s) */
+#if LWIP_NETIF_LOOPBACK
+    // Loopback UDP socket connected to itself, used by homekit_server_wakeup()
+    int wakeup_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (wakeup_fd >= 0) {
+        struct sockaddr_in wakeup_addr;
+        socklen_t wakeup_addr_len = sizeof(wakeup_addr);
+        memset(&wakeup_addr, 0, sizeof(wakeup_addr));
+        wakeup_addr.sin_family = AF_INET;
+        wakeup_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        wakeup_addr.sin_port = 0;
+        
+        if (bind(wakeup_fd, (struct sockaddr*) &wakeup_addr, sizeof(wakeup_addr)) == 0 &&
+            getsockname(wakeup_fd, (struct sockaddr*) &wakeup_addr, &wakeup_addr_len) == 0 &&
+            connect(wakeup_fd, (struct sockaddr*) &wakeup_addr, wakeup_addr_len) == 0) {
+            FD_SET(wakeup_fd, &homekit_server->fds);
+            if (wakeup_fd > homekit_server->max_fd) {
+                homekit_server->max_fd = wakeup_fd;
+            }
+            
+            homekit_server->wakeup_fd = wakeup_fd;
+        } else {
+            HOMEKIT_ERROR("Wakeup socket");
+            close(wakeup_fd);
+        }
+    }
+#endif
+    
+#if HOMEKIT_CURVE25519_POOL_SIZE > 0
+    if (homekit_server->paired) {
+        curve25519_pool_fill();
+    }
+#endif
+    
     int triggered_nfds;
     fd_set read_fds;
+    fd_set write_fds;
+    
+#ifdef HOMEKIT_STATS
+    TickType_t stats_logged = xTaskGetTickCount();
+#endif
     
     for (;;) {
+        const bool sending = homekit_server_send_queues_fds(&write_fds);
+        homekit_server_close_clients();
+        
         memcpy(&read_fds, &homekit_server->fds, sizeof(read_fds));
         
-        triggered_nfds = select(homekit_server->max_fd + 1, &read_fds, NULL, NULL, &timeout);
+        // Clients waiting for crypto worker are read when it is done, and clients
+        // with queued data when their queue is sent
+        for (client_context_t *context = homekit_server->clients; context; context = context->next) {
+            if (context->job || context->send_queue_size > 0) {
+                FD_CLR(context->socket, &read_fds);
+            }
+        }
+        
+        struct timeval timeout = { HOMEKIT_SERVER_SELECT_TIMEOUT / 1000, (HOMEKIT_SERVER_SELECT_TIMEOUT % 1000) * 1000 };
+        if (homekit_server->wakeup_fd < 0) {
+            // No wakeup available
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 80000;
+        } else if (homekit_server->telemetry.count > 0) {
+            // Woken up when telemetry batch is due
+            const uint32_t elapsed = (xTaskGetTickCount() - homekit_server->telemetry_sent) * portTICK_PERIOD_MS;
+            const uint32_t due = (elapsed < HOMEKIT_TELEMETRY_PERIOD) ? HOMEKIT_TELEMETRY_PERIOD - elapsed : 0;
+            if (due < HOMEKIT_SERVER_SELECT_TIMEOUT) {
+                timeout.tv_sec = due / 1000;
+                timeout.tv_usec = (due % 1000) * 1000;
+            }
+        }
+        
+        triggered_nfds = select(homekit_server->max_fd + 1, &read_fds, sending ? &write_fds : NULL, NULL, &timeout);
+        
+        // Time until next select() is loop stall seen by all clients
+        HOMEKIT_STATS_START(stats_start);
+        
         if (triggered_nfds > 0) {
+            if (homekit_server->wakeup_fd >= 0 && FD_ISSET(homekit_server->wakeup_fd, &read_fds)) {
+                byte signal[4];
+                while (recv(homekit_server->wakeup_fd, signal, sizeof(signal), MSG_DONTWAIT) > 0);
+                homekit_server->wakeup_pending = false;
+                triggered_nfds--;
+            }
+            
             if (FD_ISSET(homekit_server->listen_fd, &read_fds)) {
                 homekit_server_accept_client();
                 triggered_nfds--;
@@ -3523,19 +5317,56 @@ static void IRAM homekit_run_server() {
                     triggered_nfds--;
                 }
                 
+                if (sending && FD_ISSET(context->socket, &write_fds)) {
+                    if (context->send_queue_size > 0 && !context->disconnect) {
+                        client_send_queue_drain(context);
+                    }
+                    triggered_nfds--;
+                }
+                
                 context = context->next;
             }
             
             if (homekit_low_dram()) {
-                homekit_remove_oldest_client();
+                accessories_cache_free();
+                homekit_evict_client();
             }
-            
-            homekit_server_close_clients();
         }
         
-        if (homekit_server->notifications) {
-            homekit_server_process_notifications();
+#if HOMEKIT_CRYPTO_WORKER
+        crypto_jobs_run();
+#endif
+        
+        homekit_server_close_clients();
+        
+        // Interactive events first, in their own frames
+        if (homekit_server->notifications.count > 0) {
+            homekit_server_process_notifications(&homekit_server->notifications);
+        }
+        
+        if (homekit_server->telemetry.count > 0) {
+            const TickType_t now = xTaskGetTickCount();
+            if (homekit_server->telemetry.count >= HOMEKIT_TELEMETRY_BATCH ||
+                now - homekit_server->telemetry_sent >= HOMEKIT_TELEMETRY_PERIOD / portTICK_PERIOD_MS) {
+                homekit_server->telemetry_sent = now;
+                homekit_server_process_notifications(&homekit_server->telemetry);
+            }
+        }
+        
+        for (client_context_t *context = homekit_server->clients; context; context = context->next) {
+            if (context->events_pending && context->send_queue_size == 0 && !context->job && !context->disconnect) {
+                homekit_server_send_pending_events(context);
+            }
         }
+        
+        HOMEKIT_STATS_END(HOMEKIT_STATS_LOOP, stats_start);
+        
+#ifdef HOMEKIT_STATS
+        if (xTaskGetTickCount() - stats_logged >= HOMEKIT_STATS_LOG_PERIOD / portTICK_PERIOD_MS) {
+            stats_logged = xTaskGetTickCount();
+            homekit_stats_log();
+        }
+#endif
     }
     
     //server_free();
@@ -3744,10 +5575,12 @@ void homekit_server_init(homekit_server_config_t *config) {
 }
 
 void homekit_server_reset() {
+    resume_sessions_remove(-1);
     homekit_storage_reset();
 }
 
 void homekit_remove_extra_pairing(const int last_keep) {
+    resume_sessions_remove(-1);
     homekit_storage_remove_extra_pairing(last_keep);
 }
 
@@ -0,0 +1,78 @@
+#ifdef HOMEKIT_STATS
+
+#include <stdio.h>
+#include <string.h>
+#include <homekit/homekit.h>
+#include <homekit/characteristics.h>
+#include "debug.h"
+#include "stats.h"
+
+
+homekit_stats_t homekit_stats;
+
+static const char *homekit_stats_names[HOMEKIT_STATS_SECTIONS] = {
+    "unknown", "pair-setup", "pair-verify", "identify", "accessories",
+    "ch-get", "ch-put", "pairings", "prepare", "resource",
+    "events", "encrypt", "decrypt", "loop",
+};
+
+void homekit_stats_section(const uint8_t section, const uint32_t cycles) {
+    homekit_stats_section_t *s = &homekit_stats.sections[section];
+    
+    s->count++;
+    s->total += cycles;
+    if (cycles > s->max) {
+        s->max = cycles;
+    }
+    
+    int bucket = cycles ? (32 - __builtin_clz(cycles)) - HOMEKIT_STATS_BUCKET_MIN_BITS : 0;
+    if (bucket < 0) {
+        bucket = 0;
+    } else if (bucket >= HOMEKIT_STATS_BUCKETS) {
+        bucket = HOMEKIT_STATS_BUCKETS - 1;
+    }
+    s->histogram[bucket]++;
+}
+
+void homekit_stats_log() {
+    INFO("HK stats enc %u, dec %u, ev %u, ev deferred %u",
+        homekit_stats.bytes_encrypted, homekit_stats.bytes_decrypted,
+        homekit_stats.events_sent, homekit_stats.events_deferred);
+    
+    for (uint8_t i = 0; i < HOMEKIT_STATS_SECTIONS; i++) {
+        const homekit_stats_section_t *s = &homekit_stats.sections[i];
+        if (s->count == 0) {
+            continue;
+        }
+        
+        char histogram[HOMEKIT_STATS_BUCKETS * 11 + 1];
+        int pos = 0;
+        for (uint8_t j = 0; j < HOMEKIT_STATS_BUCKETS; j++) {
+            pos += snprintf(histogram + pos, sizeof(histogram) - pos, " %u", s->histogram[j]);
+        }
+        
+        INFO("HK stats %s n %u, avg %u, max %u cycles,%s",
+            homekit_stats_names[i], s->count, (uint32_t) (s->total / s->count), s->max, histogram);
+    }
+}
+
+// Each section with samples as "name:count/avg/max" in kilocycles
+homekit_value_t homekit_stats_getter(const homekit_characteristic_t *ch) {
+    char buffer[HOMEKIT_STATS_VALUE_MAX_LEN + 1];
+    int pos = snprintf(buffer, sizeof(buffer), "enc:%u;dec:%u;ev:%u/%u",
+        homekit_stats.bytes_encrypted, homekit_stats.bytes_decrypted,
+        homekit_stats.events_sent, homekit_stats.events_deferred);
+    
+    for (uint8_t i = 0; i < HOMEKIT_STATS_SECTIONS && pos < sizeof(buffer); i++) {
+        const homekit_stats_section_t *s = &homekit_stats.sections[i];
+        if (s->count > 0) {
+            pos += snprintf(buffer + pos, sizeof(buffer) - pos, ";%s:%u/%u/%u",
+                homekit_stats_names[i], s->count,
+                (uint32_t) (s->total / s->count / 1000), s->max / 1000);
+        }
+    }
+    
+    return HOMEKIT_STRING(strdup(buffer));
+}
+
+#endif // HOMEKIT_STATS
@@ -0,0 +1,78 @@
+#ifndef __HOMEKIT_STATS__
+#define __HOMEKIT_STATS__
+
+#include <stdint.h>
+
+// Server instrumentation, enabled by HOMEKIT_STATS. When disabled,
+// macros below are empty and nothing is compiled
+
+// Timed sections. Endpoints use HOMEKIT_ENDPOINT_* ids of server.c
+#define HOMEKIT_STATS_EVENTS        (10)
+#define HOMEKIT_STATS_ENCRYPT       (11)
+#define HOMEKIT_STATS_DECRYPT       (12)
+#define HOMEKIT_STATS_LOOP          (13)
+#define HOMEKIT_STATS_SECTIONS      (14)
+
+// Histogram bucket i counts sections taking less than 2^(HOMEKIT_STATS_BUCKET_MIN_BITS + i) cycles.
+// Last bucket counts all longer ones
+#define HOMEKIT_STATS_BUCKETS           (12)
+#define HOMEKIT_STATS_BUCKET_MIN_BITS   (14)
+
+#ifdef HOMEKIT_STATS
+
+typedef struct {
+    uint32_t count;
+    uint32_t max;
+    uint64_t total;
+    uint32_t histogram[HOMEKIT_STATS_BUCKETS];
+} homekit_stats_section_t;
+
+typedef struct {
+    homekit_stats_section_t sections[HOMEKIT_STATS_SECTIONS];
+    uint32_t bytes_encrypted;
+    uint32_t bytes_decrypted;
+    uint32_t events_sent;
+    uint32_t events_deferred;
+} homekit_stats_t;
+
+extern homekit_stats_t homekit_stats;
+
+#ifdef HOMEKIT_POSIX
+
+#include <time.h>
+
+// Nanoseconds on host
+static inline uint32_t homekit_stats_cycles() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#else
+
+static inline uint32_t homekit_stats_cycles() {
+    uint32_t ccount;
+    __asm__ __volatile__("rsr %0, ccount" : "=a" (ccount));
+    return ccount;
+}
+
+#endif
+
+void homekit_stats_section(const uint8_t section, const uint32_t cycles);
+
+// Prints all statistics through logger
+void homekit_stats_log();
+
+#define HOMEKIT_STATS_START(start)              const uint32_t start = homekit_stats_cycles()
+#define HOMEKIT_STATS_END(section, start)       homekit_stats_section((section), homekit_stats_cycles() - (start))
+#define HOMEKIT_STATS_ADD(counter, value)       homekit_stats.counter += (value)
+
+#else
+
+#define HOMEKIT_STATS_START(start)
+#define HOMEKIT_STATS_END(section, start)
+#define HOMEKIT_STATS_ADD(counter, value)
+
+#endif // HOMEKIT_STATS
+
+#endif // __HOMEKIT_STATS__
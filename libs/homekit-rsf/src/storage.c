@@ -1,5 +1,14 @@
 #include <string.h>
 #include <ctype.h>
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#else
+#include <FreeRTOS.h>
+#include <semphr.h>
+#endif
+
 #include "debug.h"
 #include "crypto.h"
 #include "pairing.h"
@@ -26,8 +35,30 @@
 
 const char magic1[] = "HAP";
 
+static void pairing_cache_load();
+static void pairing_cache_clear();
+static int erase_pairing(const int idx);
 
-int homekit_storage_reset() {
+// Pairing cache and records are used by server task, crypto worker and accessory tasks.
+// Created by homekit_storage_init(), before other tasks use storage
+static SemaphoreHandle_t storage_mutex = NULL;
+
+static void storage_lock() {
+    if (storage_mutex) {
+        xSemaphoreTake(storage_mutex, portMAX_DELAY);
+    }
+}
+
+static void storage_unlock() {
+    if (storage_mutex) {
+        xSemaphoreGive(storage_mutex);
+    }
+}
+
+
+static int storage_reset() {
+    pairing_cache_clear();
+    
     byte blank[2];
     memset(blank, 0, sizeof(blank));
     if (!spiflash_write(MAGIC_ADDR, blank, sizeof(blank))) {
@@ -38,8 +69,16 @@ int homekit_storage_reset() {
     return 0;
 }
 
+int homekit_storage_reset() {
+    storage_lock();
+    const int r = storage_reset();
+    storage_unlock();
+    
+    return r;
+}
+
 
-int homekit_storage_init() {
+static int storage_init() {
     char magic[sizeof(magic1)];
     memset(magic, 0, sizeof(magic));
     
@@ -59,12 +98,28 @@ int homekit_storage_init() {
             return -1;
         }
         
+        pairing_cache_clear();
+        
         return 1;
     }
     
+    pairing_cache_load();
+    
     return 0;
 }
 
+int homekit_storage_init() {
+    if (!storage_mutex) {
+        storage_mutex = xSemaphoreCreateMutex();
+    }
+    
+    storage_lock();
+    const int r = storage_init();
+    storage_unlock();
+    
+    return r;
+}
+
 
 void homekit_storage_save_accessory_id(const char *accessory_id) {
     if (!spiflash_write(ACCESSORY_ID_ADDR, (byte *)accessory_id, strlen(accessory_id))) {
@@ -143,17 +198,153 @@ typedef struct {
 } pairing_data_t;
 
 
-bool homekit_storage_can_add_pairing() {
+// RAM copy of a pairing record, indexed by its block in flash
+typedef struct {
+    uint32_t device_id_hash;
+    byte permissions;
+    char device_id[36];
+    byte device_public_key[32];
+    ed25519_key *device_key;    // Imported on first use
+} pairing_cache_t;
+
+static pairing_cache_t *pairing_cache[MAX_PAIRINGS];
+static bool pairing_cache_loaded = false;     // False if a record could not be cached
+
+
+static uint32_t device_id_hash(const char *device_id) {
+    // FNV-1a of the part of device_id stored in flash
+    uint32_t hash = 2166136261UL;
+    for (int i = 0; i < sizeof(((pairing_data_t *) 0)->device_id) && device_id[i]; i++) {
+        hash = (hash ^ (byte) device_id[i]) * 16777619UL;
+    }
+    
+    return hash;
+}
+
+static void pairing_cache_remove(const int idx) {
+    if (pairing_cache[idx]) {
+        crypto_ed25519_free(pairing_cache[idx]->device_key);
+        free(pairing_cache[idx]);
+        pairing_cache[idx] = NULL;
+    }
+}
+
+static void pairing_cache_clear() {
+    for (int i = 0; i < MAX_PAIRINGS; i++) {
+        pairing_cache_remove(i);
+    }
+    
+    pairing_cache_loaded = true;
+}
+
+static void pairing_cache_set(const int idx, const pairing_data_t *data) {
+    pairing_cache_remove(idx);
+    
+    pairing_cache_t *cache = malloc(sizeof(pairing_cache_t));
+    if (!cache) {
+        // Record would be hidden. Cache is loaded again on next access
+        ERROR("Pairing cache");
+        pairing_cache_loaded = false;
+        return;
+    }
+    
+    memcpy(cache->device_id, data->device_id, sizeof(cache->device_id));
+    memcpy(cache->device_public_key, data->device_public_key, sizeof(cache->device_public_key));
+    cache->device_id_hash = device_id_hash(data->device_id);
+    cache->permissions = data->permissions;
+    cache->device_key = NULL;
+    
+    pairing_cache[idx] = cache;
+}
+
+static int pairing_cache_find(const char *device_id, const int skip_idx) {
+    const uint32_t hash = device_id_hash(device_id);
+    for (int i = 0; i < MAX_PAIRINGS; i++) {
+        if (i != skip_idx && pairing_cache[i] && pairing_cache[i]->device_id_hash == hash &&
+            !strncmp(pairing_cache[i]->device_id, device_id, sizeof(pairing_cache[i]->device_id))) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+static void pairing_cache_load() {
+    pairing_cache_clear();
+    
     pairing_data_t data;
     for (int i = 0; i < MAX_PAIRINGS; i++) {
         spiflash_read(PAIRINGS_ADDR + sizeof(data) * i, (byte *)&data, sizeof(data));
-        if (strncmp(data.magic, magic1, sizeof(magic1))) {
+        if (!strncmp(data.magic, magic1, sizeof(magic1))) {
+            // Update interrupted before erasing old record. Records are written after used
+            // blocks, and compaction keeps their order, so old record is the first one
+            const int old_idx = pairing_cache_find(data.device_id, -1);
+            if (old_idx >= 0) {
+                INFO("Pairing update completed");
+                erase_pairing(old_idx);
+            }
+            
+            pairing_cache_set(i, &data);
+        }
+    }
+}
+
+static void pairing_cache_ensure() {
+    if (!pairing_cache_loaded) {
+        pairing_cache_load();
+    }
+}
+
+static pairing_t *pairing_cache_get(const int idx) {
+    pairing_cache_t *cache = pairing_cache[idx];
+    
+    if (!cache->device_key) {
+        ed25519_key *device_key = crypto_ed25519_new();
+        int r = crypto_ed25519_import_public_key(device_key, cache->device_public_key, sizeof(cache->device_public_key));
+        if (r) {
+            ERROR("Import dev public key (%d)", r);
+            crypto_ed25519_free(device_key);
+            return NULL;
+        }
+        
+        cache->device_key = device_key;
+    }
+    
+    pairing_t *pairing = pairing_new();
+    pairing->id = idx;
+    pairing->device_id = strndup(cache->device_id, sizeof(cache->device_id));
+    pairing->device_key = crypto_ed25519_clone(cache->device_key);
+    pairing->permissions = cache->permissions;
+    
+    if (!pairing->device_id || !pairing->device_key) {
+        ERROR("Pairing DRAM");
+        pairing_free(pairing);
+        return NULL;
+    }
+    
+    return pairing;
+}
+
+
+static bool storage_can_add_pairing() {
+    pairing_cache_ensure();
+    
+    for (int i = 0; i < MAX_PAIRINGS; i++) {
+        if (!pairing_cache[i]) {
             return true;
         }
     }
     return false;
 }
 
+bool homekit_storage_can_add_pairing() {
+    storage_lock();
+    const bool r = storage_can_add_pairing();
+    storage_unlock();
+    
+    return r;
+}
+
 static int compact_data() {
     INFO("Compacting data");
     
@@ -169,7 +360,7 @@ static int compact_data() {
         pairing_data_t *pairing_data = (pairing_data_t *)&data[PAIRINGS_OFFSET + sizeof(pairing_data_t) * i];
         if (!strncmp(pairing_data->magic, magic1, sizeof(magic1))) {
             if (i != next_pairing_idx) {
-                memcpy(&data[PAIRINGS_ADDR + sizeof(pairing_data_t) * next_pairing_idx],
+                memcpy(&data[PAIRINGS_OFFSET + sizeof(pairing_data_t) * next_pairing_idx],
                        pairing_data, sizeof(*pairing_data));
             }
             next_pairing_idx++;
@@ -178,15 +369,16 @@ static int compact_data() {
 
     if (next_pairing_idx == MAX_PAIRINGS) {
         // We are full, no compaction possible, do not waste flash erase cycle
+        free(data);
         return 0;
     }
 
-    if (homekit_storage_reset() != 0) {
+    if (storage_reset() != 0) {
         ERROR("Compact resetting");
         free(data);
         return -1;
     }
-    if (homekit_storage_init() < 0) {
+    if (storage_init() < 0) {
         ERROR("Compact initializing");
         free(data);
         return -1;
@@ -199,6 +391,10 @@ static int compact_data() {
     }
 
     free(data);
+    
+    // Pairings are in new blocks
+    pairing_cache_load();
+    
     return 0;
 }
 
@@ -206,6 +402,10 @@ static int find_empty_block() {
     byte data[sizeof(pairing_data_t)];
 
     for (unsigned int i = 0; i < MAX_PAIRINGS; i++) {
+        if (pairing_cache[i]) {
+            continue;
+        }
+        
         spiflash_read(PAIRINGS_ADDR + sizeof(data) * i, data, sizeof(data));
 
         bool block_empty = true;
@@ -223,7 +423,8 @@ static int find_empty_block() {
     return -1;
 }
 
-int homekit_storage_add_pairing(const char *device_id, const ed25519_key *device_key, byte permissions) {
+// Returns block index of written record
+static int write_pairing(const pairing_data_t *data) {
     int next_block_idx = find_empty_block();
     if (next_block_idx == -1) {
         compact_data();
@@ -235,6 +436,30 @@ int homekit_storage_add_pairing(const char *device_id, const ed25519_key *device
         return -2;
     }
 
+    if (!spiflash_write(PAIRINGS_ADDR + sizeof(*data) * next_block_idx, (byte *)data, sizeof(*data))) {
+        ERROR("Write pairing");
+        return -1;
+    }
+
+    pairing_cache_set(next_block_idx, data);
+
+    return next_block_idx;
+}
+
+static int erase_pairing(const int idx) {
+    pairing_data_t data;
+    memset(&data, 0, sizeof(data));
+    
+    pairing_cache_remove(idx);
+    
+    if (!spiflash_write(PAIRINGS_ADDR + sizeof(data) * idx, (byte *)&data, sizeof(data))) {
+        return -2;
+    }
+    
+    return 0;
+}
+
+static int storage_add_pairing(const char *device_id, const ed25519_key *device_key, byte permissions) {
     pairing_data_t data;
 
     memset(&data, 0, sizeof(data));
@@ -249,106 +474,127 @@ int homekit_storage_add_pairing(const char *device_id, const ed25519_key *device
         ERROR("Export dev public key (%d)", r);
         return -1;
     }
-
-    if (!spiflash_write(PAIRINGS_ADDR + sizeof(data)*next_block_idx, (byte *)&data, sizeof(data))) {
-        ERROR("Write pairing");
-        return -1;
+    
+    pairing_cache_ensure();
+    
+    r = write_pairing(&data);
+    if (r < 0) {
+        return r;
     }
-
+    
     return 0;
 }
 
+int homekit_storage_add_pairing(const char *device_id, const ed25519_key *device_key, byte permissions) {
+    storage_lock();
+    const int r = storage_add_pairing(device_id, device_key, permissions);
+    storage_unlock();
+    
+    return r;
+}
 
-int homekit_storage_update_pairing(const char *device_id, byte permissions) {
-    pairing_data_t data;
-    for (int i = 0; i < MAX_PAIRINGS; i++) {
-        spiflash_read(PAIRINGS_ADDR + sizeof(data) * i, (byte *)&data, sizeof(data));
-        if (strncmp(data.magic, magic1, sizeof(magic1)))
-            continue;
-
-        if (!strncmp(data.device_id, device_id, sizeof(data.device_id))) {
-            int r;
-
-            ed25519_key *device_key = crypto_ed25519_new();
-            r = crypto_ed25519_import_public_key(device_key, data.device_public_key, sizeof(data.device_public_key));
-            if (r) {
-                ERROR("Import dev public key (%d)", r);
-                crypto_ed25519_free(device_key);
-                return -2;
-            }
-
-            if (memcmp(device_key, data.device_public_key, sizeof(data.device_public_key)) != 0) {
-                r = homekit_storage_add_pairing(data.device_id, device_key, permissions);
-                crypto_ed25519_free(device_key);
-                if (r) {
-                    return -2;
-                }
-
-                memset(&data, 0, sizeof(data));
-                if (!spiflash_write(PAIRINGS_ADDR + sizeof(data) * i, (byte *)&data, sizeof(data))) {
-                    ERROR("Update pairing: erasing old");
-                    return -2;
-                }
-            } else {
-                INFO("Device Public Key not needing updated");
-            }
 
-            return 0;
-        }
+static int storage_update_pairing(const char *device_id, byte permissions) {
+    pairing_cache_ensure();
+    
+    int idx = pairing_cache_find(device_id, -1);
+    if (idx < 0) {
+        return -1;
     }
     
-    return -1;
+    if (pairing_cache[idx]->permissions == permissions) {
+        INFO("Pairing not needing updated");
+        return 0;
+    }
+    
+    // Flash record can not be rewritten in place. New record is written before old one is
+    // erased, so pairing is kept if writing fails or power is lost
+    pairing_data_t data;
+    memset(&data, 0, sizeof(data));
+    strncpy(data.magic, magic1, sizeof(magic1));
+    data.permissions = permissions;
+    memcpy(data.device_id, pairing_cache[idx]->device_id, sizeof(data.device_id));
+    memcpy(data.device_public_key, pairing_cache[idx]->device_public_key, sizeof(data.device_public_key));
+    
+    const int new_idx = write_pairing(&data);
+    if (new_idx < 0) {
+        return -2;
+    }
+    
+    // Compaction moves old record, and failed cache set reloads cache
+    pairing_cache_ensure();
+    
+    idx = pairing_cache_find(device_id, new_idx);
+    if (idx >= 0 && erase_pairing(idx)) {
+        ERROR("Update pairing: erasing old");
+        return -2;
+    }
+    
+    return 0;
 }
 
+int homekit_storage_update_pairing(const char *device_id, byte permissions) {
+    storage_lock();
+    const int r = storage_update_pairing(device_id, permissions);
+    storage_unlock();
+    
+    return r;
+}
 
-int homekit_storage_remove_pairing(const char *device_id) {
-    pairing_data_t data;
-    for (int i = 0; i<MAX_PAIRINGS; i++) {
-        spiflash_read(PAIRINGS_ADDR + sizeof(data) * i, (byte *)&data, sizeof(data));
-        if (strncmp(data.magic, magic1, sizeof(magic1)))
-            continue;
-
-        if (!strncmp(data.device_id, device_id, sizeof(data.device_id))) {
-            memset(&data, 0, sizeof(data));
-            if (!spiflash_write(PAIRINGS_ADDR + sizeof(data) * i, (byte *)&data, sizeof(data))) {
-                ERROR("Remove pairing");
-                return -2;
-            }
 
-            return 0;
-        }
+static int storage_remove_pairing(const char *device_id) {
+    pairing_cache_ensure();
+    
+    const int idx = pairing_cache_find(device_id, -1);
+    if (idx >= 0 && erase_pairing(idx)) {
+        ERROR("Remove pairing");
+        return -2;
     }
     
     return 0;
 }
 
-int homekit_storage_pairing_count() {
-    pairing_data_t data;
+int homekit_storage_remove_pairing(const char *device_id) {
+    storage_lock();
+    const int r = storage_remove_pairing(device_id);
+    storage_unlock();
+    
+    return r;
+}
+
+static int storage_pairing_count() {
+    pairing_cache_ensure();
+    
     int count = 0;
     for (int i = 0; i < MAX_PAIRINGS; i++) {
-        spiflash_read(PAIRINGS_ADDR + sizeof(data) * i, (byte *)&data, sizeof(data));
-        if (strncmp(data.magic, magic1, sizeof(magic1)))
-            continue;
-        
-        count++;
+        if (pairing_cache[i]) {
+            count++;
+        }
     }
     
     return count;
 }
 
-int homekit_storage_remove_extra_pairing(const int last_keep) {
-    pairing_data_t data;
+int homekit_storage_pairing_count() {
+    storage_lock();
+    const int r = storage_pairing_count();
+    storage_unlock();
+    
+    return r;
+}
+
+static int storage_remove_extra_pairing(const int last_keep) {
+    pairing_cache_ensure();
+    
     int count = 0;
     for (int i = 0; i < MAX_PAIRINGS; i++) {
-        spiflash_read(PAIRINGS_ADDR + sizeof(data) * i, (byte *)&data, sizeof(data));
-        if (strncmp(data.magic, magic1, sizeof(magic1)))
+        if (!pairing_cache[i])
             continue;
         
         count++;
         
         if (count > last_keep) {
-            memset(&data, 0, sizeof(data));
-            if (!spiflash_write(PAIRINGS_ADDR + sizeof(data) * i, (byte *)&data, sizeof(data))) {
+            if (erase_pairing(i)) {
                 ERROR("Remove pairing");
                 return -2;
             }
@@ -358,33 +604,32 @@ int homekit_storage_remove_extra_pairing(const int last_keep) {
     return 0;
 }
 
+int homekit_storage_remove_extra_pairing(const int last_keep) {
+    storage_lock();
+    const int r = storage_remove_extra_pairing(last_keep);
+    storage_unlock();
+    
+    return r;
+}
 
-pairing_t *homekit_storage_find_pairing(const char *device_id) {
-    pairing_data_t data;
-    for (int i = 0; i < MAX_PAIRINGS; i++) {
-        spiflash_read(PAIRINGS_ADDR + sizeof(data) * i, (byte *)&data, sizeof(data));
-        if (strncmp(data.magic, magic1, sizeof(magic1)))
-            continue;
-
-        if (!strncmp(data.device_id, device_id, sizeof(data.device_id))) {
-            ed25519_key *device_key = crypto_ed25519_new();
-            int r = crypto_ed25519_import_public_key(device_key, data.device_public_key, sizeof(data.device_public_key));
-            if (r) {
-                ERROR("Import dev public key (%d)", r);
-                return NULL;
-            }
-
-            pairing_t *pairing = pairing_new();
-            pairing->id = i;
-            pairing->device_id = strndup(data.device_id, sizeof(data.device_id));
-            pairing->device_key = device_key;
-            pairing->permissions = data.permissions;
 
-            return pairing;
-        }
+static pairing_t *storage_find_pairing(const char *device_id) {
+    pairing_cache_ensure();
+    
+    const int idx = pairing_cache_find(device_id, -1);
+    if (idx < 0) {
+        return NULL;
     }
+    
+    return pairing_cache_get(idx);
+}
 
-    return NULL;
+pairing_t *homekit_storage_find_pairing(const char *device_id) {
+    storage_lock();
+    pairing_t *r = storage_find_pairing(device_id);
+    storage_unlock();
+    
+    return r;
 }
 
 
@@ -405,32 +650,27 @@ void homekit_storage_pairing_iterator_free(pairing_iterator_t *iterator) {
 }
 
 
-pairing_t *homekit_storage_next_pairing(pairing_iterator_t *it) {
-    pairing_data_t data;
+static pairing_t *storage_next_pairing(pairing_iterator_t *it) {
+    pairing_cache_ensure();
+    
     while(it->idx < MAX_PAIRINGS) {
         int id = it->idx++;
 
-        spiflash_read(PAIRINGS_ADDR + sizeof(data) * id, (byte *)&data, sizeof(data));
-        if (!strncmp(data.magic, magic1, sizeof(magic1))) {
-            ed25519_key *device_key = crypto_ed25519_new();
-            int r = crypto_ed25519_import_public_key(device_key, data.device_public_key, sizeof(data.device_public_key));
-            if (r) {
-                ERROR("Import dev public key (%d)", r);
-                crypto_ed25519_free(device_key);
-                it->idx++;
-                continue;
+        if (pairing_cache[id]) {
+            pairing_t *pairing = pairing_cache_get(id);
+            if (pairing) {
+                return pairing;
             }
-
-            pairing_t *pairing = pairing_new();
-            pairing->id = id;
-            pairing->device_id = strndup(data.device_id, sizeof(data.device_id));
-            pairing->device_key = device_key;
-            pairing->permissions = data.permissions;
-
-            return pairing;
         }
     }
 
     return NULL;
 }
 
+pairing_t *homekit_storage_next_pairing(pairing_iterator_t *it) {
+    storage_lock();
+    pairing_t *r = storage_next_pairing(it);
+    storage_unlock();
+    
+    return r;
+}